@@ -0,0 +1,994 @@
+#define RUN2_NO_MAIN
+#include "run2.c"
+
+#include <time.h>
+#include <math.h>
+
+// Benchmark suite. For every dataset size and key pattern it builds a tree of
+// synthetic records and measures throughput and p50/p99/p999 latency of
+// insert, search, search_batch, range scans, range statistics (range_aggregate),
+// the same ranges by atomic mass (mass_range), range scans repeated from a
+// small hot set through the result cache (range_cached), rank() followed by
+// select_element(), and delete. Per size it also
+// times bulk_load(), snapshots, concurrent readers running against one
+// writer that keeps inserting and deleting keys between theirs, and purging
+// half the records with delete(), delete_range() and deferred deletes plus
+// compaction, delta loads through insert() and insert_batch(), scans in
+// copy-on-write views against a concurrent writer, full listings through
+// parallel_scan() and text file loads through initialize_tree_from_file(),
+// both on a growing number of threads, and prefix and fuzzy name lookups
+// through the name trie.
+//
+// Key patterns: sequential (ascending keys), uniform (random keys) and
+// skewed (scrambled Zipf, theta 0.99: a few hot keys spread over the key
+// space take most of the operations).
+//
+// Usage: bench [--sizes N,N,...] [--lookups N] [--threads N]
+//              [--ops OP,OP,...] [--range-width N] [--csv FILE] [--json FILE]
+//              [--stats FILE]
+//
+// --ops restricts the run to the named operations (as in the operation
+// column); make sweep uses it to compare node orders on lookup-heavy and
+// scan-heavy workloads.
+//
+// --stats FILE turns on the tree's instrumentation (see stats_enable()) for
+// the whole run, which slows the timed operations a little, and writes its
+// counters and histograms to FILE at the end.
+//
+// Results are printed as a table and optionally written as CSV and JSON,
+// tagged with the source revision and node order so runs of different
+// versions can be compared. The exit status is nonzero if any lookup of a
+// key that must be present came back empty.
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+#define MAX_SIZES 16
+#define MAX_RESULTS 1024
+#define ZIPF_THETA 0.99
+#define BATCH_SIZE 256
+
+typedef enum Pattern {
+    PATTERN_SEQUENTIAL,
+    PATTERN_UNIFORM,
+    PATTERN_SKEWED
+} Pattern;
+
+const char *pattern_names[3] = {"sequential", "uniform", "skewed"};
+
+typedef struct Result {
+    int records;
+    const char *pattern;
+    const char *operation;
+    int threads;
+    long count;
+    double seconds;
+    double p50_ns;
+    double p99_ns;
+    double p999_ns;
+} Result;
+
+Result results[MAX_RESULTS];
+int num_results = 0;
+long lookup_failures = 0;
+const char *selected_ops = NULL;
+int range_width = 100;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static unsigned long long thread_rand(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+
+static unsigned long long bench_rng_state = 88172645463325252ULL;
+
+static unsigned long long bench_rand(void) {
+    return thread_rand(&bench_rng_state);
+}
+
+
+static double bench_uniform(unsigned long long *state) {
+    return (thread_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static void shuffle(int *keys, int n) {
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)(bench_rand() % (unsigned long long)(i + 1));
+        int tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+
+// Zipf-distributed ranks in [0, n), after Gray et al., "Quickly generating
+// billion-record synthetic databases". Ranks are scrambled into keys by
+// multiplying with a constant coprime to n, so hot keys land all over the
+// tree instead of in its first leaf.
+typedef struct Zipf {
+    int n;
+    double alpha;
+    double zetan;
+    double eta;
+    double half_pow_theta;
+    unsigned long long scramble;
+} Zipf;
+
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b) {
+    while (b != 0) {
+        unsigned long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+static void zipf_init(Zipf *zipf, int n) {
+    double zeta2 = 1.0 + pow(0.5, ZIPF_THETA);
+    zipf->n = n;
+    zipf->zetan = 0;
+    for (int i = 1; i <= n; i++) {
+        zipf->zetan += 1.0 / pow(i, ZIPF_THETA);
+    }
+    zipf->alpha = 1.0 / (1.0 - ZIPF_THETA);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) / (1.0 - zeta2 / zipf->zetan);
+    zipf->half_pow_theta = zeta2;
+    zipf->scramble = 2654435761ULL;
+    while (gcd(zipf->scramble, (unsigned long long)n) != 1) {
+        zipf->scramble += 2;
+    }
+}
+
+
+static int zipf_key(const Zipf *zipf, int rank) {
+    return (int)((unsigned long long)rank * zipf->scramble % (unsigned long long)zipf->n) + 1;
+}
+
+
+static int zipf_next(const Zipf *zipf, unsigned long long *state) {
+    double u = bench_uniform(state);
+    double uz = u * zipf->zetan;
+    int rank;
+    if (uz < 1.0) {
+        rank = 0;
+    } else if (uz < zipf->half_pow_theta) {
+        rank = 1;
+    } else {
+        rank = (int)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+        if (rank >= zipf->n) {
+            rank = zipf->n - 1;
+        }
+    }
+    return zipf_key(zipf, rank);
+}
+
+
+typedef struct WeightedKey {
+    double priority;
+    int key;
+} WeightedKey;
+
+
+static int compare_weighted(const void *a, const void *b) {
+    double x = ((const WeightedKey *)a)->priority;
+    double y = ((const WeightedKey *)b)->priority;
+    return (x > y) - (x < y);
+}
+
+
+// Fills keys with a permutation of 1..n in the order the pattern touches
+// them: ascending, random, or hot keys first (weighted sampling without
+// replacement by Zipf weight).
+static void key_order(int *keys, int n, Pattern pattern, const Zipf *zipf) {
+    if (pattern == PATTERN_SKEWED) {
+        WeightedKey *weighted = (WeightedKey *)malloc(n * sizeof(WeightedKey));
+        for (int rank = 0; rank < n; rank++) {
+            double u = bench_uniform(&bench_rng_state);
+            weighted[rank].priority = -log(u > 0 ? u : 1e-300) * pow(rank + 1, ZIPF_THETA);
+            weighted[rank].key = zipf_key(zipf, rank);
+        }
+        qsort(weighted, n, sizeof(WeightedKey), compare_weighted);
+        for (int i = 0; i < n; i++) {
+            keys[i] = weighted[i].key;
+        }
+        free(weighted);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        keys[i] = i + 1;
+    }
+    if (pattern == PATTERN_UNIFORM) {
+        shuffle(keys, n);
+    }
+}
+
+
+// Fills probes with count keys drawn from 1..n under the pattern.
+static void probe_stream(int *probes, int count, int n, Pattern pattern, const Zipf *zipf) {
+    for (int i = 0; i < count; i++) {
+        if (pattern == PATTERN_SEQUENTIAL) {
+            probes[i] = i % n + 1;
+        } else if (pattern == PATTERN_UNIFORM) {
+            probes[i] = (int)(bench_rand() % (unsigned long long)n) + 1;
+        } else {
+            probes[i] = zipf_next(zipf, &bench_rng_state);
+        }
+    }
+}
+
+
+// True if operation was selected with --ops (every operation is by default).
+static int op_enabled(const char *operation) {
+    if (selected_ops == NULL) {
+        return 1;
+    }
+    size_t length = strlen(operation);
+    for (const char *p = selected_ops; *p != '\0'; p += strcspn(p, ",") + (p[strcspn(p, ",")] == ',')) {
+        if (strncmp(p, operation, length) == 0 && (p[length] == ',' || p[length] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile(const uint64_t *sorted, long count, double p) {
+    long index = (long)ceil(p * count) - 1;
+    if (index < 0) {
+        index = 0;
+    }
+    return (double)sorted[index];
+}
+
+
+// Records one measurement; latencies (one per operation, in ns) are sorted in place.
+static void add_result(int records, const char *pattern, const char *operation, int threads,
+                       long count, double seconds, uint64_t *latencies) {
+    if (num_results == MAX_RESULTS || !op_enabled(operation)) {
+        return;
+    }
+    Result *result = &results[num_results++];
+    result->records = records;
+    result->pattern = pattern;
+    result->operation = operation;
+    result->threads = threads;
+    result->count = count;
+    result->seconds = seconds;
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    result->p50_ns = percentile(latencies, count, 0.50);
+    result->p99_ns = percentile(latencies, count, 0.99);
+    result->p999_ns = percentile(latencies, count, 0.999);
+    printf("%10d  %-10s  %-17s %2d  %9.3f M/s  p50 %9.0f  p99 %9.0f  p999 %9.0f ns\n",
+           records, pattern, operation, threads, count / seconds / 1e6,
+           result->p50_ns, result->p99_ns, result->p999_ns);
+    fflush(stdout);
+}
+
+
+static int count_match(Element *element, void *arg) {
+    return 1;
+}
+
+
+// Insert, search, batch search, range scan and delete for one size and pattern.
+static void bench_pattern(int n, int num_lookups, Pattern pattern, const Zipf *zipf, uint64_t *latencies) {
+    const char *name = pattern_names[pattern];
+    int *keys = (int *)malloc(n * sizeof(int));
+    int *probes = (int *)malloc(num_lookups * sizeof(int));
+    Element **batch_out = (Element **)malloc(BATCH_SIZE * sizeof(Element *));
+
+    key_order(keys, n, pattern, zipf);
+    Element **elements = (Element **)malloc(n * sizeof(Element *));
+    for (int i = 0; i < n; i++) {
+        elements[i] = create_element(keys[i], "Xx", "Synthetic", keys[i] * 2.0);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        insert(elements[i]);
+        latencies[i] = now_ns() - t;
+    }
+    add_result(n, name, "insert", 1, n, (now_ns() - start) / 1e9, latencies);
+    free(elements);
+
+    probe_stream(probes, num_lookups, n, pattern, zipf);
+    if (op_enabled("search")) {
+        long found = 0;
+        start = now_ns();
+        for (int i = 0; i < num_lookups; i++) {
+            uint64_t t = now_ns();
+            Element *element = search(probes[i]);
+            latencies[i] = now_ns() - t;
+            found += element != NULL;
+        }
+        add_result(n, name, "search", 1, num_lookups, (now_ns() - start) / 1e9, latencies);
+        lookup_failures += num_lookups - found;
+    }
+
+    // Latency of a batch is spread evenly over its keys.
+    if (op_enabled("search_batch")) {
+        long found = 0;
+        start = now_ns();
+        for (int i = 0; i < num_lookups; i += BATCH_SIZE) {
+            int count = num_lookups - i < BATCH_SIZE ? num_lookups - i : BATCH_SIZE;
+            uint64_t t = now_ns();
+            search_batch(&probes[i], count, batch_out);
+            uint64_t per_key = (now_ns() - t) / count;
+            for (int j = 0; j < count; j++) {
+                latencies[i + j] = per_key;
+                found += batch_out[j] != NULL;
+            }
+        }
+        add_result(n, name, "search_batch", 1, num_lookups, (now_ns() - start) / 1e9, latencies);
+        lookup_failures += num_lookups - found;
+    }
+
+    if (op_enabled("range")) {
+        int num_ranges = num_lookups / 50 > 0 ? num_lookups / 50 : 1;
+        long scanned = 0;
+        start = now_ns();
+        for (int i = 0; i < num_ranges; i++) {
+            Cursor cursor;
+            uint64_t t = now_ns();
+            cursor_seek(&cursor, probes[i], probes[i] + range_width - 1);
+            while (cursor_next(&cursor) != NULL) {
+                scanned++;
+            }
+            latencies[i] = now_ns() - t;
+        }
+        add_result(n, name, "range", 1, num_ranges, (now_ns() - start) / 1e9, latencies);
+    }
+
+    // The same ranges as above, summarized from subtree stats instead of scanned.
+    if (op_enabled("range_aggregate")) {
+        int num_ranges = num_lookups / 50 > 0 ? num_lookups / 50 : 1;
+        start = now_ns();
+        for (int i = 0; i < num_ranges; i++) {
+            uint64_t t = now_ns();
+            Aggregate aggregate = range_aggregate(probes[i], probes[i] + range_width - 1);
+            latencies[i] = now_ns() - t;
+            lookup_failures += aggregate.count == 0;
+        }
+        add_result(n, name, "range_aggregate", 1, num_ranges, (now_ns() - start) / 1e9, latencies);
+    }
+
+    // The same ranges again, by atomic mass through the secondary index. The
+    // index is only on for this operation so the others time the bare tree;
+    // its nodes go back to the pool with destroy_tree().
+    if (op_enabled("mass_range")) {
+        int num_ranges = num_lookups / 50 > 0 ? num_lookups / 50 : 1;
+        long scanned = 0;
+        enable_mass_index();
+        start = now_ns();
+        for (int i = 0; i < num_ranges; i++) {
+            uint64_t t = now_ns();
+            scanned += mass_range_scan(probes[i] * 2.0, (probes[i] + range_width - 1) * 2.0, count_match, NULL);
+            latencies[i] = now_ns() - t;
+        }
+        add_result(n, name, "mass_range", 1, num_ranges, (now_ns() - start) / 1e9, latencies);
+        mass_index.enabled = 0;
+        mass_index.root = NULL;
+    }
+
+    // Dashboard-style range scans: the same widths as range, drawn from 64
+    // hot ranges, so after the first round every scan is a result cache hit.
+    if (op_enabled("range_cached")) {
+        int num_ranges = num_lookups / 50 > 0 ? num_lookups / 50 : 1;
+        long scanned = 0;
+        result_cache_enable(RESULT_CACHE_ENTRIES, RESULT_CACHE_RECORDS);
+        start = now_ns();
+        for (int i = 0; i < num_ranges; i++) {
+            int lower = probes[i % 64];
+            uint64_t t = now_ns();
+            scanned += cached_range_scan(lower, lower + range_width - 1, count_match, NULL);
+            latencies[i] = now_ns() - t;
+        }
+        add_result(n, name, "range_cached", 1, num_ranges, (now_ns() - start) / 1e9, latencies);
+        result_cache_disable();
+    }
+
+    if (op_enabled("rank_select")) {
+        int found = 0;
+        start = now_ns();
+        for (int i = 0; i < num_lookups; i++) {
+            uint64_t t = now_ns();
+            Element *element = select_element(rank(probes[i]));
+            latencies[i] = now_ns() - t;
+            found += element != NULL && element->atomic_number == probes[i];
+        }
+        add_result(n, name, "rank_select", 1, num_lookups, (now_ns() - start) / 1e9, latencies);
+        lookup_failures += num_lookups - found;
+    }
+
+    if (op_enabled("delete")) {
+        key_order(keys, n, pattern, zipf);
+        long deleted = 0;
+        start = now_ns();
+        for (int i = 0; i < n; i++) {
+            uint64_t t = now_ns();
+            deleted += delete(keys[i]);
+            latencies[i] = now_ns() - t;
+        }
+        add_result(n, name, "delete", 1, n, (now_ns() - start) / 1e9, latencies);
+        lookup_failures += n - deleted;
+    }
+
+    destroy_tree();
+    free(batch_out);
+    free(probes);
+    free(keys);
+}
+
+
+typedef struct ReaderJob {
+    pthread_t thread;
+    int num_records;
+    int lookups;
+    unsigned long long seed;
+    long found;
+    uint64_t *latencies;
+} ReaderJob;
+
+typedef struct WriterJob {
+    pthread_t thread;
+    int num_records;
+    volatile int stop;
+    long operations;
+} WriterJob;
+
+
+// Looks up random even keys, all of which stay in the tree.
+static void *concurrent_reader(void *arg) {
+    ReaderJob *job = (ReaderJob *)arg;
+    unsigned long long state = job->seed;
+    for (int i = 0; i < job->lookups; i++) {
+        int key = 2 * ((int)(thread_rand(&state) % (unsigned long long)job->num_records) + 1);
+        uint64_t t = now_ns();
+        Element *element = search(key);
+        job->latencies[i] = now_ns() - t;
+        job->found += element != NULL && element->atomic_number == key;
+    }
+    return NULL;
+}
+
+
+// Inserts and deletes random odd keys, splitting and merging leaves under the readers.
+static void *concurrent_writer(void *arg) {
+    WriterJob *job = (WriterJob *)arg;
+    unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    while (!job->stop) {
+        int key = 2 * (int)(thread_rand(&state) % (unsigned long long)job->num_records) + 1;
+        if (!delete(key)) {
+            insert(create_element(key, "Xx", "Synthetic", key * 2.0));
+        }
+        job->operations++;
+    }
+    return NULL;
+}
+
+
+// Saves the current tree as a snapshot, maps it and looks keys up in the mapping.
+static void bench_snapshot(int n, int num_lookups, uint64_t *latencies) {
+    const char *snapshot_file = "bench.snap";
+    uint64_t start = now_ns();
+    snapshot_save(snapshot_file);
+    latencies[0] = now_ns() - start;
+    add_result(n, "sequential", "snapshot_save", 1, 1, latencies[0] / 1e9, latencies);
+    start = now_ns();
+    SnapshotFile *snapshot = snapshot_open(snapshot_file, 0);
+    latencies[0] = now_ns() - start;
+    add_result(n, "sequential", "snapshot_open", 1, 1, latencies[0] / 1e9, latencies);
+    if (snapshot != NULL) {
+        long found = 0;
+        start = now_ns();
+        for (int i = 0; i < num_lookups; i++) {
+            int key = (int)(bench_rand() % (unsigned long long)n) + 1;
+            uint64_t t = now_ns();
+            const SnapshotRecord *record = snapshot_search(snapshot, key);
+            latencies[i] = now_ns() - t;
+            found += record != NULL && record->atomic_number == key;
+        }
+        add_result(n, "uniform", "snapshot_search", 1, num_lookups, (now_ns() - start) / 1e9, latencies);
+        lookup_failures += num_lookups - found;
+        snapshot_close(snapshot);
+    } else {
+        lookup_failures++;
+    }
+    remove(snapshot_file);
+}
+
+
+// Readers look up the even keys 2..2n while the writer churns the odd ones.
+static void bench_concurrent(int n, int num_lookups, int num_threads, Element **sorted, uint64_t *latencies) {
+    for (int i = 0; i < n; i++) {
+        sorted[i] = create_element(2 * (i + 1), "Xx", "Synthetic", (i + 1) * 4.0);
+    }
+    bulk_load(sorted, n);
+    ReaderJob *readers = (ReaderJob *)calloc(num_threads, sizeof(ReaderJob));
+    for (int threads = 1; threads <= num_threads; threads *= 2) {
+        WriterJob writer = {0};
+        writer.num_records = n;
+        enable_concurrency();
+        uint64_t start = now_ns();
+        pthread_create(&writer.thread, NULL, concurrent_writer, &writer);
+        long reads = 0;
+        for (int t = 0; t < threads; t++) {
+            readers[t].num_records = n;
+            readers[t].lookups = num_lookups / threads;
+            readers[t].seed = bench_rand() | 1;
+            readers[t].found = 0;
+            readers[t].latencies = latencies + reads;
+            reads += readers[t].lookups;
+            pthread_create(&readers[t].thread, NULL, concurrent_reader, &readers[t]);
+        }
+        long found = 0;
+        for (int t = 0; t < threads; t++) {
+            pthread_join(readers[t].thread, NULL);
+            found += readers[t].found;
+        }
+        double elapsed = (now_ns() - start) / 1e9;
+        writer.stop = 1;
+        pthread_join(writer.thread, NULL);
+        disable_concurrency();
+        add_result(n, "uniform", "concurrent_search", threads, reads, elapsed, latencies);
+        lookup_failures += reads - found;
+    }
+    free(readers);
+    destroy_tree();
+}
+
+
+// Purges the middle half of n bulk-loaded records three ways: one delete()
+// per key, delete_range() over range_width keys at a time (one op per call),
+// and deferred deletes followed by a compact_tree() pass.
+static void bench_purge(int n, uint64_t *latencies) {
+    const char *operations[3] = {"purge_delete", "purge_range", "purge_deferred"};
+    int lower = n / 4 + 1;
+    int upper = n - n / 4;
+    for (int method = 0; method < 3; method++) {
+        if (!op_enabled(operations[method]) && !(method == 2 && op_enabled("compact"))) {
+            continue;
+        }
+        Element **sorted = (Element **)malloc(n * sizeof(Element *));
+        for (int i = 0; i < n; i++) {
+            sorted[i] = create_element(i + 1, "Xx", "Synthetic", (i + 1) * 2.0);
+        }
+        bulk_load(sorted, n);
+        free(sorted);
+
+        long count = 0;
+        long deleted = 0;
+        defer_rebalance = method == 2;
+        uint64_t start = now_ns();
+        for (int key = lower; key <= upper; key += method == 1 ? range_width : 1) {
+            uint64_t t = now_ns();
+            if (method == 1) {
+                deleted += delete_range(key, key + range_width - 1 < upper ? key + range_width - 1 : upper);
+            } else {
+                deleted += delete(key);
+            }
+            latencies[count++] = now_ns() - t;
+        }
+        add_result(n, "sequential", operations[method], 1, count, (now_ns() - start) / 1e9, latencies);
+        defer_rebalance = 0;
+        if (method == 2) {
+            start = now_ns();
+            compact_tree();
+            latencies[0] = now_ns() - start;
+            add_result(n, "sequential", "compact", 1, 1, latencies[0] / 1e9, latencies);
+        }
+        lookup_failures += (upper - lower + 1) - deleted;
+        destroy_tree();
+    }
+}
+
+
+// Scans of range_width records, each in a view opened for the scan, while a
+// writer churns the odd keys between them and so keeps copying nodes the
+// view still reads. Every even key in a scanned range must turn up.
+static void bench_views(int n, uint64_t *latencies) {
+    Element **sorted = (Element **)malloc(n * sizeof(Element *));
+    for (int i = 0; i < n; i++) {
+        sorted[i] = create_element(2 * (i + 1), "Xx", "Synthetic", (i + 1) * 4.0);
+    }
+    bulk_load(sorted, n);
+    free(sorted);
+
+    int num_scans = 1000;
+    long expected = 0;
+    long found = 0;
+    WriterJob writer = {0};
+    writer.num_records = n;
+    enable_concurrency();
+    uint64_t start = now_ns();
+    pthread_create(&writer.thread, NULL, concurrent_writer, &writer);
+    for (int i = 0; i < num_scans; i++) {
+        int lower = 2 * (int)(bench_rand() % (unsigned long long)n) + 2;
+        int upper = lower + 2 * range_width - 1;
+        expected += ((upper < 2 * n ? upper : 2 * n) - lower) / 2 + 1;
+        uint64_t t = now_ns();
+        TreeView *view = view_open();
+        ViewCursor cursor;
+        view_cursor_seek(&cursor, view, lower, upper);
+        Element *element;
+        while ((element = view_cursor_next(&cursor)) != NULL) {
+            found += element->atomic_number % 2 == 0;
+        }
+        view_close(view);
+        latencies[i] = now_ns() - t;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    writer.stop = 1;
+    pthread_join(writer.thread, NULL);
+    disable_concurrency();
+    add_result(n, "uniform", "view_scan", 1, num_scans, elapsed, latencies);
+    lookup_failures += expected - found;
+    destroy_tree();
+}
+
+
+// Lists all n records with parallel_scan() into /dev/null on 1, 2, 4, ...
+// num_threads threads; one op is one full listing.
+static void bench_full_scan(int n, int num_threads, uint64_t *latencies) {
+    FILE *sink = fopen("/dev/null", "w");
+    if (sink == NULL) {
+        return;
+    }
+    Element **sorted = (Element **)malloc(n * sizeof(Element *));
+    for (int i = 0; i < n; i++) {
+        sorted[i] = create_element(i + 1, "Xx", "Synthetic", (i + 1) * 2.0);
+    }
+    bulk_load(sorted, n);
+    free(sorted);
+
+    int saved_threads = scan_threads;
+    int num_scans = 5;
+    for (int threads = 1; threads <= num_threads; threads *= 2) {
+        scan_threads = threads;
+        long records = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < num_scans; i++) {
+            uint64_t t = now_ns();
+            records += parallel_scan(INT_MIN, INT_MAX, scan_emit_display, sink);
+            latencies[i] = now_ns() - t;
+        }
+        add_result(n, "sequential", "full_scan", threads, num_scans, (now_ns() - start) / 1e9, latencies);
+        lookup_failures += (long)num_scans * n - records;
+    }
+    scan_threads = saved_threads;
+    scan_pool_stop();
+    fclose(sink);
+    destroy_tree();
+}
+
+
+// Writes a pronounceable-ish name of 8 letters for key, distinct per key.
+static void synthetic_name(int key, char *name) {
+    unsigned int h = (unsigned int)key * 2654435761u;
+    name[0] = (char)('A' + h % 26);
+    for (int i = 1; i < 8; i++) {
+        h = h / 26 + (unsigned int)key * (i + 7);
+        name[i] = (char)('a' + h % 26);
+    }
+    name[8] = '\0';
+}
+
+
+// Typeahead through the name trie: listings of the first ten names under a
+// three-letter prefix, and fuzzy lookups of a name with one letter changed.
+static void bench_prefix(int n, int num_lookups, uint64_t *latencies) {
+    Element **sorted = (Element **)malloc(n * sizeof(Element *));
+    char name[30];
+    for (int i = 0; i < n; i++) {
+        synthetic_name(i + 1, name);
+        sorted[i] = create_element(i + 1, "Xx", name, (i + 1) * 2.0);
+    }
+    bulk_load(sorted, n);
+    free(sorted);
+    enable_prefix_index();
+
+    TrieMatch matches[TRIE_DEFAULT_LIMIT];
+    int num_queries = num_lookups / 10 > 0 ? num_lookups / 10 : 1;
+    if (op_enabled("prefix")) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < num_queries; i++) {
+            synthetic_name((int)(bench_rand() % (unsigned long long)n) + 1, name);
+            name[3] = '\0';
+            uint64_t t = now_ns();
+            int found = prefix_search(&name_trie, name, matches, TRIE_DEFAULT_LIMIT);
+            latencies[i] = now_ns() - t;
+            lookup_failures += found == 0;
+        }
+        add_result(n, "uniform", "prefix", 1, num_queries, (now_ns() - start) / 1e9, latencies);
+    }
+    if (op_enabled("fuzzy")) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < num_queries; i++) {
+            synthetic_name((int)(bench_rand() % (unsigned long long)n) + 1, name);
+            name[1 + bench_rand() % 7] = 'z';
+            uint64_t t = now_ns();
+            int found = fuzzy_search(&name_trie, name, 1, matches, TRIE_DEFAULT_LIMIT);
+            latencies[i] = now_ns() - t;
+            lookup_failures += found == 0;
+        }
+        add_result(n, "uniform", "fuzzy", 1, num_queries, (now_ns() - start) / 1e9, latencies);
+    }
+    name_trie.enabled = 0;
+    symbol_trie.enabled = 0;
+    destroy_tree();
+}
+
+
+// Delta loads into n bulk-loaded records (the even keys): ten batches of
+// n / 100 records at random odd keys, applied one insert() per record
+// (delta_insert) and with insert_batch() (delta_batch). One op is one
+// record; a batch's time is spread evenly over its records.
+static void bench_delta(int n, uint64_t *latencies) {
+    const char *operations[2] = {"delta_insert", "delta_batch"};
+    int batch_size = n / 100 > 0 ? n / 100 : 1;
+    int num_batches = 10;
+    int *keys = (int *)malloc(num_batches * batch_size * sizeof(int));
+    for (int i = 0; i < num_batches * batch_size; i++) {
+        keys[i] = 2 * (int)(bench_rand() % (unsigned long long)n) + 1;
+    }
+    Element **batch = (Element **)malloc(batch_size * sizeof(Element *));
+    for (int method = 0; method < 2; method++) {
+        if (!op_enabled(operations[method])) {
+            continue;
+        }
+        Element **sorted = (Element **)malloc(n * sizeof(Element *));
+        for (int i = 0; i < n; i++) {
+            sorted[i] = create_element(2 * (i + 1), "Xx", "Synthetic", (i + 1) * 4.0);
+        }
+        bulk_load(sorted, n);
+        free(sorted);
+
+        long count = 0;
+        uint64_t start = now_ns();
+        for (int b = 0; b < num_batches; b++) {
+            const int *batch_keys = &keys[b * batch_size];
+            if (method == 0) {
+                for (int i = 0; i < batch_size; i++) {
+                    uint64_t t = now_ns();
+                    Element *element = create_element(batch_keys[i], "Xx", "Synthetic", batch_keys[i] * 2.0);
+                    if (!insert(element)) {
+                        free_element(element);
+                    }
+                    latencies[count++] = now_ns() - t;
+                }
+            } else {
+                uint64_t t = now_ns();
+                for (int i = 0; i < batch_size; i++) {
+                    batch[i] = create_element(batch_keys[i], "Xx", "Synthetic", batch_keys[i] * 2.0);
+                }
+                insert_batch(batch, batch_size, UPSERT_KEEP);
+                uint64_t per_record = (now_ns() - t) / batch_size;
+                for (int i = 0; i < batch_size; i++) {
+                    latencies[count++] = per_record;
+                }
+            }
+        }
+        add_result(n, "uniform", operations[method], 1, count, (now_ns() - start) / 1e9, latencies);
+        for (int i = 0; i < num_batches * batch_size; i += 97) {
+            lookup_failures += search(keys[i]) == NULL;
+        }
+        destroy_tree();
+    }
+    free(batch);
+    free(keys);
+}
+
+
+// Writes n records to a text file, with keys in ascending (bulk_load()
+// path) or random (insert_batch() path) order, and times
+// initialize_tree_from_file() on it with 1, 2, 4, ... num_threads parse
+// threads. One op is one record; the load's time is spread evenly over them.
+static void bench_ingest(int n, int num_threads, uint64_t *latencies) {
+    const char *data_file = "bench.txt";
+    const Pattern patterns[2] = {PATTERN_SEQUENTIAL, PATTERN_UNIFORM};
+    int *keys = (int *)malloc(n * sizeof(int));
+    int saved_threads = scan_threads;
+    for (int p = 0; p < 2; p++) {
+        key_order(keys, n, patterns[p], NULL);
+        FILE *file = fopen(data_file, "w");
+        if (file == NULL) {
+            lookup_failures++;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            fprintf(file, "%d\tXx\tSynthetic\t%.3f\n", keys[i], keys[i] * 2.0);
+        }
+        fclose(file);
+        for (int threads = 1; threads <= num_threads; threads *= 2) {
+            scan_threads = threads;
+            uint64_t start = now_ns();
+            long added = initialize_tree_from_file(data_file);
+            uint64_t elapsed = now_ns() - start;
+            for (int i = 0; i < n; i++) {
+                latencies[i] = elapsed / n;
+            }
+            add_result(n, pattern_names[patterns[p]], "ingest", threads, n, elapsed / 1e9, latencies);
+            lookup_failures += n - added;
+            destroy_tree();
+        }
+    }
+    scan_threads = saved_threads;
+    remove(data_file);
+    free(keys);
+}
+
+
+// bulk_load(), snapshot save/open/lookup, and concurrent readers for one size.
+static void bench_size_extras(int n, int num_lookups, int num_threads, uint64_t *latencies) {
+    Element **sorted = (Element **)malloc(n * sizeof(Element *));
+    int snapshots = op_enabled("snapshot_save") || op_enabled("snapshot_open") || op_enabled("snapshot_search");
+    if (op_enabled("bulk_load") || snapshots) {
+        for (int i = 0; i < n; i++) {
+            sorted[i] = create_element(i + 1, "Xx", "Synthetic", (i + 1) * 2.0);
+        }
+        uint64_t start = now_ns();
+        bulk_load(sorted, n);
+        latencies[0] = now_ns() - start;
+        add_result(n, "sequential", "bulk_load", 1, 1, latencies[0] / 1e9, latencies);
+        if (snapshots) {
+            bench_snapshot(n, num_lookups, latencies);
+        }
+        destroy_tree();
+    }
+    if (op_enabled("concurrent_search")) {
+        bench_concurrent(n, num_lookups, num_threads, sorted, latencies);
+    }
+    free(sorted);
+    bench_purge(n, latencies);
+    bench_delta(n, latencies);
+    if (op_enabled("view_scan")) {
+        bench_views(n, latencies);
+    }
+    if (op_enabled("full_scan")) {
+        bench_full_scan(n, num_threads, latencies);
+    }
+    if (op_enabled("prefix") || op_enabled("fuzzy")) {
+        bench_prefix(n, num_lookups, latencies);
+    }
+    if (op_enabled("ingest")) {
+        bench_ingest(n, num_threads, latencies);
+    }
+}
+
+
+static void write_csv(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", path);
+        return;
+    }
+    fprintf(file, "revision,node_order,records,pattern,operation,threads,count,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+    for (int i = 0; i < num_results; i++) {
+        Result *r = &results[i];
+        fprintf(file, "%s,%d,%d,%s,%s,%d,%ld,%.6f,%.1f,%.0f,%.0f,%.0f\n", BENCH_REVISION, MAX_ELEMENTS,
+                r->records, r->pattern, r->operation, r->threads, r->count, r->seconds,
+                r->count / r->seconds, r->p50_ns, r->p99_ns, r->p999_ns);
+    }
+    fclose(file);
+}
+
+
+static void write_json(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", path);
+        return;
+    }
+    fprintf(file, "{\n  \"revision\": \"%s\",\n  \"node_order\": %d,\n  \"results\": [\n", BENCH_REVISION, MAX_ELEMENTS);
+    for (int i = 0; i < num_results; i++) {
+        Result *r = &results[i];
+        fprintf(file, "    {\"records\": %d, \"pattern\": \"%s\", \"operation\": \"%s\", \"threads\": %d, "
+                      "\"count\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                      "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f}%s\n",
+                r->records, r->pattern, r->operation, r->threads, r->count, r->seconds,
+                r->count / r->seconds, r->p50_ns, r->p99_ns, r->p999_ns, i + 1 < num_results ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+
+int main(int argc, char **argv) {
+    int sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+    int num_sizes = 4;
+    int num_lookups = 1000000;
+    int num_threads = 4;
+    const char *csv_path = NULL;
+    const char *json_path = NULL;
+    const char *stats_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            num_sizes = 0;
+            for (char *size = strtok(argv[++i], ","); size != NULL && num_sizes < MAX_SIZES; size = strtok(NULL, ",")) {
+                sizes[num_sizes++] = atoi(size);
+            }
+        } else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            num_lookups = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            selected_ops = argv[++i];
+        } else if (strcmp(argv[i], "--range-width") == 0 && i + 1 < argc) {
+            range_width = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csv_path = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--sizes N,N,...] [--lookups N] [--threads N] [--ops OP,OP,...] "
+                            "[--range-width N] [--csv FILE] [--json FILE] [--stats FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (num_lookups < 1 || num_threads < 1 || range_width < 1) {
+        fprintf(stderr, "--lookups, --threads and --range-width must be positive.\n");
+        return 2;
+    }
+
+    printf("revision %s, node order %d, %d lookups per run\n", BENCH_REVISION, MAX_ELEMENTS, num_lookups);
+    if (stats_path != NULL) {
+        stats_enable(1);
+    }
+    for (int s = 0; s < num_sizes; s++) {
+        int n = sizes[s];
+        if (n < 1) {
+            continue;
+        }
+        uint64_t *latencies = (uint64_t *)malloc((n > num_lookups ? n : num_lookups) * sizeof(uint64_t));
+        Zipf zipf;
+        zipf_init(&zipf, n);
+        for (int p = PATTERN_SEQUENTIAL; p <= PATTERN_SKEWED; p++) {
+            bench_pattern(n, num_lookups, (Pattern)p, &zipf, latencies);
+        }
+        bench_size_extras(n, num_lookups, num_threads, latencies);
+        free(latencies);
+    }
+
+    if (csv_path != NULL) {
+        write_csv(csv_path);
+    }
+    if (json_path != NULL) {
+        write_json(json_path);
+    }
+    if (stats_path != NULL) {
+        FILE *stats_file = fopen(stats_path, "w");
+        if (stats_file != NULL) {
+            stats_dump_json(stats_file);
+            fclose(stats_file);
+        }
+    }
+    if (lookup_failures != 0) {
+        printf("%ld lookups of present keys failed.\n", lookup_failures);
+        return 1;
+    }
+    return 0;
+}
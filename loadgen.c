@@ -0,0 +1,365 @@
+#define RUN2_NO_MAIN
+#include "run2.c"
+
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+
+// Load generator for run2 --serve. It first inserts --preload records above
+// the periodic table over one connection, then every one of --connections
+// threads opens its own connection and sends --requests requests, keeping up
+// to --pipeline of them in flight. Requests are GETs of present keys, RANGEs
+// of --range-width keys, and writes (an INSERT of a key private to the
+// thread, later a DELETE of it) in the proportions given by --mix. Latency
+// is timed per request, from when it is queued for sending to its reply.
+//
+// Usage: loadgen PORT|PATH [--connections N] [--requests N] [--pipeline N]
+//                [--preload N] [--range-width N] [--mix GET,RANGE,WRITE]
+//
+// Prints throughput and p50/p99/p999 latency per request type and overall.
+// Exits 1 if a reply is malformed or says something unexpected.
+
+#define PRELOAD_BASE 1000
+#define NUM_KINDS 4
+
+static const char *kind_names[NUM_KINDS] = {"get", "range", "insert", "delete"};
+
+typedef struct Client {
+    const char *address;
+    int id;
+    long requests;
+    int pipeline;
+    int preload;
+    int range_width;
+    int mix[3];                  // percent of GETs, RANGEs and writes
+    unsigned long long seed;
+    uint64_t *latencies[NUM_KINDS];
+    long counts[NUM_KINDS];
+    long failures;
+} Client;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static unsigned long long next_rand(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static double percentile(const uint64_t *sorted, long count, double p) {
+    long index = (long)ceil(p * count) - 1;
+    if (index < 0) {
+        index = 0;
+    }
+    return (double)sorted[index];
+}
+
+
+static int connect_to(const char *address) {
+    char *end;
+    long port = strtol(address, &end, 10);
+    int fd;
+    if (*address != '\0' && *end == '\0') {
+        struct sockaddr_in in;
+        int on = 1;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons((uint16_t)port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&in, sizeof(in)) != 0) {
+            close(fd);
+            return -1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    } else {
+        struct sockaddr_un un;
+        if (strlen(address) >= sizeof(un.sun_path)) {
+            return -1;
+        }
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, address);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&un, sizeof(un)) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+
+// Chooses the next request. Writes alternate between inserting a fresh key
+// of this client's own and deleting it again, so the data set stays put.
+static int next_request(Client *client, char *frame, size_t *size, int *pending_key, long *next_key) {
+    int roll = (int)(next_rand(&client->seed) % 100);
+    int key = PRELOAD_BASE + (int)(next_rand(&client->seed) % (unsigned long long)(client->preload > 0 ? client->preload : 1));
+    if (client->preload == 0) {
+        key = 1 + (int)(next_rand(&client->seed) % 118);
+    }
+    if (roll < client->mix[0]) {
+        *size = server_encode_request(frame, SERVER_GET, key, 0, NULL);
+        return 0;
+    }
+    if (roll < client->mix[0] + client->mix[1]) {
+        *size = server_encode_request(frame, SERVER_RANGE, key, key + client->range_width - 1, NULL);
+        return 1;
+    }
+    if (*pending_key != 0) {
+        *size = server_encode_request(frame, SERVER_DELETE, *pending_key, 0, NULL);
+        *pending_key = 0;
+        return 3;
+    }
+    Element record;
+    *pending_key = (int)(*next_key)++;
+    record.atomic_number = *pending_key;
+    record.atomic_mass = *pending_key * 2.0;
+    strcpy(record.symbol, "Lg");
+    record.name = "Loadgen";
+    *size = server_encode_request(frame, SERVER_INSERT, 0, 0, &record);
+    return 2;
+}
+
+
+// Sends the preload, then this client's requests, pipelined. The socket is
+// non-blocking and polled for both directions, so a server that holds back
+// on reading until its replies drain never deadlocks against us.
+static void *client_run(void *arg) {
+    Client *client = (Client *)arg;
+    int fd = connect_to(client->address);
+    if (fd < 0) {
+        fprintf(stderr, "loadgen: cannot connect to %s\n", client->address);
+        client->failures++;
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    long total = client->requests;
+    int preloading = client->id < 0;
+    size_t send_capacity = (size_t)client->pipeline * SERVER_FRAME_MAX;
+    char *send_buffer = (char *)malloc(send_capacity);
+    size_t send_used = 0;
+    size_t send_done = 0;
+    size_t receive_capacity = 1 << 16;
+    size_t received = 0;
+    char *receive_buffer = (char *)malloc(receive_capacity);
+    uint64_t *sent_at = (uint64_t *)malloc(client->pipeline * sizeof(uint64_t));
+    int *kinds = (int *)malloc(client->pipeline * sizeof(int));
+    int pending_key = 0;
+    long next_key = 1000000000L + (long)client->id * (client->requests + 1);
+    long sent = 0;
+    long done = 0;
+
+    while (done < total && client->failures == 0) {
+        // Top the window up to --pipeline requests in flight.
+        memmove(send_buffer, send_buffer + send_done, send_used - send_done);
+        send_used -= send_done;
+        send_done = 0;
+        uint64_t now = now_ns();
+        while (sent - done < client->pipeline && sent < total && send_used + SERVER_FRAME_MAX <= send_capacity) {
+            size_t size;
+            int kind;
+            if (preloading) {
+                Element record;
+                record.atomic_number = PRELOAD_BASE + (int)sent;
+                record.atomic_mass = record.atomic_number * 2.0;
+                strcpy(record.symbol, "Lg");
+                record.name = "Preloaded";
+                size = server_encode_request(send_buffer + send_used, SERVER_INSERT, 0, 0, &record);
+                kind = 2;
+            } else {
+                kind = next_request(client, send_buffer + send_used, &size, &pending_key, &next_key);
+            }
+            sent_at[sent % client->pipeline] = now;
+            kinds[sent % client->pipeline] = kind;
+            send_used += size;
+            sent++;
+        }
+
+        struct pollfd poller = {fd, POLLIN | (send_used > send_done ? POLLOUT : 0), 0};
+        if (poll(&poller, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            client->failures++;
+            break;
+        }
+        if (poller.revents & POLLOUT) {
+            ssize_t written = write(fd, send_buffer + send_done, send_used - send_done);
+            if (written > 0) {
+                send_done += written;
+            } else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+                client->failures++;
+                break;
+            }
+        }
+        if (!(poller.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        ssize_t got = read(fd, receive_buffer + received, receive_capacity - received);
+        if (got < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (got <= 0) {
+            client->failures++;
+            break;
+        }
+        received += got;
+        now = now_ns();
+        size_t pos = 0;
+        uint32_t length;
+        while (received - pos >= 4 && (memcpy(&length, receive_buffer + pos, 4), received - pos >= 4 + (size_t)length)) {
+            int kind = kinds[done % client->pipeline];
+            uint8_t status = length >= 5 ? (uint8_t)receive_buffer[pos + 4] : SERVER_ERROR;
+            // GETs hit present keys; inserts of fresh keys and deletes of them succeed.
+            if (status != SERVER_OK && !(preloading && status == SERVER_EXISTS)) {
+                client->failures++;
+            }
+            if (!preloading) {
+                client->latencies[kind][client->counts[kind]++] = now - sent_at[done % client->pipeline];
+            }
+            pos += 4 + length;
+            done++;
+        }
+        memmove(receive_buffer, receive_buffer + pos, received - pos);
+        received -= pos;
+        if (received == receive_capacity) {
+            receive_capacity *= 2;
+            receive_buffer = (char *)realloc(receive_buffer, receive_capacity);
+        }
+    }
+    close(fd);
+    free(send_buffer);
+    free(receive_buffer);
+    free(sent_at);
+    free(kinds);
+    return NULL;
+}
+
+
+static void print_line(const char *name, uint64_t *latencies, long count, double seconds) {
+    if (count == 0) {
+        return;
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    printf("  %-8s %10ld requests %10.0f req/s  p50 %9.0f  p99 %9.0f  p999 %9.0f ns\n", name, count,
+           count / seconds, percentile(latencies, count, 0.50), percentile(latencies, count, 0.99),
+           percentile(latencies, count, 0.999));
+}
+
+
+int main(int argc, char **argv) {
+    int num_clients = 4;
+    long requests = 100000;
+    int pipeline = 16;
+    int preload = 10000;
+    int width = 10;
+    int mix[3] = {90, 5, 5};
+
+    if (argc < 2 || argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s PORT|PATH [--connections N] [--requests N] [--pipeline N] [--preload N] "
+                        "[--range-width N] [--mix GET,RANGE,WRITE]\n", argv[0]);
+        return 1;
+    }
+    const char *address = argv[1];
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            num_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            requests = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            pipeline = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--preload") == 0 && i + 1 < argc) {
+            preload = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--range-width") == 0 && i + 1 < argc) {
+            width = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%d,%d,%d", &mix[0], &mix[1], &mix[2]) == 3) {
+            i++;
+        } else {
+            fprintf(stderr, "loadgen: bad option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (num_clients < 1 || requests < 1 || pipeline < 1 || pipeline > 4096 || preload < 0 || width < 1 ||
+        mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] != 100) {
+        fprintf(stderr, "loadgen: connections, requests, pipeline (up to 4096) and range width must be "
+                        "positive, and the mix must add up to 100\n");
+        return 1;
+    }
+
+    long failures = 0;
+    if (preload > 0) {
+        Client loader = {address, -1, preload, pipeline, preload, width, {0, 0, 0}, 1};
+        client_run(&loader);
+        failures += loader.failures;
+    }
+
+    Client *clients = (Client *)calloc(num_clients, sizeof(Client));
+    pthread_t *threads = (pthread_t *)malloc(num_clients * sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].address = address;
+        clients[i].id = i;
+        clients[i].requests = requests;
+        clients[i].pipeline = pipeline;
+        clients[i].preload = preload;
+        clients[i].range_width = width;
+        memcpy(clients[i].mix, mix, sizeof(mix));
+        clients[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        for (int k = 0; k < NUM_KINDS; k++) {
+            clients[i].latencies[k] = (uint64_t *)malloc(requests * sizeof(uint64_t));
+        }
+        pthread_create(&threads[i], NULL, client_run, &clients[i]);
+    }
+    for (int i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    long total = 0;
+    uint64_t *all = (uint64_t *)malloc(num_clients * requests * sizeof(uint64_t));
+    printf("%d connections, pipeline %d, %.3f s\n", num_clients, pipeline, seconds);
+    for (int k = 0; k < NUM_KINDS; k++) {
+        long count = 0;
+        for (int i = 0; i < num_clients; i++) {
+            memcpy(all + total + count, clients[i].latencies[k], clients[i].counts[k] * sizeof(uint64_t));
+            count += clients[i].counts[k];
+        }
+        uint64_t *kind = (uint64_t *)malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+        memcpy(kind, all + total, count * sizeof(uint64_t));
+        print_line(kind_names[k], kind, count, seconds);
+        free(kind);
+        total += count;
+    }
+    print_line("all", all, total, seconds);
+    for (int i = 0; i < num_clients; i++) {
+        failures += clients[i].failures;
+        for (int k = 0; k < NUM_KINDS; k++) {
+            free(clients[i].latencies[k]);
+        }
+    }
+    free(all);
+    free(clients);
+    free(threads);
+    if (failures != 0) {
+        printf("%ld requests failed.\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -1,555 +1,7608 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <math.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
+// Instrumentation (see stats_enable()). Build with -DTREE_STATS=0 to compile
+// the counters and timers out altogether.
+#ifndef TREE_STATS
+#define TREE_STATS 1
+#endif
+#if TREE_STATS && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define STATS_HARDWARE 1
+#else
+#define STATS_HARDWARE 0
+#endif
 
+
+// Node order: the most keys a node holds, and with it the node size and the
+// split point. Set it at build time with -DMAX_ELEMENTS=N; the Makefile has
+// presets for nodes whose keys fill one cache line and for page-sized nodes.
+#ifndef MAX_ELEMENTS
 #define MAX_ELEMENTS 118
+#endif
+#if MAX_ELEMENTS < 3
+#error "MAX_ELEMENTS must be at least 3"
+#endif
+// Every node except the root keeps at least this many keys.
+#define MIN_KEYS ((MAX_ELEMENTS - 1) / 2)
+// Bound on the height of any tree with int keys: every node but the root has at least two children.
+#define MAX_TREE_HEIGHT 64
 
+// A record. The name is interned (see string_intern()): elements with the
+// same name share one copy, which keeps the struct at 40 bytes.
 typedef struct Element {
     int atomic_number;
     char symbol[3];
-    char name[30];
+    char block;                   // 's', 'p', 'd', 'f', or 0 outside the periodic table
+    const char *name;
     double atomic_mass;
+    struct Element *symbol_next;  // chain of elements sharing this symbol
+    struct Element *symbol_prev;
 } Element;
 
 
+// B+ tree node. Records live only in leaves, which are chained through next;
+// internal keys are separators, with child i holding keys in
+// [keys[i - 1], keys[i]). Keys are stored inline and cache-line aligned so
+// the intra-node search never has to dereference an Element.
+//
+// version is the optimistic lock used in concurrent mode: bit 0 marks a node
+// that has been freed, bit 1 is held by a writer, and the remaining bits
+// count completed writes.
+//
+// stats summarizes the atomic masses of every record in the node's subtree,
+// so range statistics, rank() and select_element() can use whole subtrees
+// without visiting their records.
+//
+// epoch and prev_version serve copy-on-write views (see view_open()): a
+// writer about to change a node that an open view may still read first
+// pushes a copy of the old contents onto prev_version.
+typedef struct Aggregate {
+    long count;
+    double sum;
+    double min;                   // INFINITY when count is 0
+    double max;                   // -INFINITY when count is 0
+} Aggregate;
+
 typedef struct Node {
+    int keys[MAX_ELEMENTS] __attribute__((aligned(64)));
     int num_keys;
-    Element **elements;
-    struct Node **children;
-    struct Node *next;
     int is_leaf;
+    uint64_t version;
+    struct Node *next;
+    Aggregate stats;
+    uint64_t epoch;              // epoch in which the contents were written
+    struct Node *prev_version;   // older contents, newest first, kept for open views
+    union {
+        Element *elements[MAX_ELEMENTS];
+        struct Node *children[MAX_ELEMENTS + 1];
+    };
 } Node;
 
+
+// Forward-only range cursor over the leaf chain. Elements are returned in
+// place, without copying, and stay valid until the tree is modified.
+// In concurrent mode the cursor remembers the leaf version its position was
+// read under and re-seeks from resume whenever that leaf has changed.
+typedef struct Cursor {
+    Node *leaf;
+    int pos;
+    int upper;
+    uint64_t version;
+    int resume;
+} Cursor;
+
+
+// Point-in-time view of the tree (see view_open()): the root when the view
+// was opened, and the epoch whose node versions it reads.
+typedef struct TreeView {
+    Node *root;
+    uint64_t epoch;
+    struct TreeView *next;       // list of open views
+} TreeView;
+
+// Forward-only range cursor over a view. Leaves are relinked in place, so a
+// view can't follow the leaf chain; the cursor keeps its path from the
+// view's root instead, with the child taken at each internal level and the
+// position in the leaf at the bottom.
+typedef struct ViewCursor {
+    const TreeView *view;
+    Node *path[MAX_TREE_HEIGHT];
+    int index[MAX_TREE_HEIGHT];
+    int depth;                   // level of the leaf, -1 once the scan is over
+    int upper;
+} ViewCursor;
+
+// Something a view may still read after the tree let go of it: an old node
+// version (owner is the node whose chain holds it), a removed node, or a
+// removed element. Freed once no open view is older than death.
+#define RETIRED_COPY 0
+#define RETIRED_NODE 1
+#define RETIRED_ELEMENT 2
+
+typedef struct RetiredVersion {
+    void *object;
+    Node *owner;
+    uint64_t death;              // epoch in which object stopped being current
+    int kind;
+} RetiredVersion;
+
+
+// One partition of a parallel scan (see parallel_scan()): a subtree cut to
+// the scanned range, or a slice of a sorted list of elements. Its records
+// are formatted into text, which is written out in partition order.
+typedef struct ScanTask {
+    Node *node;                  // NULL for a slice
+    int lower_open;              // as in node_range_aggregate()
+    int upper_open;
+    Element **elements;
+    int count;
+    char *text;
+    size_t length;
+    size_t capacity;
+    long records;
+} ScanTask;
+
+// Formats one record into a task's text (see scan_printf()).
+typedef void (*ScanEmit)(ScanTask *task, const Element *element);
+
+// A contiguous run of task indexes. Its owner takes tasks from the front;
+// an idle worker steals the back half.
+typedef struct ScanQueue {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+} ScanQueue;
+
+// Latency histogram: bucket b counts operations that took [2^b, 2^(b+1)) ns.
+#define STATS_BUCKETS 40
+
+typedef struct LatencyHistogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} LatencyHistogram;
+
+// Timed operations.
+#define STAT_SEARCH 0
+#define STAT_INSERT 1
+#define STAT_DELETE 2
+#define STAT_DELETE_RANGE 3
+#define STAT_NUM_OPS 4
+
+// Event counters, kept while stats_enabled is set.
+typedef struct TreeStats {
+    uint64_t descents;           // root-to-leaf descents by searches and cursor seeks
+    uint64_t node_visits;        // nodes those descents read, leaves included
+    uint64_t search_misses;
+    uint64_t insert_duplicates;
+    uint64_t delete_misses;
+    uint64_t range_scans;
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t root_splits;        // the tree grew a level
+    uint64_t borrows;            // entries moved to an underfull sibling
+    uint64_t merges;
+    uint64_t root_collapses;     // the tree lost a level
+    uint64_t restarts;           // concurrent attempts retried after a conflict
+    uint64_t cow_copies;         // node versions kept for open views
+    LatencyHistogram latency[STAT_NUM_OPS];
+} TreeStats;
+
+// Shape of the tree, measured by stats_dump_json().
+typedef struct TreeShape {
+    int height;
+    long leaves;
+    long internal_nodes;
+    long records;
+    long internal_keys;
+} TreeShape;
+
+
+typedef struct ScanJob {
+    ScanTask *tasks;
+    int num_tasks;
+    int lower;
+    int upper;
+    ScanEmit emit;
+    ScanQueue *queues;           // one per worker, the caller's first
+    int num_queues;
+} ScanJob;
+
+
+// Fixed-size object pool: objects are carved out of large chunks and
+// recycled through a free list. Chunks are only released by pool_destroy().
+#define POOL_CHUNK_BYTES (1 << 20)
+
+typedef struct PoolChunk {
+    struct PoolChunk *next;
+} PoolChunk;
+
+typedef struct Pool {
+    size_t object_size;
+    size_t align;
+    PoolChunk *chunks;
+    char *bump;
+    char *bump_end;
+    void *free_list;
+    size_t live_objects;
+    size_t chunk_count;
+} Pool;
+
+// Interned strings: each distinct string is stored once, in a chained hash
+// table, and freed when its last reference is released. Concurrent callers
+// hold pool_mutex.
+typedef struct InternedString {
+    struct InternedString *next;  // hash chain
+    unsigned int hash;
+    unsigned int refs;
+    char text[];
+} InternedString;
+
+typedef struct StringPool {
+    InternedString **buckets;
+    int capacity;                 // a power of two, or 0 before the first string
+    int count;
+    size_t bytes;                 // headers included
+} StringPool;
+
+// Secondary index on symbol: open-addressing hash table from symbol to the
+// head of that symbol's element chain. Slots are never removed; an emptied
+// chain just leaves a NULL head behind.
+typedef struct SymbolSlot {
+    char symbol[4];
+    Element *head;
+} SymbolSlot;
+
+typedef struct SymbolIndex {
+    SymbolSlot *slots;
+    int capacity;
+    int used;
+    int enabled;
+} SymbolIndex;
+
+
+// Ordered secondary index: a treap of elements sorted by compare().
+typedef struct IndexNode {
+    Element *element;
+    unsigned int priority;
+    struct IndexNode *left;
+    struct IndexNode *right;
+} IndexNode;
+
+typedef struct OrderedIndex {
+    IndexNode *root;
+    int (*compare)(const Element *a, const Element *b);
+    int enabled;
+} OrderedIndex;
+
+// Compact trie (radix tree) over a lower-cased string key of each record,
+// for prefix and fuzzy lookups. Every node but the root has a non-empty edge
+// label, and a node holding no records has at least two children, so the
+// subtree under a prefix has fewer than twice as many nodes as keys.
+// Children are chained through sibling in order of their first label byte;
+// the records whose key ends at a node sit in its entries, a treap ordered
+// by atomic number.
+#define TRIE_KEY_MAX 30
+#define TRIE_QUERY_MAX 64
+// Results returned when a lookup does not ask for a number.
+#define TRIE_DEFAULT_LIMIT 10
+
+typedef struct TrieNode {
+    char label[TRIE_KEY_MAX];
+    unsigned char length;
+    struct TrieNode *child;
+    struct TrieNode *sibling;
+    OrderedIndex entries;
+} TrieNode;
+
+typedef struct Trie {
+    TrieNode *root;
+    const char *(*key)(const Element *element);
+    int enabled;
+} Trie;
+
+// One result of a trie lookup; distance is the edit distance for fuzzy
+// matches and 0 for prefix matches.
+typedef struct TrieMatch {
+    Element *element;
+    int distance;
+} TrieMatch;
+
+// Elements of one block, kept sorted by atomic number.
+typedef struct BlockList {
+    Element **elements;
+    int count;
+    int capacity;
+} BlockList;
+
+// Result cache for key ranges (see cached_range_scan()): the records of
+// recently asked [lower, upper] ranges in key order, found by a hash of the
+// bounds and dropped least recently used first. A write to key k drops
+// exactly the entries whose range holds k; lowers and uppers mirror every
+// entry's bounds in flat arrays so that check is one pass over a few cache
+// lines.
+#define RESULT_CACHE_ENTRIES 256
+#define RESULT_CACHE_RECORDS (1L << 18)
+// A result bigger than this share of max_records is not cached.
+#define RESULT_CACHE_ENTRY_SHARE 8
+
+typedef struct CacheEntry {
+    int lower;
+    int upper;
+    Element **elements;
+    int count;
+    int slot;                        // index into lowers / uppers / slots
+    struct CacheEntry *hash_next;
+    struct CacheEntry *newer;
+    struct CacheEntry *older;
+} CacheEntry;
+
+typedef struct ResultCache {
+    int enabled;
+    int max_entries;
+    long max_records;
+    int count;
+    long records;                    // element pointers held by all entries
+    CacheEntry **buckets;
+    int num_buckets;                 // a power of two
+    int *lowers;
+    int *uppers;
+    CacheEntry **slots;
+    CacheEntry *newest;
+    CacheEntry *oldest;
+    uint64_t writes;                 // bumped by every write, so a fill can tell it raced one
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;          // entries dropped by writes
+    uint64_t evictions;              // entries dropped for room
+} ResultCache;
+
+// What insert_batch() does with a record whose atomic number is taken.
+#define UPSERT_KEEP 0                // keep the record that got there first
+#define UPSERT_REPLACE 1             // replace it with the newer one
+
+// Text data file ingest (see initialize_tree_from_file()). The mapped file
+// is cut into line-aligned chunks that are parsed, and sorted, on separate
+// threads; a parsed record points into the mapping for its name rather
+// than copying it. Each chunk keeps its first few errors by line within
+// the chunk.
+#define INGEST_CHUNK_MIN_BYTES (1 << 20)
+#define INGEST_MAX_ERRORS 10
+
+typedef struct IngestRecord {
+    int atomic_number;
+    char symbol[3];
+    unsigned char name_length;
+    const char *name;            // not terminated
+    double atomic_mass;
+} IngestRecord;
+
+typedef struct IngestChunk {
+    const char *begin;
+    const char *end;
+    IngestRecord *records;
+    long count;
+    long capacity;
+    long lines;
+    int sorted;                  // parsed in strictly increasing atomic number
+    long num_errors;
+    long error_lines[INGEST_MAX_ERRORS];
+    const char *error_messages[INGEST_MAX_ERRORS];
+    pthread_t thread;
+    int started;                 // thread is running the chunk
+} IngestChunk;
+
+// Binary snapshot file. Everything is addressed by file offset, so the file
+// can be mapped anywhere and searched in place. Layout: header, records in
+// key order, then nodes of node_order keys followed by node_order + 1
+// references (child node offsets, or record indexes in leaves).
+#define SNAPSHOT_MAGIC "RUN2SNAP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_order;
+    uint64_t file_size;
+    uint64_t record_count;
+    uint64_t node_count;
+    uint64_t records_offset;
+    uint64_t nodes_offset;
+    uint64_t root_offset;        // 0 for an empty tree
+    uint32_t payload_checksum;   // CRC-32 of everything after the header
+    uint32_t header_checksum;    // CRC-32 of the header with this field zeroed
+} SnapshotHeader;
+
+typedef struct SnapshotRecord {
+    int32_t atomic_number;
+    char symbol[4];
+    char name[32];
+    double atomic_mass;
+} SnapshotRecord;
+
+typedef struct SnapshotNode {
+    uint32_t num_keys;
+    uint32_t is_leaf;
+    uint64_t next;               // offset of the next leaf, 0 at the end of the chain
+    int32_t keys[];
+} SnapshotNode;
+
+typedef struct SnapshotFile {
+    const char *base;
+    size_t size;
+    const SnapshotHeader *header;
+    size_t refs_offset;          // offset of the reference array inside a node
+    size_t node_size;
+} SnapshotFile;
+
+typedef struct SnapshotCursor {
+    const SnapshotFile *snapshot;
+    const SnapshotNode *leaf;
+    uint32_t pos;
+    int upper;
+} SnapshotCursor;
+
+// Packed, read-only form of the tree (see pack_tree()). Records are kept in
+// key order in runs of PACKED_RUN_RECORDS. A lookup binary searches the
+// first keys of the runs and decodes one run. Each record is three varints:
+// the gap to the previous key (0 for the first of a run), then the ids of
+// its name and of its symbol in a table holding each distinct string once.
+// Masses are stored apart, one double per record in key order.
+#define PACKED_RUN_RECORDS 32
+
+typedef struct PackedTree {
+    long count;
+    long num_runs;
+    int *first_keys;             // first key of each run
+    size_t *run_offsets;         // start of each run in codes, then the end of the last
+    unsigned char *codes;
+    double *masses;
+    int num_strings;
+    uint32_t *string_offsets;    // start of each string in strings
+    char *strings;               // names and symbols, each NUL-terminated
+    size_t bytes;                // everything above, allocated
+} PackedTree;
+
+// Nodes that fill whole pages are allocated page-aligned, so a node never straddles two pages.
+#define NODE_ALIGN (sizeof(Node) % 4096 == 0 ? 4096 : 64)
+
+Pool node_pool = {sizeof(Node), NODE_ALIGN};
+Pool element_pool = {sizeof(Element), sizeof(double)};
+Pool index_node_pool = {sizeof(IndexNode), sizeof(void *)};
+Pool trie_node_pool = {sizeof(TrieNode), sizeof(void *)};
+StringPool name_strings = {NULL, 0, 0, 0};
+
 Node *root = NULL;
 
+// Target fraction of MAX_ELEMENTS that bulk_load() packs into each node.
+double bulk_load_fill = 0.9;
+
+// Deferred rebalancing: while set, delete() takes the record out of its leaf
+// and leaves underfull leaves for compact_tree() to fix later. In concurrent
+// mode such a delete locks nothing but its leaf.
+// deferred_deletes counts the deletes made since the last compaction.
+int defer_rebalance = 0;
+long deferred_deletes = 0;
+
+int compare_by_name(const Element *a, const Element *b);
+int compare_by_mass(const Element *a, const Element *b);
+int compare_by_number(const Element *a, const Element *b);
+const char *element_name_key(const Element *element);
+const char *element_symbol_key(const Element *element);
+
+SymbolIndex symbol_index = {NULL, 0, 0, 0};
+OrderedIndex name_index = {NULL, compare_by_name, 0};
+OrderedIndex mass_index = {NULL, compare_by_mass, 0};
+Trie name_trie = {NULL, element_name_key, 0};
+Trie symbol_trie = {NULL, element_symbol_key, 0};
+ResultCache result_cache;
+
+// Block of each atomic number 1..118, one string per period.
+const char element_blocks[] =
+    "-"
+    "ss"                                   // 1-2
+    "sspppppp"                             // 3-10
+    "sspppppp"                             // 11-18
+    "ssddddddddddpppppp"                   // 19-36
+    "ssddddddddddpppppp"                   // 37-54
+    "ssfffffffffffffffdddddddddpppppp"     // 55-86
+    "ssfffffffffffffffdddddddddpppppp";    // 87-118
+
+BlockList block_lists[4];
+
+// When set, the program is serving reads from a mapped snapshot and the in-memory tree is empty.
+SnapshotFile *mapped_snapshot = NULL;
+
+// When set, the records are packed (see pack_tree()) and the in-memory tree is empty.
+PackedTree *packed_tree = NULL;
+
+// Concurrent mode (see enable_concurrency()). root_version guards the root
+// pointer the same way a node's version guards the node; pool_mutex guards the
+// node and element pools and the retired list, index_mutex the secondary
+// indexes and block lists.
+int tree_concurrent = 0;
+uint64_t root_version = 0;
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Elements deleted in concurrent mode: a reader may still hold them, so they
+// are only returned to the pool by reclaim_retired_elements().
+Element **retired_elements = NULL;
+int retired_count = 0;
+int retired_capacity = 0;
+
+// Copy-on-write views. cow_epoch numbers the stretches of writes between two
+// view_open() calls; newest_view_epoch is the epoch of the newest open view
+// (0 with none). In concurrent mode cow_writers counts the write attempts in
+// progress and cow_gate holds new ones back while a view is being opened.
+// view_mutex guards the list of open views; retired_versions (guarded by
+// pool_mutex) holds what open views may still read.
+uint64_t cow_epoch = 1;
+uint64_t newest_view_epoch = 0;
+long cow_writers = 0;
+int cow_gate = 0;
+TreeView *open_views = NULL;
+pthread_mutex_t view_mutex = PTHREAD_MUTEX_INITIALIZER;
+RetiredVersion *retired_versions = NULL;
+int retired_version_count = 0;
+int retired_version_capacity = 0;
+
+// Parallel scans: scan_threads is the number of threads a scan may use (0
+// for one per online CPU, 1 to scan serially). The pool's workers sleep on
+// scan_start between jobs; scan_generation tells them a new one is posted,
+// and scan_busy counts those still on it. scan_run_mutex lets one scan use
+// the pool at a time.
+int scan_threads = 0;
+pthread_t *scan_workers = NULL;
+int scan_num_workers = 0;
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t scan_run_mutex = PTHREAD_MUTEX_INITIALIZER;
+ScanJob *scan_job = NULL;
+unsigned long scan_generation = 0;
+int scan_busy = 0;
+int scan_stopping = 0;
+
+// Instrumentation state: counting is on while stats_enabled is set;
+// perf_fds holds the hardware counters opened by stats_enable(1), -1 where
+// the kernel refused one.
+int stats_enabled = 0;
+TreeStats tree_stats;
+#define STATS_PERF_COUNTERS 5
+int perf_fds[STATS_PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+const char block_names[4] = {'s', 'p', 'd', 'f'};
+
 //Functions used:
-void insert(Element *element);
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *object);
+void pool_destroy(Pool *pool);
+const char *string_intern(StringPool *pool, const char *text);
+void string_release(StringPool *pool, const char *text);
+void string_pool_destroy(StringPool *pool);
+int insert(Element *element);
+long insert_batch(Element **elements, int count, int policy);
 Element *create_element(int atomic_number, const char *symbol, const char *name, double atomic_mass);
+char element_block(int atomic_number);
+void free_element(Element *element);
 Node *create_node(int is_leaf);
+void free_node(Node *node);
+void destroy_tree(void);
+void bulk_load(Element **elements, int count);
+void node_refresh_stats(Node *node);
 void split_node(Node *parent, int index, Node *child);
+int node_lower_bound(const Node *node, int key);
+int node_upper_bound(const Node *node, int key);
 Element *search(int atomic_number);
-void delete_adjust(Node *parent);
-void delete(int atomic_number);
+int delete_adjust(Node *parent, int index);
+int delete(int atomic_number);
+long delete_range(int lower, int upper);
+int compact_tree(void);
+void enable_concurrency(void);
+void disable_concurrency(void);
+void retire_element(Element *element);
+void reclaim_retired_elements(void);
+Element *search_concurrent(int atomic_number);
+int insert_concurrent(Element *element);
+int delete_concurrent(int atomic_number);
+void cursor_seek_concurrent(Cursor *cursor, int lower, int upper);
+Element *cursor_next_concurrent(Cursor *cursor);
+TreeView *view_open(void);
+void view_close(TreeView *view);
+Element *view_search(const TreeView *view, int atomic_number);
+void view_cursor_seek(ViewCursor *cursor, const TreeView *view, int lower, int upper);
+Element *view_cursor_next(ViewCursor *cursor);
+void view_range_search(const TreeView *view, int lower, int upper);
+void view_display_block_elements(const TreeView *view, char block);
+void scan_printf(ScanTask *task, const char *format, ...);
+long parallel_scan(int lower, int upper, ScanEmit emit, FILE *output);
+long parallel_scan_list(Element **elements, int count, ScanEmit emit, FILE *output);
+int parallel_scan_worthwhile(long records);
+int scan_thread_count(void);
+void scan_pool_stop(void);
+void stats_enable(int hardware);
+void stats_disable(void);
+void stats_reset(void);
+void stats_dump_json(FILE *output);
+void search_batch(const int *keys, int count, Element **out);
+void cursor_seek(Cursor *cursor, int lower, int upper);
+Element *cursor_next(Cursor *cursor);
 void range_search(int lower, int upper);
+void result_cache_enable(int max_entries, long max_records);
+void result_cache_disable(void);
+void result_cache_clear(void);
+void result_cache_invalidate(int atomic_number);
+long cached_range_scan(int lower, int upper, int (*visit)(Element *element, void *arg), void *arg);
+long cached_range_listing(int lower, int upper, int (*visit)(Element *element, void *arg), ScanEmit emit,
+                          FILE *output);
+Aggregate range_aggregate(int lower, int upper);
+long rank(int atomic_number);
+Element *select_element(long position);
+void index_element(Element *element);
+void unindex_element(Element *element);
+void symbol_index_insert(Element *element);
+void symbol_index_remove(Element *element);
+void enable_symbol_index(void);
+void enable_name_index(void);
+void enable_mass_index(void);
+Element *search_by_symbol(const char *symbol);
+Element *search_by_name(const char *name);
+long mass_range_scan(double lower, double upper, int (*visit)(Element *element, void *arg), void *arg);
+void mass_range_search(double lower, double upper);
+void trie_insert(Trie *trie, Element *element);
+void trie_remove(Trie *trie, Element *element);
+void enable_prefix_index(void);
+int prefix_search(Trie *trie, const char *prefix, TrieMatch *matches, int limit);
+int fuzzy_search(Trie *trie, const char *query, int max_distance, TrieMatch *matches, int limit);
+void ordered_index_insert(OrderedIndex *index, Element *element);
+void ordered_index_remove(OrderedIndex *index, Element *element);
+int ordered_index_scan(IndexNode *node, int (*compare)(const Element *a, const Element *b),
+                       const Element *lower, const Element *upper,
+                       int (*visit)(Element *element, void *arg), void *arg);
 void print_tree(Node *node);
-void display_s_block_elements(Node *node);
-void display_p_block_elements(Node *node);
-void display_d_block_elements(Node *node);
-void display_f_block_elements(Node *node);
+BlockList *block_list(char block);
+void block_list_insert(Element *element);
+void block_list_remove(Element *element);
+void display_block_elements(char block);
+int snapshot_save(const char *path);
+SnapshotFile *snapshot_open(const char *path, int verify_payload);
+void snapshot_close(SnapshotFile *snapshot);
+const SnapshotRecord *snapshot_search(const SnapshotFile *snapshot, int atomic_number);
+void snapshot_cursor_seek(SnapshotCursor *cursor, const SnapshotFile *snapshot, int lower, int upper);
+const SnapshotRecord *snapshot_cursor_next(SnapshotCursor *cursor);
+void snapshot_materialize(void);
+int pack_tree(void);
+void unpack_tree(void);
+Element *packed_search(int atomic_number);
+void packed_free(PackedTree *packed);
+long packed_scan(int lower, int upper, int (*visit)(Element *element, void *arg), void *arg);
+int wal_open(const char *path, const char *snapshot_path, int sync_every, int sync_delay_ms,
+             uint64_t checkpoint_every);
+void wal_log_insert(const Element *element);
+void wal_log_delete(int atomic_number);
+void wal_log_delete_range(int lower, int upper);
+int wal_sync(void);
+int wal_checkpoint(void);
+void wal_maybe_checkpoint(void);
+void wal_close(void);
+int run_batch(FILE *input, FILE *output);
+size_t server_encode_request(char *frame, int opcode, int lower, int upper, const Element *record);
+int run_server(const char *address);
 
 
-void initialize_tree_from_file(const char *filename) {
-    FILE *file = fopen("elements.txt", "r");
-    if (file == NULL) {
-        printf("Failed to open file.\n");
-        return;
+// Parses [p, end) as a whole decimal int.
+static int ingest_parse_int(const char *p, const char *end, int *value) {
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    if (p == end) {
+        return 0;
+    }
+    long parsed = 0;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+        parsed = parsed * 10 + (*p - '0');
+        if (parsed > (long)INT_MAX + 1) {
+            return 0;
+        }
     }
+    if (!negative && parsed > INT_MAX) {
+        return 0;
+    }
+    *value = (int)(negative ? -parsed : parsed);
+    return 1;
+}
 
-    int atomic_number;
-    char symbol[3];
-    char name[30];
-    double atomic_mass;
 
-    while (fscanf(file, "%d %s %s %lf", &atomic_number, symbol, name, &atomic_mass) == 4) {
-        insert(create_element(atomic_number, symbol, name, atomic_mass));
+// Parses [p, end) as a whole decimal number: sign, digits with an optional
+// point, optional exponent. Short ones (up to 15 digits, exponent within
+// 22) are one exact multiply or divide, which rounds the same as strtod();
+// anything longer goes to strtod() from a terminated copy.
+static int ingest_parse_double(const char *p, const char *end, double *value) {
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = p;
+    int negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;              // significant ones
+    int any_digits = 0;
+    int scale = 0;
+    int seen_point = 0;
+    for (; p < end && ((*p >= '0' && *p <= '9') || (*p == '.' && !seen_point)); p++) {
+        if (*p == '.') {
+            seen_point = 1;
+            continue;
+        }
+        any_digits = 1;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits += mantissa != 0;
+            scale -= seen_point;
+        } else {
+            digits++;
+            scale += !seen_point;
+        }
+    }
+    if (!any_digits) {
+        return 0;
+    }
+    int exponent = 0;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        int exponent_negative = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) {
+            p++;
+        }
+        if (p == end) {
+            return 0;
+        }
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (exponent < 100000) {
+                exponent = exponent * 10 + (*p - '0');
+            }
+        }
+        exponent = exponent_negative ? -exponent : exponent;
+    }
+    if (p != end) {
+        return 0;
+    }
+    scale += exponent;
+    if (digits <= 15 && scale >= -22 && scale <= 22) {
+        double parsed = (double)mantissa;
+        parsed = scale < 0 ? parsed / powers[-scale] : parsed * powers[scale];
+        *value = negative ? -parsed : parsed;
+        return 1;
+    }
+    char copy[64];
+    if (end - start >= (long)sizeof(copy)) {
+        return 0;
     }
+    memcpy(copy, start, end - start);
+    copy[end - start] = '\0';
+    *value = strtod(copy, NULL);
+    return 1;
+}
+
 
-    fclose(file);
+// Parses one line, [p, end) without its line break, as "number symbol
+// name mass" separated by spaces or tabs. Returns 1 for a record, 0 for a
+// blank line, and -1 with *message set for anything else.
+static int ingest_parse_line(const char *p, const char *end, IngestRecord *record, const char **message) {
+    const char *fields[5];
+    const char *field_ends[5];
+    int num_fields = 0;
+    while (p < end) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (num_fields == 4) {
+            *message = "too many fields";
+            return -1;
+        }
+        fields[num_fields] = p;
+        while (p < end && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        field_ends[num_fields++] = p;
+    }
+    if (num_fields == 0) {
+        return 0;
+    }
+    if (num_fields < 4) {
+        *message = "expected number symbol name mass";
+        return -1;
+    }
+    if (!ingest_parse_int(fields[0], field_ends[0], &record->atomic_number)) {
+        *message = "bad atomic number";
+        return -1;
+    }
+    long symbol_length = field_ends[1] - fields[1];
+    if (symbol_length > 2) {
+        *message = "symbol longer than 2 characters";
+        return -1;
+    }
+    memcpy(record->symbol, fields[1], symbol_length);
+    record->symbol[symbol_length] = '\0';
+    long name_length = field_ends[2] - fields[2];
+    if (name_length > 29) {
+        *message = "name longer than 29 characters";
+        return -1;
+    }
+    record->name = fields[2];
+    record->name_length = (unsigned char)name_length;
+    if (!ingest_parse_double(fields[3], field_ends[3], &record->atomic_mass) || isnan(record->atomic_mass)) {
+        *message = "bad atomic mass";
+        return -1;
+    }
+    return 1;
 }
 
 
-Element *create_element(int atomic_number, const char *symbol, const char *name, double atomic_mass) {
-    Element *element = (Element *)malloc(sizeof(Element));
-    element->atomic_number = atomic_number;
-    strcpy(element->symbol, symbol);
-    strcpy(element->name, name);
-    element->atomic_mass = atomic_mass;
-    return element;
+// By atomic number, then position in the file.
+static int compare_ingest_records(const void *a, const void *b) {
+    const IngestRecord *x = (const IngestRecord *)a;
+    const IngestRecord *y = (const IngestRecord *)b;
+    if (x->atomic_number != y->atomic_number) {
+        return x->atomic_number < y->atomic_number ? -1 : 1;
+    }
+    return (x->name > y->name) - (x->name < y->name);
 }
 
 
-Node *create_node(int is_leaf) {
-    Node *node = (Node *)malloc(sizeof(Node));
-    node->num_keys = 0;
-    node->elements = (Element **)malloc(MAX_ELEMENTS * sizeof(Element *));
-    node->children = (Node **)malloc((MAX_ELEMENTS + 1) * sizeof(Node *));
-    node->next = NULL;
-    node->is_leaf = is_leaf;
-    return node;
+// Thread body: parses every line of one chunk, then sorts its records.
+static void *ingest_parse_chunk(void *arg) {
+    IngestChunk *chunk = (IngestChunk *)arg;
+    const char *p = chunk->begin;
+    while (p < chunk->end) {
+        const char *line_end = (const char *)memchr(p, '\n', chunk->end - p);
+        const char *next = line_end != NULL ? line_end + 1 : chunk->end;
+        if (line_end == NULL) {
+            line_end = chunk->end;
+        }
+        if (line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+        chunk->lines++;
+
+        if (chunk->count == chunk->capacity) {
+            chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+            chunk->records = (IngestRecord *)realloc(chunk->records, chunk->capacity * sizeof(IngestRecord));
+        }
+        IngestRecord *record = &chunk->records[chunk->count];
+        const char *message = NULL;
+        int parsed = ingest_parse_line(p, line_end, record, &message);
+        if (parsed > 0) {
+            if (chunk->count > 0 && record->atomic_number <= chunk->records[chunk->count - 1].atomic_number) {
+                chunk->sorted = 0;
+            }
+            chunk->count++;
+        } else if (parsed < 0) {
+            if (chunk->num_errors < INGEST_MAX_ERRORS) {
+                chunk->error_lines[chunk->num_errors] = chunk->lines;
+                chunk->error_messages[chunk->num_errors] = message;
+            }
+            chunk->num_errors++;
+        }
+        p = next;
+    }
+    if (!chunk->sorted) {
+        qsort(chunk->records, chunk->count, sizeof(IngestRecord), compare_ingest_records);
+    }
+    return NULL;
 }
 
 
-void split_node(Node *parent, int index, Node *child) {
-    Node *new_node = create_node(child->is_leaf);
-    new_node->num_keys = MAX_ELEMENTS / 2;
-    
-    for (int i = 0; i < new_node->num_keys; i++) {
-        new_node->elements[i] = child->elements[MAX_ELEMENTS / 2 + i];
+// Whether chunk a's next record goes before chunk b's; ties go to the
+// earlier chunk, so the record that comes first in the file wins.
+static int ingest_chunk_before(const IngestChunk *chunks, const long *next, int a, int b) {
+    int x = chunks[a].records[next[a]].atomic_number;
+    int y = chunks[b].records[next[b]].atomic_number;
+    return x < y || (x == y && a < b);
+}
+
+
+static void ingest_heap_sift_down(const IngestChunk *chunks, const long *next, int *heap, int size, int slot) {
+    for (;;) {
+        int smallest = slot;
+        int left = 2 * slot + 1;
+        int right = left + 1;
+        if (left < size && ingest_chunk_before(chunks, next, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < size && ingest_chunk_before(chunks, next, heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == slot) {
+            return;
+        }
+        int swap = heap[slot];
+        heap[slot] = heap[smallest];
+        heap[smallest] = swap;
+        slot = smallest;
     }
-    
-    if (!child->is_leaf) {
-        for (int i = 0; i <= new_node->num_keys; i++) {
-            new_node->children[i] = child->children[MAX_ELEMENTS / 2 + i];
+}
+
+
+// Loads the records of a text file with one "number symbol name mass" per
+// line. The file is mapped and cut into line-aligned chunks of at least
+// INGEST_CHUNK_MIN_BYTES, parsed and sorted in parallel on up to
+// scan_threads threads. Lines that don't parse are skipped and reported by
+// line number. The chunks are then merged into elements in key order,
+// keeping the first record of each number, and packed bottom-up with
+// bulk_load() into an empty tree or merged in with insert_batch().
+// Returns the number of records added, or -1 if the file could not be read.
+long initialize_tree_from_file(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("Failed to open %s.\n", filename);
+        if (fd >= 0) {
+            close(fd);
         }
+        return -1;
     }
-    
-    child->num_keys = MAX_ELEMENTS / 2;
-    
-    for (int i = parent->num_keys; i >= index + 1; i--) {
-        parent->children[i + 1] = parent->children[i];
+    size_t size = (size_t)info.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
     }
-    parent->children[index + 1] = new_node;
-    
-    for (int i = parent->num_keys - 1; i >= index; i--) {
-        parent->elements[i + 1] = parent->elements[i];
+    const char *base = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Failed to map %s.\n", filename);
+        return -1;
+    }
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+
+    int num_chunks = scan_thread_count();
+    if ((size_t)num_chunks > size / INGEST_CHUNK_MIN_BYTES) {
+        num_chunks = size / INGEST_CHUNK_MIN_BYTES > 0 ? (int)(size / INGEST_CHUNK_MIN_BYTES) : 1;
+    }
+    IngestChunk *chunks = (IngestChunk *)calloc(num_chunks, sizeof(IngestChunk));
+    const char *end = base + size;
+    for (int i = 0; i < num_chunks; i++) {
+        // Each chunk but the first starts just past a line break.
+        const char *begin = base + size / num_chunks * i;
+        while (begin > base && begin < end && begin[-1] != '\n') {
+            begin++;
+        }
+        chunks[i].begin = begin;
+        chunks[i].sorted = 1;
+        if (i > 0) {
+            chunks[i - 1].end = begin;
+        }
+    }
+    chunks[num_chunks - 1].end = end;
+    for (int i = 1; i < num_chunks; i++) {
+        chunks[i].started = pthread_create(&chunks[i].thread, NULL, ingest_parse_chunk, &chunks[i]) == 0;
+    }
+    ingest_parse_chunk(&chunks[0]);
+    // A chunk whose thread could not be started is parsed here instead.
+    for (int i = 1; i < num_chunks; i++) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        } else {
+            ingest_parse_chunk(&chunks[i]);
+        }
+    }
+
+    long total = 0;
+    long line = 0;
+    long errors = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        IngestChunk *chunk = &chunks[i];
+        for (long e = 0; e < chunk->num_errors && e < INGEST_MAX_ERRORS && errors + e < INGEST_MAX_ERRORS; e++) {
+            printf("%s:%ld: %s\n", filename, line + chunk->error_lines[e], chunk->error_messages[e]);
+        }
+        errors += chunk->num_errors;
+        line += chunk->lines;
+        total += chunk->count;
+    }
+    if (errors > INGEST_MAX_ERRORS) {
+        printf("%s: %ld more lines skipped.\n", filename, errors - INGEST_MAX_ERRORS);
     }
-    parent->elements[index] = child->elements[MAX_ELEMENTS / 2 - 1];
-    
-    parent->num_keys++;
-}
 
+    // The sorted chunks are merged and the records created here, on one
+    // thread, since the pools and the name interning are not thread-safe.
+    // Creating them in key order also lays them out in key order.
+    Element **elements = (Element **)malloc((total > 0 ? total : 1) * sizeof(Element *));
+    long *next = (long *)calloc(num_chunks, sizeof(long));
+    int *heap = (int *)malloc(num_chunks * sizeof(int));
+    int heap_size = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        if (chunks[i].count > 0) {
+            heap[heap_size++] = i;
+        }
+    }
+    for (int slot = heap_size / 2 - 1; slot >= 0; slot--) {
+        ingest_heap_sift_down(chunks, next, heap, heap_size, slot);
+    }
+    long count = 0;
+    char name[30];
+    while (heap_size > 0) {
+        IngestChunk *chunk = &chunks[heap[0]];
+        const IngestRecord *record = &chunk->records[next[heap[0]]++];
+        if (next[heap[0]] == chunk->count) {
+            heap[0] = heap[--heap_size];
+        }
+        ingest_heap_sift_down(chunks, next, heap, heap_size, 0);
+        if (count > 0 && record->atomic_number == elements[count - 1]->atomic_number) {
+            continue;
+        }
+        memcpy(name, record->name, record->name_length);
+        name[record->name_length] = '\0';
+        elements[count++] = create_element(record->atomic_number, record->symbol, name, record->atomic_mass);
+    }
+    for (int i = 0; i < num_chunks; i++) {
+        free(chunks[i].records);
+    }
+    free(chunks);
+    free(next);
+    free(heap);
+    munmap((void *)base, size);
 
-void insert(Element *element) {
+    long added = count;
     if (root == NULL) {
-        root = create_node(1);
-        root->elements[0] = element;
-        root->num_keys = 1;
+        bulk_load(elements, (int)count);
     } else {
-        if (root->num_keys == MAX_ELEMENTS) {
-            Node *new_root = create_node(0);
-            new_root->children[0] = root;
-            split_node(new_root, 0, root);
-            root = new_root;
+        added = insert_batch(elements, (int)count, UPSERT_KEEP);
+        if (added < 0) {
+            for (long i = 0; i < count; i++) {
+                free_element(elements[i]);
+            }
         }
-        Node *cur = root;
-        while (!cur->is_leaf) {
-            int i = cur->num_keys - 1;
-            while (i >= 0 && element->atomic_number < cur->elements[i]->atomic_number) {
-                i--;
+    }
+    free(elements);
+    return added;
+}
+
+
+// Number of nodes to cut count entries into so that each node holds about
+// per_node of them but never fewer than min_per_node (unless there is only one).
+static int bulk_group_count(int count, int per_node, int min_per_node) {
+    int groups = (count + per_node - 1) / per_node;
+    if (groups > count / min_per_node) {
+        groups = count / min_per_node;
+    }
+    return groups < 1 ? 1 : groups;
+}
+
+
+// Builds the tree bottom-up from elements sorted by strictly increasing atomic
+// number. Records are packed left to right into chained leaves of about
+// bulk_load_fill * MAX_ELEMENTS keys, then each internal level is built over
+// the one below it, taking the first key of every child but the first as
+// its separators. The tree must be empty.
+void bulk_load(Element **elements, int count) {
+    if (count == 0) {
+        return;
+    }
+
+    int per_node = (int)(MAX_ELEMENTS * bulk_load_fill);
+    if (per_node < MIN_KEYS + 1) {
+        per_node = MIN_KEYS + 1;
+    }
+    if (per_node > MAX_ELEMENTS) {
+        per_node = MAX_ELEMENTS;
+    }
+
+    int groups = bulk_group_count(count, per_node, MIN_KEYS);
+    Node **level = (Node **)malloc(groups * sizeof(Node *));
+    int *low_keys = (int *)malloc(groups * sizeof(int));
+    Node *prev = NULL;
+    int pos = 0;
+    for (int g = 0; g < groups; g++) {
+        Node *leaf = create_node(1);
+        int k = count / groups + (g < count % groups);
+        for (int j = 0; j < k; j++) {
+            leaf->keys[j] = elements[pos]->atomic_number;
+            leaf->elements[j] = elements[pos];
+            index_element(elements[pos]);
+            pos++;
+        }
+        leaf->num_keys = k;
+        node_refresh_stats(leaf);
+        if (prev != NULL) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level[g] = leaf;
+        low_keys[g] = leaf->keys[0];
+    }
+
+    // Internal levels are rebuilt in place: a level never writes ahead of what it has consumed.
+    int num_nodes = groups;
+    while (num_nodes > 1) {
+        groups = bulk_group_count(num_nodes, per_node + 1, MIN_KEYS + 1);
+        int child_pos = 0;
+        for (int g = 0; g < groups; g++) {
+            Node *node = create_node(0);
+            int c = num_nodes / groups + (g < num_nodes % groups);
+            int low_key = low_keys[child_pos];
+            for (int j = 0; j < c; j++) {
+                if (j > 0) {
+                    node->keys[j - 1] = low_keys[child_pos];
+                }
+                node->children[j] = level[child_pos++];
+            }
+            node->num_keys = c - 1;
+            node_refresh_stats(node);
+            level[g] = node;
+            low_keys[g] = low_key;
+        }
+        num_nodes = groups;
+    }
+    root = level[0];
+
+    free(low_keys);
+    free(level);
+}
+
+
+void *pool_alloc(Pool *pool) {
+    if (pool->free_list != NULL) {
+        void *object = pool->free_list;
+        pool->free_list = *(void **)object;
+        pool->live_objects++;
+        return object;
+    }
+    size_t stride = (pool->object_size + pool->align - 1) / pool->align * pool->align;
+    if (pool->bump == NULL || pool->bump + stride > pool->bump_end) {
+        size_t header = (sizeof(PoolChunk) + pool->align - 1) / pool->align * pool->align;
+        size_t bytes = POOL_CHUNK_BYTES;
+        if (bytes < header + stride) {
+            bytes = header + stride;
+        }
+        bytes = (bytes + pool->align - 1) / pool->align * pool->align;
+        PoolChunk *chunk = (PoolChunk *)aligned_alloc(pool->align < sizeof(void *) ? sizeof(void *) : pool->align, bytes);
+        if (chunk == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->chunk_count++;
+        pool->bump = (char *)chunk + header;
+        pool->bump_end = (char *)chunk + bytes;
+    }
+    void *object = pool->bump;
+    pool->bump += stride;
+    pool->live_objects++;
+    return object;
+}
+
+
+void pool_free(Pool *pool, void *object) {
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->live_objects--;
+}
+
+
+// Releases every chunk at once; all objects handed out by the pool become invalid.
+void pool_destroy(Pool *pool) {
+    PoolChunk *chunk = pool->chunks;
+    while (chunk != NULL) {
+        PoolChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pool->chunks = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+    pool->free_list = NULL;
+    pool->live_objects = 0;
+    pool->chunk_count = 0;
+}
+
+
+// Optimistic lock coupling primitives over a node (or root) version word.
+// Readers take no lock: they record the version, read, and validate that it
+// did not move. Writers upgrade a recorded version to a held lock, so a
+// writer never acts on a node that changed since it was read.
+#define VERSION_OBSOLETE 1
+#define VERSION_LOCKED 2
+
+static inline void version_backoff(int *spins) {
+    if (++*spins % 64 == 0) {
+        sched_yield();
+    }
+}
+
+
+// Waits out a writer and records the version. Returns 0 if the node has been freed.
+static inline int version_read_lock(const uint64_t *version, uint64_t *seen) {
+    int spins = 0;
+    uint64_t v = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    while (v & VERSION_LOCKED) {
+        version_backoff(&spins);
+        v = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    }
+    *seen = v;
+    return !(v & VERSION_OBSOLETE);
+}
+
+
+// Like version_read_lock(), but fails instead of waiting for a writer.
+static inline int version_try_read_lock(const uint64_t *version, uint64_t *seen) {
+    *seen = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    return !(*seen & (VERSION_LOCKED | VERSION_OBSOLETE));
+}
+
+
+// True if nothing was written since version_read_lock() returned seen.
+static inline int version_validate(const uint64_t *version, uint64_t seen) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(version, __ATOMIC_RELAXED) == seen;
+}
+
+
+static inline int version_upgrade(uint64_t *version, uint64_t seen) {
+    return __atomic_compare_exchange_n(version, &seen, seen + VERSION_LOCKED, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+// Releases a held lock; the carry out of the lock bit bumps the write count.
+static inline void version_unlock(uint64_t *version) {
+    __atomic_fetch_add(version, VERSION_LOCKED, __ATOMIC_RELEASE);
+}
+
+
+static inline void index_lock(void) {
+    if (tree_concurrent) {
+        pthread_mutex_lock(&index_mutex);
+    }
+}
+
+
+static inline void index_unlock(void) {
+    if (tree_concurrent) {
+        pthread_mutex_unlock(&index_mutex);
+    }
+}
+
+
+#if TREE_STATS
+#define STAT_ADD(counter, n)                          \
+    do {                                              \
+        if (stats_enabled) {                          \
+            stat_add(&tree_stats.counter, (n));       \
+        }                                             \
+    } while (0)
+#else
+#define STAT_ADD(counter, n) \
+    do {                     \
+    } while (0)
+#endif
+
+// Counters are only contended in concurrent mode.
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+    if (tree_concurrent) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    } else {
+        *counter += n;
+    }
+}
+
+
+// Start time of a timed operation, or 0 when stats are off.
+static inline uint64_t stats_start(void) {
+    if (!TREE_STATS || !stats_enabled) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+
+static void stats_finish(int op, uint64_t started) {
+    if (started == 0) {
+        return;
+    }
+    uint64_t elapsed = stats_start() - started;
+    LatencyHistogram *histogram = &tree_stats.latency[op];
+    int bucket = elapsed == 0 ? 0 : 63 - __builtin_clzll(elapsed);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    stat_add(&histogram->count, 1);
+    stat_add(&histogram->total_ns, elapsed);
+    stat_add(&histogram->buckets[bucket], 1);
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+
+// Queues object until no open view can read it. In concurrent mode the
+// caller holds pool_mutex.
+static void retire_version(void *object, Node *owner, int kind) {
+    if (retired_version_count == retired_version_capacity) {
+        retired_version_capacity = retired_version_capacity ? retired_version_capacity * 2 : 256;
+        retired_versions = (RetiredVersion *)realloc(retired_versions, retired_version_capacity * sizeof(RetiredVersion));
+    }
+    RetiredVersion *retired = &retired_versions[retired_version_count++];
+    retired->object = object;
+    retired->owner = owner;
+    retired->death = cow_epoch;
+    retired->kind = kind;
+}
+
+
+// Whether an open view may reach node's current or older contents.
+static inline int cow_visible(const Node *node) {
+    return node->prev_version != NULL || node->epoch <= __atomic_load_n(&newest_view_epoch, __ATOMIC_ACQUIRE);
+}
+
+
+// Called before a node is changed in place (under its lock in concurrent
+// mode). If an open view may still read the current contents, they are
+// copied onto the node's version chain first; either way the node is then
+// stamped with the writer's epoch, so it is copied at most once per epoch.
+static void cow_preserve(Node *node) {
+    uint64_t epoch = cow_epoch;
+    if (node->epoch >= epoch) {
+        return;
+    }
+    if (node->epoch > __atomic_load_n(&newest_view_epoch, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&node->epoch, epoch, __ATOMIC_RELEASE);
+        return;
+    }
+    if (tree_concurrent) {
+        pthread_mutex_lock(&pool_mutex);
+    }
+    Node *copy = (Node *)pool_alloc(&node_pool);
+    // Like create_node(), bump the recycled slot's version for stale readers.
+    uint64_t copy_version = __atomic_load_n(&copy->version, __ATOMIC_RELAXED);
+    memcpy(copy, node, sizeof(Node));
+    __atomic_store_n(&copy->version, (copy_version | (VERSION_OBSOLETE | VERSION_LOCKED)) + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&node->prev_version, copy, __ATOMIC_RELEASE);
+    __atomic_store_n(&node->epoch, epoch, __ATOMIC_RELEASE);
+    retire_version(copy, node, RETIRED_COPY);
+    STAT_ADD(cow_copies, 1);
+    if (tree_concurrent) {
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+
+// Brackets one concurrent write attempt. view_open() closes the gate and
+// waits for the attempts in progress, so every write lies wholly before or
+// wholly after a view's point in time, and cow_epoch is fixed for the
+// length of an attempt.
+static void cow_writer_enter(void) {
+    int spins = 0;
+    for (;;) {
+        __atomic_fetch_add(&cow_writers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&cow_gate, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        __atomic_fetch_sub(&cow_writers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&cow_gate, __ATOMIC_ACQUIRE)) {
+            version_backoff(&spins);
+        }
+    }
+}
+
+
+static inline void cow_writer_exit(void) {
+    __atomic_fetch_sub(&cow_writers, 1, __ATOMIC_RELEASE);
+}
+
+
+Element *create_element(int atomic_number, const char *symbol, const char *name, double atomic_mass) {
+    if (tree_concurrent) {
+        pthread_mutex_lock(&pool_mutex);
+    }
+    Element *element = (Element *)pool_alloc(&element_pool);
+    element->name = string_intern(&name_strings, name);
+    if (tree_concurrent) {
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    element->atomic_number = atomic_number;
+    strcpy(element->symbol, symbol);
+    element->atomic_mass = atomic_mass;
+    element->block = element_block(atomic_number);
+    element->symbol_next = NULL;
+    element->symbol_prev = NULL;
+    return element;
+}
+
+
+// Gives an element's memory back, with its reference to its name. Concurrent
+// callers hold pool_mutex.
+static void element_release(Element *element) {
+    string_release(&name_strings, element->name);
+    pool_free(&element_pool, element);
+}
+
+
+char element_block(int atomic_number) {
+    if (atomic_number < 1 || atomic_number > 118) {
+        return 0;
+    }
+    return element_blocks[atomic_number];
+}
+
+
+// While views are open an element is only retired: one of them may still hold it.
+void free_element(Element *element) {
+    if (tree_concurrent) {
+        pthread_mutex_lock(&pool_mutex);
+    }
+    if (__atomic_load_n(&newest_view_epoch, __ATOMIC_ACQUIRE) != 0) {
+        retire_version(element, NULL, RETIRED_ELEMENT);
+    } else {
+        element_release(element);
+    }
+    if (tree_concurrent) {
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+
+// A recycled node keeps counting from its old version (with the lock and
+// obsolete bits cleared), so a reader still holding the old version fails
+// validation instead of mistaking the new node for the one it was reading.
+Node *create_node(int is_leaf) {
+    if (tree_concurrent) {
+        pthread_mutex_lock(&pool_mutex);
+    }
+    Node *node = (Node *)pool_alloc(&node_pool);
+    if (tree_concurrent) {
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    uint64_t version = __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->version, (version | (VERSION_OBSOLETE | VERSION_LOCKED)) + 1, __ATOMIC_RELEASE);
+    node->num_keys = 0;
+    node->next = NULL;
+    node->is_leaf = is_leaf;
+    node->epoch = cow_epoch;
+    node->prev_version = NULL;
+    return node;
+}
+
+
+// In concurrent mode the caller must hold the node's lock; the node is
+// marked obsolete so readers that reach it restart. A node an open view may
+// still read is retired instead of returned to the pool.
+void free_node(Node *node) {
+    if (!tree_concurrent) {
+        if (cow_visible(node)) {
+            retire_version(node, NULL, RETIRED_NODE);
+        } else {
+            pool_free(&node_pool, node);
+        }
+        return;
+    }
+    __atomic_fetch_add(&node->version, VERSION_OBSOLETE + VERSION_LOCKED, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&pool_mutex);
+    if (cow_visible(node)) {
+        retire_version(node, NULL, RETIRED_NODE);
+    } else {
+        pool_free(&node_pool, node);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+// Tears down the whole tree, including every element, in one pass over the pool chunks.
+void destroy_tree(void) {
+    pool_destroy(&node_pool);
+    pool_destroy(&element_pool);
+    pool_destroy(&index_node_pool);
+    pool_destroy(&trie_node_pool);
+    string_pool_destroy(&name_strings);
+    root = NULL;
+    free(symbol_index.slots);
+    symbol_index.slots = NULL;
+    symbol_index.capacity = 0;
+    symbol_index.used = 0;
+    name_index.root = NULL;
+    mass_index.root = NULL;
+    name_trie.root = NULL;
+    symbol_trie.root = NULL;
+    result_cache_clear();
+    for (int i = 0; i < 4; i++) {
+        free(block_lists[i].elements);
+        block_lists[i].elements = NULL;
+        block_lists[i].count = 0;
+        block_lists[i].capacity = 0;
+    }
+    free(retired_elements);
+    retired_elements = NULL;
+    retired_count = 0;
+    retired_capacity = 0;
+    // Views must be closed first; whatever they kept alive went with the pools.
+    free(retired_versions);
+    retired_versions = NULL;
+    retired_version_count = 0;
+    retired_version_capacity = 0;
+    open_views = NULL;
+    newest_view_epoch = 0;
+    if (packed_tree != NULL) {
+        packed_free(packed_tree);
+        packed_tree = NULL;
+    }
+}
+
+
+// Rebuilds the in-memory tree if the records are in a mapped snapshot or
+// packed. Every entry point that changes the tree, or reads it other than
+// through search() and the range scans, calls this first.
+static inline void materialize_tree(void) {
+    if (mapped_snapshot != NULL) {
+        snapshot_materialize();
+    }
+    if (packed_tree != NULL) {
+        unpack_tree();
+    }
+}
+
+
+// Branch-free binary search over sorted keys: index of the first key >= key (len if none).
+static inline int keys_lower_bound(const int *keys, int len, int key) {
+    const int *base = keys;
+    if (len == 0) {
+        return 0;
+    }
+    while (len > 1) {
+        int half = len / 2;
+        base += (base[half - 1] < key) ? half : 0;
+        len -= half;
+    }
+    return (int)(base - keys) + (*base < key);
+}
+
+
+// Index of the first key > key (len if none).
+static inline int keys_upper_bound(const int *keys, int len, int key) {
+    const int *base = keys;
+    if (len == 0) {
+        return 0;
+    }
+    while (len > 1) {
+        int half = len / 2;
+        base += (base[half - 1] <= key) ? half : 0;
+        len -= half;
+    }
+    return (int)(base - keys) + (*base <= key);
+}
+
+
+int node_lower_bound(const Node *node, int key) {
+    return keys_lower_bound(node->keys, node->num_keys, key);
+}
+
+
+int node_upper_bound(const Node *node, int key) {
+    return keys_upper_bound(node->keys, node->num_keys, key);
+}
+
+
+static inline void aggregate_clear(Aggregate *aggregate) {
+    aggregate->count = 0;
+    aggregate->sum = 0.0;
+    aggregate->min = INFINITY;
+    aggregate->max = -INFINITY;
+}
+
+
+static inline void aggregate_add(Aggregate *aggregate, double mass) {
+    aggregate->count++;
+    aggregate->sum += mass;
+    if (mass < aggregate->min) {
+        aggregate->min = mass;
+    }
+    if (mass > aggregate->max) {
+        aggregate->max = mass;
+    }
+}
+
+
+static inline void aggregate_merge(Aggregate *aggregate, const Aggregate *other) {
+    aggregate->count += other->count;
+    aggregate->sum += other->sum;
+    if (other->min < aggregate->min) {
+        aggregate->min = other->min;
+    }
+    if (other->max > aggregate->max) {
+        aggregate->max = other->max;
+    }
+}
+
+
+// Recomputes node->stats from its records, or from its children's stats.
+void node_refresh_stats(Node *node) {
+    aggregate_clear(&node->stats);
+    if (node->is_leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            aggregate_add(&node->stats, node->elements[i]->atomic_mass);
+        }
+    } else {
+        for (int i = 0; i <= node->num_keys; i++) {
+            aggregate_merge(&node->stats, &node->children[i]->stats);
+        }
+    }
+}
+
+
+// Single-record aggregate of element's mass.
+static inline Aggregate element_stats(const Element *element) {
+    Aggregate aggregate = {1, element->atomic_mass, element->atomic_mass, element->atomic_mass};
+    return aggregate;
+}
+
+
+// Splits the full node parent->children[index] in two. A leaf split copies
+// the first key of the new right leaf up as the separator and links the new
+// leaf into the chain; an internal split moves its middle key up.
+void split_node(Node *parent, int index, Node *child) {
+    cow_preserve(parent);
+    cow_preserve(child);
+    Node *new_node = create_node(child->is_leaf);
+    int mid = child->num_keys / 2;
+    int separator;
+
+    if (child->is_leaf) {
+        STAT_ADD(leaf_splits, 1);
+        new_node->num_keys = child->num_keys - mid;
+        memcpy(new_node->keys, &child->keys[mid], new_node->num_keys * sizeof(int));
+        memcpy(new_node->elements, &child->elements[mid], new_node->num_keys * sizeof(Element *));
+        child->num_keys = mid;
+        separator = new_node->keys[0];
+        new_node->next = child->next;
+        child->next = new_node;
+    } else {
+        STAT_ADD(internal_splits, 1);
+        new_node->num_keys = child->num_keys - mid - 1;
+        memcpy(new_node->keys, &child->keys[mid + 1], new_node->num_keys * sizeof(int));
+        memcpy(new_node->children, &child->children[mid + 1], (new_node->num_keys + 1) * sizeof(Node *));
+        separator = child->keys[mid];
+        child->num_keys = mid;
+    }
+
+    memmove(&parent->keys[index + 1], &parent->keys[index], (parent->num_keys - index) * sizeof(int));
+    memmove(&parent->children[index + 2], &parent->children[index + 1], (parent->num_keys - index) * sizeof(Node *));
+    parent->keys[index] = separator;
+    parent->children[index + 1] = new_node;
+    parent->num_keys++;
+
+    // The parent still covers the same records. Writers in concurrent mode
+    // skip the stats; disable_concurrency() rebuilds them.
+    if (!tree_concurrent) {
+        node_refresh_stats(child);
+        node_refresh_stats(new_node);
+    }
+}
+
+
+// insert() outside concurrent mode.
+static int insert_serial(Element *element) {
+    int key = element->atomic_number;
+    if (root == NULL) {
+        root = create_node(1);
+        root->keys[0] = key;
+        root->elements[0] = element;
+        root->num_keys = 1;
+        root->stats = element_stats(element);
+        index_element(element);
+        wal_log_insert(element);
+        wal_maybe_checkpoint();
+        return 1;
+    }
+
+    if (root->num_keys == MAX_ELEMENTS) {
+        Node *new_root = create_node(0);
+        new_root->children[0] = root;
+        split_node(new_root, 0, root);
+        node_refresh_stats(new_root);
+        root = new_root;
+        STAT_ADD(root_splits, 1);
+    }
+    // The stats along the path are only updated once the insert is known to succeed.
+    Node *path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    Node *cur = root;
+    while (!cur->is_leaf) {
+        path[depth++] = cur;
+        int i = node_upper_bound(cur, key);
+        if (cur->children[i]->num_keys == MAX_ELEMENTS) {
+            split_node(cur, i, cur->children[i]);
+            if (key >= cur->keys[i]) {
+                i++;
+            }
+        }
+        cur = cur->children[i];
+    }
+
+    int pos = node_lower_bound(cur, key);
+    if (pos < cur->num_keys && cur->keys[pos] == key) {
+        return 0;
+    }
+    cow_preserve(cur);
+    memmove(&cur->keys[pos + 1], &cur->keys[pos], (cur->num_keys - pos) * sizeof(int));
+    memmove(&cur->elements[pos + 1], &cur->elements[pos], (cur->num_keys - pos) * sizeof(Element *));
+    cur->keys[pos] = key;
+    cur->elements[pos] = element;
+    cur->num_keys++;
+    aggregate_add(&cur->stats, element->atomic_mass);
+    while (depth > 0) {
+        aggregate_add(&path[--depth]->stats, element->atomic_mass);
+    }
+    index_element(element);
+    wal_log_insert(element);
+    wal_maybe_checkpoint();
+    return 1;
+}
+
+
+// Inserts element into its leaf, splitting full nodes on the way down.
+// Returns 0 without inserting if the atomic number is already present.
+int insert(Element *element) {
+    materialize_tree();
+    uint64_t started = stats_start();
+    int inserted = tree_concurrent ? insert_concurrent(element) : insert_serial(element);
+    if (!inserted) {
+        STAT_ADD(insert_duplicates, 1);
+    }
+    stats_finish(STAT_INSERT, started);
+    return inserted;
+}
+
+
+// Stable merge sort by atomic number, so records sharing one keep their
+// order. scratch has room for count / 2 elements.
+static void sort_by_number(Element **elements, Element **scratch, int count) {
+    if (count < 2) {
+        return;
+    }
+    int half = count / 2;
+    sort_by_number(elements, scratch, half);
+    sort_by_number(elements + half, scratch, count - half);
+    if (elements[half - 1]->atomic_number <= elements[half]->atomic_number) {
+        return;
+    }
+    // The right half stays in place; the merge never overtakes it.
+    memcpy(scratch, elements, half * sizeof(Element *));
+    int i = 0;
+    int j = half;
+    int k = 0;
+    while (i < half && j < count) {
+        elements[k++] = elements[j]->atomic_number < scratch[i]->atomic_number ? elements[j++] : scratch[i++];
+    }
+    while (i < half) {
+        elements[k++] = scratch[i++];
+    }
+}
+
+
+// Sorts elements by atomic number and keeps one record per number, the
+// first or (UPSERT_REPLACE) the last; the others are freed. Returns how
+// many are left at the front of elements.
+static int sort_unique(Element **elements, int count, int policy) {
+    Element **scratch = (Element **)malloc((count / 2 + 1) * sizeof(Element *));
+    sort_by_number(elements, scratch, count);
+    free(scratch);
+
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique > 0 && elements[unique - 1]->atomic_number == elements[i]->atomic_number) {
+            STAT_ADD(insert_duplicates, 1);
+            if (policy == UPSERT_REPLACE) {
+                free_element(elements[unique - 1]);
+                elements[unique - 1] = elements[i];
+            } else {
+                free_element(elements[i]);
+            }
+        } else {
+            elements[unique++] = elements[i];
+        }
+    }
+    return unique;
+}
+
+
+// Merges run (distinct keys in increasing order, at most MAX_ELEMENTS of
+// them, all bound for leaf) into leaf. parent holds leaf at index and has
+// room for one more child, or is NULL when leaf is the root. Replacements
+// happen in place; the new keys are then merged in from the back, so the
+// records before the first of them never move, unless they don't fit and
+// the leaf is split in two. The masses stored and dropped are added to
+// added and removed; the caller merges added along the path, or refreshes
+// the path when anything was dropped. Returns the
+// number of records of run stored.
+static int leaf_merge_run(Node *leaf, Node *parent, int index, Element **run, int count, int policy,
+                          Aggregate *added, Aggregate *removed) {
+    cow_preserve(leaf);
+    int fresh = 0;
+    int stored = 0;
+    int pos = node_lower_bound(leaf, run[0]->atomic_number);
+    for (int j = 0; j < count; j++) {
+        Element *element = run[j];
+        while (pos < leaf->num_keys && leaf->keys[pos] < element->atomic_number) {
+            pos++;
+        }
+        if (pos < leaf->num_keys && leaf->keys[pos] == element->atomic_number) {
+            STAT_ADD(insert_duplicates, 1);
+            if (policy != UPSERT_REPLACE) {
+                free_element(element);
+                continue;
+            }
+            aggregate_add(removed, leaf->elements[pos]->atomic_mass);
+            unindex_element(leaf->elements[pos]);
+            free_element(leaf->elements[pos]);
+            wal_log_delete(element->atomic_number);
+            leaf->elements[pos] = element;
+        } else {
+            run[fresh++] = element;
+        }
+        aggregate_add(added, element->atomic_mass);
+        index_element(element);
+        wal_log_insert(element);
+        stored++;
+    }
+
+    int total = leaf->num_keys + fresh;
+    if (total <= MAX_ELEMENTS) {
+        for (int k = total - 1, i = leaf->num_keys - 1, j = fresh - 1; j >= 0; k--) {
+            if (i >= 0 && leaf->keys[i] > run[j]->atomic_number) {
+                leaf->keys[k] = leaf->keys[i];
+                leaf->elements[k] = leaf->elements[i--];
+            } else {
+                leaf->keys[k] = run[j]->atomic_number;
+                leaf->elements[k] = run[j--];
+            }
+        }
+        leaf->num_keys = total;
+        if (removed->count > 0) {
+            node_refresh_stats(leaf);
+        } else {
+            aggregate_merge(&leaf->stats, added);
+        }
+        return stored;
+    }
+
+    int keys[2 * MAX_ELEMENTS];
+    Element *merged[2 * MAX_ELEMENTS];
+    for (int k = 0, i = 0, j = 0; k < total; k++) {
+        if (j == fresh || (i < leaf->num_keys && leaf->keys[i] < run[j]->atomic_number)) {
+            keys[k] = leaf->keys[i];
+            merged[k] = leaf->elements[i++];
+        } else {
+            keys[k] = run[j]->atomic_number;
+            merged[k] = run[j++];
+        }
+    }
+    int split = total / 2;
+    Node *right = create_node(1);
+    right->num_keys = total - split;
+    memcpy(right->keys, &keys[split], right->num_keys * sizeof(int));
+    memcpy(right->elements, &merged[split], right->num_keys * sizeof(Element *));
+    right->next = leaf->next;
+    leaf->next = right;
+    memcpy(leaf->keys, keys, split * sizeof(int));
+    memcpy(leaf->elements, merged, split * sizeof(Element *));
+    leaf->num_keys = split;
+    node_refresh_stats(leaf);
+    node_refresh_stats(right);
+    STAT_ADD(leaf_splits, 1);
+
+    int new_root = parent == NULL;
+    if (new_root) {
+        parent = create_node(0);
+        parent->children[0] = leaf;
+        root = parent;
+        index = 0;
+        STAT_ADD(root_splits, 1);
+    }
+    cow_preserve(parent);
+    memmove(&parent->keys[index + 1], &parent->keys[index], (parent->num_keys - index) * sizeof(int));
+    memmove(&parent->children[index + 2], &parent->children[index + 1], (parent->num_keys - index) * sizeof(Node *));
+    parent->keys[index] = right->keys[0];
+    parent->children[index + 1] = right;
+    parent->num_keys++;
+    if (new_root) {
+        node_refresh_stats(parent);
+    }
+    return stored;
+}
+
+
+// The bulk writers (insert_batch(), delete_range(), compact_tree()) change
+// many nodes without taking their version locks, which optimistic readers
+// would not notice, so they refuse to run in concurrent mode. Returns 1,
+// with a message, if the caller must refuse.
+static int refuse_concurrent(const char *operation) {
+    if (!tree_concurrent) {
+        return 0;
+    }
+    fprintf(stderr, "%s is not available in concurrent mode.\n", operation);
+    return 1;
+}
+
+
+// Inserts a batch of records, such as a delta load, in key order: the
+// records bound for one leaf go down together in a single descent (which
+// splits full internal nodes ahead of time, as insert() does) and are
+// merged into the leaf in one pass. At most MAX_ELEMENTS go down at a time,
+// so an overflowing leaf is always fixed by one split afterwards. A record whose atomic
+// number is taken, in the tree or earlier in the batch, is dropped under
+// UPSERT_KEEP and replaces the other record under UPSERT_REPLACE.
+// elements is sorted in place, and every element in it now belongs to the
+// tree: the ones not stored are freed. Each change is logged as insert()
+// and delete() log theirs. Returns the number of records stored. In
+// concurrent mode it refuses and returns -1, and elements stay the caller's.
+long insert_batch(Element **elements, int count, int policy) {
+    if (refuse_concurrent("insert_batch()")) {
+        return -1;
+    }
+    materialize_tree();
+    int unique = sort_unique(elements, count, policy);
+    long stored = 0;
+    int next = 0;
+    Node *path[MAX_TREE_HEIGHT];
+    int slots[MAX_TREE_HEIGHT];
+    while (next < unique) {
+        if (root == NULL) {
+            root = create_node(1);
+            aggregate_clear(&root->stats);
+        } else if (!root->is_leaf && root->num_keys == MAX_ELEMENTS) {
+            Node *new_root = create_node(0);
+            new_root->children[0] = root;
+            split_node(new_root, 0, root);
+            node_refresh_stats(new_root);
+            root = new_root;
+            STAT_ADD(root_splits, 1);
+        }
+
+        // limit is the first key past the leaf the descent ends in.
+        int key = elements[next]->atomic_number;
+        long limit = (long)INT_MAX + 1;
+        int depth = 0;
+        Node *cur = root;
+        while (!cur->is_leaf) {
+            int i = node_upper_bound(cur, key);
+            if (!cur->children[i]->is_leaf && cur->children[i]->num_keys == MAX_ELEMENTS) {
+                split_node(cur, i, cur->children[i]);
+                if (key >= cur->keys[i]) {
+                    i++;
+                }
+            }
+            if (i < cur->num_keys) {
+                limit = cur->keys[i];
+            }
+            path[depth] = cur;
+            slots[depth++] = i;
+            cur = cur->children[i];
+        }
+        STAT_ADD(descents, 1);
+        STAT_ADD(node_visits, depth + 1);
+
+        int end = next + 1;
+        while (end < unique && end - next < MAX_ELEMENTS && elements[end]->atomic_number < limit) {
+            end++;
+        }
+        Aggregate added;
+        Aggregate removed;
+        aggregate_clear(&added);
+        aggregate_clear(&removed);
+        stored += leaf_merge_run(cur, depth > 0 ? path[depth - 1] : NULL, depth > 0 ? slots[depth - 1] : 0,
+                                 &elements[next], end - next, policy, &added, &removed);
+        // Bottom-up, as in delete(), so a refresh reads children that are already current.
+        while (depth > 0) {
+            Node *node = path[--depth];
+            if (removed.count > 0) {
+                node_refresh_stats(node);
+            } else {
+                aggregate_merge(&node->stats, &added);
+            }
+        }
+        next = end;
+    }
+    wal_maybe_checkpoint();
+    return stored;
+}
+
+
+static Element *search_serial(int atomic_number) {
+    Node *cur = root;
+    if (cur == NULL) {
+        return NULL;
+    }
+    int visited = 1;
+    while (!cur->is_leaf) {
+        cur = cur->children[node_upper_bound(cur, atomic_number)];
+        visited++;
+    }
+    STAT_ADD(descents, 1);
+    STAT_ADD(node_visits, visited);
+    int i = node_lower_bound(cur, atomic_number);
+    if (i < cur->num_keys && cur->keys[i] == atomic_number) {
+        return cur->elements[i];
+    }
+    return NULL;
+}
+
+
+Element *search(int atomic_number) {
+    uint64_t started = stats_start();
+    Element *found;
+    if (packed_tree != NULL) {
+        found = packed_search(atomic_number);
+    } else {
+        found = tree_concurrent ? search_concurrent(atomic_number) : search_serial(atomic_number);
+    }
+    if (found == NULL) {
+        STAT_ADD(search_misses, 1);
+    }
+    stats_finish(STAT_SEARCH, started);
+    return found;
+}
+
+
+// Makes sure parent->children[index] has more than MIN_KEYS keys before the
+// delete descends into it, by borrowing one entry from a sibling or merging
+// with one. Returns the index of the child that now covers the same keys.
+// The parent's stats are unchanged; those of the nodes an entry moves
+// between are kept current (outside concurrent mode).
+int delete_adjust(Node *parent, int index) {
+    Node *cur = parent->children[index];
+    Node *left_sibling = index > 0 ? parent->children[index - 1] : NULL;
+    Node *right_sibling = index < parent->num_keys ? parent->children[index + 1] : NULL;
+    Aggregate moved;
+
+    cow_preserve(parent);
+    cow_preserve(cur);
+    // Borrow the last entry of the left sibling.
+    if (left_sibling && left_sibling->num_keys > MIN_KEYS) {
+        cow_preserve(left_sibling);
+        memmove(&cur->keys[1], &cur->keys[0], cur->num_keys * sizeof(int));
+        if (cur->is_leaf) {
+            memmove(&cur->elements[1], &cur->elements[0], cur->num_keys * sizeof(Element *));
+            cur->keys[0] = left_sibling->keys[left_sibling->num_keys - 1];
+            cur->elements[0] = left_sibling->elements[left_sibling->num_keys - 1];
+            parent->keys[index - 1] = cur->keys[0];
+        } else {
+            memmove(&cur->children[1], &cur->children[0], (cur->num_keys + 1) * sizeof(Node *));
+            cur->keys[0] = parent->keys[index - 1];
+            cur->children[0] = left_sibling->children[left_sibling->num_keys];
+            parent->keys[index - 1] = left_sibling->keys[left_sibling->num_keys - 1];
+        }
+        cur->num_keys++;
+        left_sibling->num_keys--;
+        STAT_ADD(borrows, 1);
+        if (!tree_concurrent) {
+            moved = cur->is_leaf ? element_stats(cur->elements[0]) : cur->children[0]->stats;
+            aggregate_merge(&cur->stats, &moved);
+            node_refresh_stats(left_sibling);
+        }
+        return index;
+    }
+
+    // Borrow the first entry of the right sibling.
+    if (right_sibling && right_sibling->num_keys > MIN_KEYS) {
+        cow_preserve(right_sibling);
+        if (cur->is_leaf) {
+            cur->keys[cur->num_keys] = right_sibling->keys[0];
+            cur->elements[cur->num_keys] = right_sibling->elements[0];
+            memmove(&right_sibling->elements[0], &right_sibling->elements[1], (right_sibling->num_keys - 1) * sizeof(Element *));
+            memmove(&right_sibling->keys[0], &right_sibling->keys[1], (right_sibling->num_keys - 1) * sizeof(int));
+            parent->keys[index] = right_sibling->keys[0];
+        } else {
+            cur->keys[cur->num_keys] = parent->keys[index];
+            cur->children[cur->num_keys + 1] = right_sibling->children[0];
+            parent->keys[index] = right_sibling->keys[0];
+            memmove(&right_sibling->keys[0], &right_sibling->keys[1], (right_sibling->num_keys - 1) * sizeof(int));
+            memmove(&right_sibling->children[0], &right_sibling->children[1], right_sibling->num_keys * sizeof(Node *));
+        }
+        cur->num_keys++;
+        right_sibling->num_keys--;
+        STAT_ADD(borrows, 1);
+        if (!tree_concurrent) {
+            moved = cur->is_leaf ? element_stats(cur->elements[cur->num_keys - 1]) : cur->children[cur->num_keys]->stats;
+            aggregate_merge(&cur->stats, &moved);
+            node_refresh_stats(right_sibling);
+        }
+        return index;
+    }
+
+    // Both siblings are minimal: merge with one of them.
+    Node *left = left_sibling ? left_sibling : cur;
+    Node *right = left_sibling ? cur : right_sibling;
+    int separator = left_sibling ? index - 1 : index;
+
+    cow_preserve(left);
+    if (left->is_leaf) {
+        memcpy(&left->keys[left->num_keys], right->keys, right->num_keys * sizeof(int));
+        memcpy(&left->elements[left->num_keys], right->elements, right->num_keys * sizeof(Element *));
+        left->num_keys += right->num_keys;
+        left->next = right->next;
+    } else {
+        left->keys[left->num_keys] = parent->keys[separator];
+        memcpy(&left->keys[left->num_keys + 1], right->keys, right->num_keys * sizeof(int));
+        memcpy(&left->children[left->num_keys + 1], right->children, (right->num_keys + 1) * sizeof(Node *));
+        left->num_keys += 1 + right->num_keys;
+    }
+    memmove(&parent->keys[separator], &parent->keys[separator + 1], (parent->num_keys - separator - 1) * sizeof(int));
+    memmove(&parent->children[separator + 1], &parent->children[separator + 2], (parent->num_keys - separator - 1) * sizeof(Node *));
+    parent->num_keys--;
+    if (!tree_concurrent) {
+        aggregate_merge(&left->stats, &right->stats);
+    }
+    free_node(right);
+    STAT_ADD(merges, 1);
+    return separator;
+}
+
+
+// delete() outside concurrent mode.
+static int delete_serial(int atomic_number) {
+    if (root == NULL) {
+        return 0;
+    }
+
+    Node *path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    Node *cur = root;
+    while (!cur->is_leaf) {
+        int index = node_upper_bound(cur, atomic_number);
+        if (!defer_rebalance && cur->children[index]->num_keys <= MIN_KEYS) {
+            index = delete_adjust(cur, index);
+        }
+        Node *child = cur->children[index];
+        if (cur == root && cur->num_keys == 0) {
+            root = child;
+            free_node(cur);
+            STAT_ADD(root_collapses, 1);
+        } else {
+            path[depth++] = cur;
+        }
+        cur = child;
+    }
+
+    int index = node_lower_bound(cur, atomic_number);
+    if (index == cur->num_keys || cur->keys[index] != atomic_number) {
+        return 0;
+    }
+    cow_preserve(cur);
+    unindex_element(cur->elements[index]);
+    free_element(cur->elements[index]);
+    memmove(&cur->keys[index], &cur->keys[index + 1], (cur->num_keys - index - 1) * sizeof(int));
+    memmove(&cur->elements[index], &cur->elements[index + 1], (cur->num_keys - index - 1) * sizeof(Element *));
+    cur->num_keys--;
+    // Recomputed bottom-up rather than subtracted, so a long run of deletes
+    // cannot accumulate floating-point error in the sums.
+    node_refresh_stats(cur);
+    while (depth > 0) {
+        node_refresh_stats(path[--depth]);
+    }
+    if (defer_rebalance) {
+        deferred_deletes++;
+    }
+    wal_log_delete(atomic_number);
+
+    if (cur == root && cur->num_keys == 0) {
+        free_node(root);
+        root = NULL;
+    }
+    wal_maybe_checkpoint();
+    return 1;
+}
+
+
+// Removes the element with the given atomic number, rebalancing top-down so
+// the leaf it is removed from never underflows (unless defer_rebalance is
+// set). Returns 0 if it was not found.
+int delete(int atomic_number) {
+    materialize_tree();
+    uint64_t started = stats_start();
+    int deleted = tree_concurrent ? delete_concurrent(atomic_number) : delete_serial(atomic_number);
+    if (!deleted) {
+        STAT_ADD(delete_misses, 1);
+    }
+    stats_finish(STAT_DELETE, started);
+    return deleted;
+}
+
+
+// Rebalances the adjacent children index and index + 1 of parent, which may
+// hold any number of keys: they are merged if everything fits in one node,
+// otherwise their entries are split evenly between them (so both end up
+// with at least MIN_KEYS). Returns 1 if they were merged into the left one.
+static int rebalance_pair(Node *parent, int index) {
+    Node *left = parent->children[index];
+    Node *right = parent->children[index + 1];
+    int keys[2 * MAX_ELEMENTS + 1];
+    void *entries[2 * MAX_ELEMENTS + 2];
+    int num_keys;
+
+    cow_preserve(parent);
+    cow_preserve(left);
+    cow_preserve(right);
+    if (left->is_leaf) {
+        num_keys = left->num_keys + right->num_keys;
+        memcpy(keys, left->keys, left->num_keys * sizeof(int));
+        memcpy(&keys[left->num_keys], right->keys, right->num_keys * sizeof(int));
+        memcpy(entries, left->elements, left->num_keys * sizeof(Element *));
+        memcpy(&entries[left->num_keys], right->elements, right->num_keys * sizeof(Element *));
+    } else {
+        num_keys = left->num_keys + 1 + right->num_keys;
+        memcpy(keys, left->keys, left->num_keys * sizeof(int));
+        keys[left->num_keys] = parent->keys[index];
+        memcpy(&keys[left->num_keys + 1], right->keys, right->num_keys * sizeof(int));
+        memcpy(entries, left->children, (left->num_keys + 1) * sizeof(Node *));
+        memcpy(&entries[left->num_keys + 1], right->children, (right->num_keys + 1) * sizeof(Node *));
+    }
+
+    if (num_keys <= MAX_ELEMENTS) {
+        memcpy(left->keys, keys, num_keys * sizeof(int));
+        if (left->is_leaf) {
+            memcpy(left->elements, entries, num_keys * sizeof(Element *));
+            left->next = right->next;
+        } else {
+            memcpy(left->children, entries, (num_keys + 1) * sizeof(Node *));
+        }
+        left->num_keys = num_keys;
+        memmove(&parent->keys[index], &parent->keys[index + 1], (parent->num_keys - index - 1) * sizeof(int));
+        memmove(&parent->children[index + 1], &parent->children[index + 2], (parent->num_keys - index - 1) * sizeof(Node *));
+        parent->num_keys--;
+        free_node(right);
+        node_refresh_stats(left);
+        STAT_ADD(merges, 1);
+        return 1;
+    }
+
+    int mid = num_keys / 2;
+    if (left->is_leaf) {
+        left->num_keys = mid;
+        right->num_keys = num_keys - mid;
+        memcpy(left->keys, keys, mid * sizeof(int));
+        memcpy(left->elements, entries, mid * sizeof(Element *));
+        memcpy(right->keys, &keys[mid], right->num_keys * sizeof(int));
+        memcpy(right->elements, &entries[mid], right->num_keys * sizeof(Element *));
+        parent->keys[index] = right->keys[0];
+    } else {
+        left->num_keys = mid;
+        right->num_keys = num_keys - mid - 1;
+        memcpy(left->keys, keys, mid * sizeof(int));
+        memcpy(left->children, entries, (mid + 1) * sizeof(Node *));
+        memcpy(right->keys, &keys[mid + 1], right->num_keys * sizeof(int));
+        memcpy(right->children, &entries[mid + 1], (right->num_keys + 1) * sizeof(Node *));
+        parent->keys[index] = keys[mid];
+    }
+    node_refresh_stats(left);
+    node_refresh_stats(right);
+    STAT_ADD(borrows, 1);
+    return 0;
+}
+
+
+// Brings every child of node up to MIN_KEYS by pairing underfull children
+// with a neighbour. A node built that way can inherit an underfull child of
+// its own, so the result is repaired in turn. node itself may stay underfull
+// (its parent repairs it) and ends with a single child if everything fit in one.
+static void repair_children(Node *node) {
+    int i = 0;
+    while (!node->is_leaf && node->num_keys > 0 && i <= node->num_keys) {
+        if (node->children[i]->num_keys >= MIN_KEYS) {
+            i++;
+            continue;
+        }
+        int pair = i < node->num_keys ? i : i - 1;
+        int merged = rebalance_pair(node, pair);
+        repair_children(node->children[pair]);
+        if (!merged) {
+            repair_children(node->children[pair + 1]);
+        }
+        i = pair;
+    }
+}
+
+
+// Drops root levels left with a single child, and an empty root leaf.
+static void collapse_root(void) {
+    while (root != NULL && !root->is_leaf && root->num_keys == 0) {
+        Node *child = root->children[0];
+        free_node(root);
+        root = child;
+        STAT_ADD(root_collapses, 1);
+    }
+    if (root != NULL && root->is_leaf && root->num_keys == 0) {
+        free_node(root);
+        root = NULL;
+    }
+}
+
+
+// Frees node's whole subtree with its records. Returns the number of records.
+static long free_subtree(Node *node) {
+    long removed = 0;
+    if (node->is_leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            unindex_element(node->elements[i]);
+            free_element(node->elements[i]);
+        }
+        removed = node->num_keys;
+    } else {
+        for (int i = 0; i <= node->num_keys; i++) {
+            removed += free_subtree(node->children[i]);
+        }
+    }
+    free_node(node);
+    return removed;
+}
+
+
+// Removes the keys in [lower, upper] from node's subtree. Children the range
+// covers whole are freed without being searched; only the (at most two)
+// children holding a bound are descended into, and they are kept even if
+// they end up empty. Nothing is rebalanced and the leaf chain is not
+// relinked here. lower_open / upper_open are as in node_range_aggregate().
+static long node_delete_range(Node *node, int lower, int upper, int lower_open, int upper_open) {
+    cow_preserve(node);
+    if (node->is_leaf) {
+        int from = lower_open ? 0 : node_lower_bound(node, lower);
+        int to = upper_open ? node->num_keys : node_upper_bound(node, upper);
+        for (int i = from; i < to; i++) {
+            unindex_element(node->elements[i]);
+            free_element(node->elements[i]);
+        }
+        memmove(&node->keys[from], &node->keys[to], (node->num_keys - to) * sizeof(int));
+        memmove(&node->elements[from], &node->elements[to], (node->num_keys - to) * sizeof(Element *));
+        node->num_keys -= to - from;
+        return to - from;
+    }
+
+    int first = lower_open ? 0 : node_upper_bound(node, lower);
+    int last = upper_open ? node->num_keys : node_upper_bound(node, upper);
+    long removed = 0;
+    // Children before first keep their places; the survivors from first on are
+    // packed down behind them, each with the separator it had before.
+    int kept = first;
+    for (int i = first; i <= node->num_keys; i++) {
+        Node *child = node->children[i];
+        if (i <= last) {
+            int child_lower_open = lower_open || i > first;
+            int child_upper_open = upper_open || i < last;
+            if (child_lower_open && child_upper_open) {
+                removed += free_subtree(child);
+                continue;
+            }
+            removed += node_delete_range(child, lower, upper, child_lower_open, child_upper_open);
+        }
+        if (kept > 0) {
+            node->keys[kept - 1] = node->keys[i - 1];
+        }
+        node->children[kept++] = child;
+    }
+    node->num_keys = kept - 1;
+    return removed;
+}
+
+
+// Repairs the nodes along the paths to lower and upper bottom-up, and
+// recomputes their stats.
+static void repair_range_path(Node *node, int lower, int upper) {
+    if (!node->is_leaf) {
+        int first = node_upper_bound(node, lower);
+        int last = node_upper_bound(node, upper);
+        repair_range_path(node->children[first], lower, upper);
+        if (last != first) {
+            repair_range_path(node->children[last], lower, upper);
+        }
+        repair_children(node);
+    }
+    node_refresh_stats(node);
+}
+
+
+static Node *find_leaf(int key) {
+    Node *cur = root;
+    while (!cur->is_leaf) {
+        cur = cur->children[node_upper_bound(cur, key)];
+    }
+    return cur;
+}
+
+
+// Deletes every record with an atomic number in [lower, upper] in one pass:
+// whole subtrees inside the range are freed, the leaves at either end are
+// trimmed, the leaf before the range is linked to the one after it, and
+// only the nodes along the two boundary paths are rebalanced. Logged as a
+// single change. Returns the number of records deleted, or -1 in
+// concurrent mode, where it refuses.
+long delete_range(int lower, int upper) {
+    if (refuse_concurrent("delete_range()")) {
+        return -1;
+    }
+    materialize_tree();
+    uint64_t started = stats_start();
+    long removed = root != NULL && lower <= upper ? node_delete_range(root, lower, upper, 0, 0) : 0;
+    if (removed > 0) {
+        Node *before = find_leaf(lower);
+        Node *after = find_leaf(upper);
+        if (before != after) {
+            before->next = after;
+        }
+        repair_range_path(root, lower, upper);
+        collapse_root();
+        wal_log_delete_range(lower, upper);
+        wal_maybe_checkpoint();
+    }
+    stats_finish(STAT_DELETE_RANGE, started);
+    return removed;
+}
+
+
+static void compact_subtree(Node *node) {
+    if (node->is_leaf) {
+        return;
+    }
+    for (int i = 0; i <= node->num_keys; i++) {
+        compact_subtree(node->children[i]);
+    }
+    repair_children(node);
+}
+
+
+// Rebuilds the nodes left underfull by deferred deletes (see defer_rebalance),
+// merging or evenly refilling them from their neighbours, in one pass over
+// the tree. Returns 0 in concurrent mode, where it refuses.
+int compact_tree(void) {
+    if (refuse_concurrent("compact_tree()")) {
+        return 0;
+    }
+    materialize_tree();
+    if (root != NULL) {
+        compact_subtree(root);
+        collapse_root();
+    }
+    deferred_deletes = 0;
+    return 1;
+}
+
+
+// Concurrent mode. After enable_concurrency(), search(), insert(), delete(),
+// search_batch() and cursors may be called from any number of threads.
+// Readers descend without locks and retry when a node's version moved under
+// them; writers keep the top-down split/merge discipline, so they lock only
+// the nodes they change (a node and its parent, plus the siblings a merge
+// touches) and restart from the root if anything they read has changed.
+// Bulk loading, snapshots, enable_*_index() and destroy_tree() still need the
+// tree to themselves; insert_batch(), delete_range() and compact_tree()
+// refuse to run.
+#define OLC_RESTART (-1)
+
+void enable_concurrency(void) {
+    materialize_tree();
+    tree_concurrent = 1;
+}
+
+
+// Recomputes the stats of every node in node's subtree.
+static void refresh_subtree_stats(Node *node) {
+    if (!node->is_leaf) {
+        for (int i = 0; i <= node->num_keys; i++) {
+            refresh_subtree_stats(node->children[i]);
+        }
+    }
+    node_refresh_stats(node);
+}
+
+
+// Leaves concurrent mode once no other thread is using the tree. Concurrent
+// writers leave the subtree stats alone, so they are rebuilt here.
+void disable_concurrency(void) {
+    tree_concurrent = 0;
+    reclaim_retired_elements();
+    if (root != NULL && root->is_leaf && root->num_keys == 0) {
+        free_node(root);
+        root = NULL;
+    }
+    if (root != NULL) {
+        refresh_subtree_stats(root);
+    }
+}
+
+
+void retire_element(Element *element) {
+    pthread_mutex_lock(&pool_mutex);
+    if (retired_count == retired_capacity) {
+        retired_capacity = retired_capacity ? retired_capacity * 2 : 64;
+        retired_elements = (Element **)realloc(retired_elements, retired_capacity * sizeof(Element *));
+    }
+    retired_elements[retired_count++] = element;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+// Returns deleted elements to the pool. Only call at a point where no thread
+// can still hold an element it got from the tree.
+// Elements an open view may still hold wait for view_close() instead.
+void reclaim_retired_elements(void) {
+    pthread_mutex_lock(&pool_mutex);
+    int views_open = __atomic_load_n(&newest_view_epoch, __ATOMIC_ACQUIRE) != 0;
+    for (int i = 0; i < retired_count; i++) {
+        if (views_open) {
+            retire_version(retired_elements[i], NULL, RETIRED_ELEMENT);
+        } else {
+            element_release(retired_elements[i]);
+        }
+    }
+    retired_count = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+// One optimistic descent to the leaf covering key. On success stores the leaf
+// (NULL for an empty tree) and the version its contents must be validated
+// against; returns 0 if the descent ran into a concurrent write. Freed nodes
+// go straight back to the pool, so each parent is validated again after its
+// child's version is taken: only then is the child known not to have been
+// freed and reused in between.
+static int find_leaf_attempt(int key, Node **leaf, uint64_t *leaf_version) {
+    uint64_t root_v;
+    uint64_t v;
+    if (!version_read_lock(&root_version, &root_v)) {
+        return 0;
+    }
+    Node *node = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+    if (node == NULL) {
+        *leaf = NULL;
+        return version_validate(&root_version, root_v);
+    }
+    if (!version_read_lock(&node->version, &v) || !version_validate(&root_version, root_v)) {
+        return 0;
+    }
+    int visited = 1;
+    while (!node->is_leaf) {
+        int n = node->num_keys;
+        if (n < 0 || n > MAX_ELEMENTS) {
+            return 0;
+        }
+        Node *child = node->children[keys_upper_bound(node->keys, n, key)];
+        uint64_t child_v;
+        if (!version_validate(&node->version, v) || !version_read_lock(&child->version, &child_v) ||
+            !version_validate(&node->version, v)) {
+            return 0;
+        }
+        node = child;
+        v = child_v;
+        visited++;
+    }
+    STAT_ADD(descents, 1);
+    STAT_ADD(node_visits, visited);
+    *leaf = node;
+    *leaf_version = v;
+    return 1;
+}
+
+
+static Node *find_leaf_optimistic(int key, uint64_t *leaf_version) {
+    Node *leaf;
+    while (!find_leaf_attempt(key, &leaf, leaf_version)) {
+        STAT_ADD(restarts, 1);
+    }
+    return leaf;
+}
+
+
+Element *search_concurrent(int atomic_number) {
+    for (;;) {
+        uint64_t v;
+        Node *leaf = find_leaf_optimistic(atomic_number, &v);
+        if (leaf == NULL) {
+            return NULL;
+        }
+        Element *found = NULL;
+        int n = leaf->num_keys;
+        if (n >= 0 && n <= MAX_ELEMENTS) {
+            int i = keys_lower_bound(leaf->keys, n, atomic_number);
+            if (i < n && leaf->keys[i] == atomic_number) {
+                found = leaf->elements[i];
+            }
+        }
+        if (version_validate(&leaf->version, v)) {
+            return found;
+        }
+        STAT_ADD(restarts, 1);
+    }
+}
+
+
+// Returns 1 if inserted, 0 for a duplicate, OLC_RESTART on a conflict. A
+// full node on the path is split under its own lock and its parent's (the
+// root pointer's for the root), and the descent then starts over.
+static int insert_attempt(Element *element) {
+    int key = element->atomic_number;
+    uint64_t root_v;
+    uint64_t v;
+    if (!version_read_lock(&root_version, &root_v)) {
+        return OLC_RESTART;
+    }
+    Node *node = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+    if (node == NULL) {
+        if (!version_upgrade(&root_version, root_v)) {
+            return OLC_RESTART;
+        }
+        Node *leaf = create_node(1);
+        leaf->keys[0] = key;
+        leaf->elements[0] = element;
+        leaf->num_keys = 1;
+        __atomic_store_n(&root, leaf, __ATOMIC_RELEASE);
+        index_lock();
+        index_element(element);
+        index_unlock();
+        wal_log_insert(element);
+        version_unlock(&root_version);
+        return 1;
+    }
+    if (!version_read_lock(&node->version, &v) || !version_validate(&root_version, root_v)) {
+        return OLC_RESTART;
+    }
+
+    Node *parent = NULL;
+    uint64_t parent_v = 0;
+    int index = 0;
+    for (;;) {
+        int n = node->num_keys;
+        int is_leaf = node->is_leaf;
+        if (!version_validate(&node->version, v)) {
+            return OLC_RESTART;
+        }
+        if (n == MAX_ELEMENTS) {
+            uint64_t *parent_lock = parent != NULL ? &parent->version : &root_version;
+            if (!version_upgrade(parent_lock, parent != NULL ? parent_v : root_v)) {
+                return OLC_RESTART;
+            }
+            if (!version_upgrade(&node->version, v)) {
+                version_unlock(parent_lock);
+                return OLC_RESTART;
+            }
+            if (parent == NULL) {
+                Node *new_root = create_node(0);
+                new_root->children[0] = node;
+                split_node(new_root, 0, node);
+                __atomic_store_n(&root, new_root, __ATOMIC_RELEASE);
+                STAT_ADD(root_splits, 1);
+            } else {
+                split_node(parent, index, node);
+            }
+            version_unlock(&node->version);
+            version_unlock(parent_lock);
+            return OLC_RESTART;
+        }
+        if (is_leaf) {
+            break;
+        }
+        int i = keys_upper_bound(node->keys, n, key);
+        Node *child = node->children[i];
+        uint64_t child_v;
+        if (!version_validate(&node->version, v) || !version_read_lock(&child->version, &child_v) ||
+            !version_validate(&node->version, v)) {
+            return OLC_RESTART;
+        }
+        parent = node;
+        parent_v = v;
+        index = i;
+        node = child;
+        v = child_v;
+    }
+
+    if (!version_upgrade(&node->version, v)) {
+        return OLC_RESTART;
+    }
+    int pos = node_lower_bound(node, key);
+    if (pos < node->num_keys && node->keys[pos] == key) {
+        version_unlock(&node->version);
+        return 0;
+    }
+    cow_preserve(node);
+    memmove(&node->keys[pos + 1], &node->keys[pos], (node->num_keys - pos) * sizeof(int));
+    memmove(&node->elements[pos + 1], &node->elements[pos], (node->num_keys - pos) * sizeof(Element *));
+    node->keys[pos] = key;
+    node->elements[pos] = element;
+    node->num_keys++;
+    index_lock();
+    index_element(element);
+    index_unlock();
+    wal_log_insert(element);
+    version_unlock(&node->version);
+    return 1;
+}
+
+
+// Each attempt is bracketed on its own, so view_open() never waits on a
+// writer that keeps retrying.
+int insert_concurrent(Element *element) {
+    int result;
+    do {
+        cow_writer_enter();
+        result = insert_attempt(element);
+        cow_writer_exit();
+        if (result == OLC_RESTART) {
+            STAT_ADD(restarts, 1);
+        }
+    } while (result == OLC_RESTART);
+    return result;
+}
+
+
+// Rebalances parent->children[index] under the locks of parent, the child and
+// both of its siblings (and the root pointer when parent is the root, which
+// a merge may collapse). Siblings are only try-locked, so two writers
+// rebalancing neighbouring nodes back off instead of waiting on each other.
+// Always ends in OLC_RESTART: the caller descends again from the root.
+static int delete_rebalance(Node *parent, uint64_t parent_v, int is_root, uint64_t root_v,
+                            int index, Node *child, uint64_t child_v, Node *left, Node *right) {
+    Node *held[4];
+    int num_held = 0;
+    int root_held = 0;
+    int ok = 1;
+
+    if (is_root) {
+        ok = root_held = version_upgrade(&root_version, root_v);
+    }
+    if (ok && (ok = version_upgrade(&parent->version, parent_v))) {
+        held[num_held++] = parent;
+    }
+    if (ok && (ok = version_upgrade(&child->version, child_v))) {
+        held[num_held++] = child;
+    }
+    Node *siblings[2] = {left, right};
+    for (int s = 0; s < 2 && ok; s++) {
+        uint64_t sibling_v;
+        if (siblings[s] != NULL) {
+            ok = version_try_read_lock(&siblings[s]->version, &sibling_v) &&
+                 version_upgrade(&siblings[s]->version, sibling_v);
+            if (ok) {
+                held[num_held++] = siblings[s];
+            }
+        }
+    }
+
+    if (!ok) {
+        for (int h = 0; h < num_held; h++) {
+            version_unlock(&held[h]->version);
+        }
+    } else {
+        int before = parent->num_keys;
+        int merged_into = delete_adjust(parent, index);
+        // A merge frees the right-hand node of the pair, which leaves its lock with it.
+        Node *freed = parent->num_keys == before ? NULL : (merged_into == index ? right : child);
+        for (int h = 1; h < num_held; h++) {
+            if (held[h] != freed) {
+                version_unlock(&held[h]->version);
+            }
+        }
+        if (is_root && parent->num_keys == 0) {
+            __atomic_store_n(&root, parent->children[0], __ATOMIC_RELEASE);
+            free_node(parent);
+            STAT_ADD(root_collapses, 1);
+        } else {
+            version_unlock(&parent->version);
+        }
+    }
+    if (root_held) {
+        version_unlock(&root_version);
+    }
+    return OLC_RESTART;
+}
+
+
+// Returns 1 if deleted, 0 if not found, OLC_RESTART on a conflict. The last
+// record of the root leaf is removed without freeing the leaf, so an empty
+// tree keeps its root until disable_concurrency().
+static int delete_attempt(int atomic_number) {
+    uint64_t root_v;
+    uint64_t v;
+    if (!version_read_lock(&root_version, &root_v)) {
+        return OLC_RESTART;
+    }
+    Node *node = __atomic_load_n(&root, __ATOMIC_ACQUIRE);
+    if (node == NULL) {
+        return version_validate(&root_version, root_v) ? 0 : OLC_RESTART;
+    }
+    if (!version_read_lock(&node->version, &v) || !version_validate(&root_version, root_v)) {
+        return OLC_RESTART;
+    }
+
+    int is_root = 1;
+    for (;;) {
+        int n = node->num_keys;
+        int is_leaf = node->is_leaf;
+        if (!version_validate(&node->version, v)) {
+            return OLC_RESTART;
+        }
+        if (is_leaf) {
+            break;
+        }
+        int i = keys_upper_bound(node->keys, n, atomic_number);
+        Node *child = node->children[i];
+        Node *left = i > 0 ? node->children[i - 1] : NULL;
+        Node *right = i < n ? node->children[i + 1] : NULL;
+        uint64_t child_v;
+        if (!version_validate(&node->version, v) || !version_read_lock(&child->version, &child_v) ||
+            !version_validate(&node->version, v)) {
+            return OLC_RESTART;
+        }
+        int child_keys = child->num_keys;
+        if (!version_validate(&child->version, child_v)) {
+            return OLC_RESTART;
+        }
+        if (child_keys <= MIN_KEYS && !defer_rebalance) {
+            return delete_rebalance(node, v, is_root, root_v, i, child, child_v, left, right);
+        }
+        is_root = 0;
+        node = child;
+        v = child_v;
+    }
+
+    if (!version_upgrade(&node->version, v)) {
+        return OLC_RESTART;
+    }
+    int index = node_lower_bound(node, atomic_number);
+    if (index == node->num_keys || node->keys[index] != atomic_number) {
+        version_unlock(&node->version);
+        return 0;
+    }
+    cow_preserve(node);
+    Element *element = node->elements[index];
+    memmove(&node->keys[index], &node->keys[index + 1], (node->num_keys - index - 1) * sizeof(int));
+    memmove(&node->elements[index], &node->elements[index + 1], (node->num_keys - index - 1) * sizeof(Element *));
+    node->num_keys--;
+    index_lock();
+    unindex_element(element);
+    index_unlock();
+    if (defer_rebalance) {
+        __atomic_fetch_add(&deferred_deletes, 1, __ATOMIC_RELAXED);
+    }
+    wal_log_delete(atomic_number);
+    version_unlock(&node->version);
+    retire_element(element);
+    return 1;
+}
+
+
+int delete_concurrent(int atomic_number) {
+    int result;
+    do {
+        cow_writer_enter();
+        result = delete_attempt(atomic_number);
+        cow_writer_exit();
+        if (result == OLC_RESTART) {
+            STAT_ADD(restarts, 1);
+        }
+    } while (result == OLC_RESTART);
+    return result;
+}
+
+
+// Positions cursor on the first key >= cursor->resume.
+static void cursor_reseek(Cursor *cursor) {
+    for (;;) {
+        uint64_t v;
+        Node *leaf = find_leaf_optimistic(cursor->resume, &v);
+        if (leaf == NULL) {
+            cursor->leaf = NULL;
+            return;
+        }
+        int n = leaf->num_keys;
+        int pos = n >= 0 && n <= MAX_ELEMENTS ? keys_lower_bound(leaf->keys, n, cursor->resume) : 0;
+        if (version_validate(&leaf->version, v)) {
+            cursor->leaf = leaf;
+            cursor->pos = pos;
+            cursor->version = v;
+            return;
+        }
+    }
+}
+
+
+void cursor_seek_concurrent(Cursor *cursor, int lower, int upper) {
+    cursor->upper = upper;
+    cursor->resume = lower;
+    cursor_reseek(cursor);
+}
+
+
+// Every record present for the whole scan is returned exactly once, in key
+// order; records inserted or deleted during the scan may or may not be seen.
+// Stepping to the next leaf re-validates the current one after the next
+// leaf's version is taken, so a borrow that moves a record back across the
+// boundary cannot slip past the cursor.
+Element *cursor_next_concurrent(Cursor *cursor) {
+    while (cursor->leaf != NULL) {
+        Node *leaf = cursor->leaf;
+        int n = leaf->num_keys;
+        int pos = cursor->pos;
+        if (pos < n && n <= MAX_ELEMENTS) {
+            int key = leaf->keys[pos];
+            Element *element = leaf->elements[pos];
+            if (!version_validate(&leaf->version, cursor->version)) {
+                cursor_reseek(cursor);
+                continue;
+            }
+            if (key > cursor->upper) {
+                cursor->leaf = NULL;
+                return NULL;
+            }
+            if (key == cursor->upper) {
+                cursor->leaf = NULL;
+            } else {
+                cursor->pos++;
+                cursor->resume = key + 1;
+            }
+            return element;
+        }
+
+        Node *next = leaf->next;
+        uint64_t next_v;
+        if (!version_validate(&leaf->version, cursor->version)) {
+            cursor_reseek(cursor);
+            continue;
+        }
+        if (next == NULL) {
+            cursor->leaf = NULL;
+            return NULL;
+        }
+        if (!version_read_lock(&next->version, &next_v) || !version_validate(&leaf->version, cursor->version)) {
+            cursor_reseek(cursor);
+            continue;
+        }
+        int next_n = next->num_keys;
+        int next_pos = next_n >= 0 && next_n <= MAX_ELEMENTS ? keys_lower_bound(next->keys, next_n, cursor->resume) : 0;
+        if (!version_validate(&next->version, next_v)) {
+            cursor_reseek(cursor);
+            continue;
+        }
+        cursor->leaf = next;
+        cursor->pos = next_pos;
+        cursor->version = next_v;
+    }
+    return NULL;
+}
+
+
+typedef struct BatchProbe {
+    int key;
+    int index;
+} BatchProbe;
+
+typedef struct BatchGroup {
+    Node *node;
+    int begin;
+    int end;
+} BatchGroup;
+
+
+static int compare_probes(const void *a, const void *b) {
+    int x = ((const BatchProbe *)a)->key;
+    int y = ((const BatchProbe *)b)->key;
+    return (x > y) - (x < y);
+}
+
+
+// Requests every cache line of a node's key array ahead of its search.
+static inline void prefetch_node_keys(const Node *node) {
+    const char *keys = (const char *)node->keys;
+    size_t bytes = node->num_keys * sizeof(int);
+    for (size_t offset = 0; offset < bytes; offset += 64) {
+        __builtin_prefetch(keys + offset);
+    }
+}
+
+
+// Looks up count keys at once; out[i] receives the element for keys[i] or
+// NULL. The keys are sorted and walked down the tree one level at a time:
+// probes that fall into the same child share one visit to it, and every
+// child needed on the next level is prefetched before any of them is
+// searched, so the misses of independent descents overlap.
+void search_batch(const int *keys, int count, Element **out) {
+    if (count <= 0) {
+        return;
+    }
+    materialize_tree();
+    if (tree_concurrent) {
+        for (int i = 0; i < count; i++) {
+            out[i] = search_concurrent(keys[i]);
+        }
+        return;
+    }
+    if (root == NULL) {
+        memset(out, 0, count * sizeof(Element *));
+        return;
+    }
+
+    BatchProbe *probes = (BatchProbe *)malloc(count * sizeof(BatchProbe));
+    for (int i = 0; i < count; i++) {
+        probes[i].key = keys[i];
+        probes[i].index = i;
+    }
+    qsort(probes, count, sizeof(BatchProbe), compare_probes);
+
+    BatchGroup *groups = (BatchGroup *)malloc(count * sizeof(BatchGroup));
+    BatchGroup *next_groups = (BatchGroup *)malloc(count * sizeof(BatchGroup));
+    int num_groups = 1;
+    groups[0].node = root;
+    groups[0].begin = 0;
+    groups[0].end = count;
+
+    while (!groups[0].node->is_leaf) {
+        int num_next = 0;
+        for (int g = 0; g < num_groups; g++) {
+            Node *node = groups[g].node;
+            int p = groups[g].begin;
+            while (p < groups[g].end) {
+                int i = node_upper_bound(node, probes[p].key);
+                int q = p + 1;
+                if (i == node->num_keys) {
+                    q = groups[g].end;
+                } else {
+                    while (q < groups[g].end && probes[q].key < node->keys[i]) {
+                        q++;
+                    }
+                }
+                Node *child = node->children[i];
+                prefetch_node_keys(child);
+                next_groups[num_next].node = child;
+                next_groups[num_next].begin = p;
+                next_groups[num_next].end = q;
+                num_next++;
+                p = q;
+            }
+        }
+        BatchGroup *tmp = groups;
+        groups = next_groups;
+        next_groups = tmp;
+        num_groups = num_next;
+    }
+
+    for (int g = 0; g < num_groups; g++) {
+        Node *leaf = groups[g].node;
+        for (int p = groups[g].begin; p < groups[g].end; p++) {
+            int i = node_lower_bound(leaf, probes[p].key);
+            out[probes[p].index] = (i < leaf->num_keys && leaf->keys[i] == probes[p].key) ? leaf->elements[i] : NULL;
+        }
+    }
+
+    free(next_groups);
+    free(groups);
+    free(probes);
+}
+
+
+// Positions cursor on the first element with atomic number >= lower.
+void cursor_seek(Cursor *cursor, int lower, int upper) {
+    STAT_ADD(range_scans, 1);
+    if (tree_concurrent) {
+        cursor_seek_concurrent(cursor, lower, upper);
+        return;
+    }
+    cursor->upper = upper;
+    cursor->leaf = root;
+    cursor->pos = 0;
+    if (root == NULL) {
+        return;
+    }
+    int visited = 1;
+    while (!cursor->leaf->is_leaf) {
+        cursor->leaf = cursor->leaf->children[node_upper_bound(cursor->leaf, lower)];
+        visited++;
+    }
+    STAT_ADD(descents, 1);
+    STAT_ADD(node_visits, visited);
+    cursor->pos = node_lower_bound(cursor->leaf, lower);
+}
+
+
+// Returns the next element in key order, or NULL once the scan passes upper.
+Element *cursor_next(Cursor *cursor) {
+    if (tree_concurrent) {
+        return cursor_next_concurrent(cursor);
+    }
+    while (cursor->leaf != NULL && cursor->pos == cursor->leaf->num_keys) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->pos = 0;
+    }
+    if (cursor->leaf == NULL || cursor->leaf->keys[cursor->pos] > cursor->upper) {
+        cursor->leaf = NULL;
+        return NULL;
+    }
+    return cursor->leaf->elements[cursor->pos++];
+}
+
+
+// Parallel scans. A key range (or a sorted list of elements) is cut into
+// several partitions per thread, in key order. The caller and the pool's
+// workers each start on a contiguous run of partitions, and one that runs
+// out steals the back half of another's run, so ranges that end part way
+// into a subtree or partitions of uneven density still keep every thread
+// busy. Each partition formats its records into its own buffer, and the
+// buffers are written out in order, so the output is byte for byte that of
+// a serial scan. The tree must hold still for the length of a scan, so
+// nothing uses these in concurrent mode.
+#define SCAN_TASKS_PER_THREAD 8
+#define MAX_SCAN_TASKS 4096
+#define MAX_SCAN_THREADS 256
+// Scans of fewer records than this stay on the calling thread.
+#define SCAN_PARALLEL_MIN_RECORDS 16384
+
+int scan_thread_count(void) {
+    long threads = scan_threads;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return threads < 1 ? 1 : threads > MAX_SCAN_THREADS ? MAX_SCAN_THREADS : (int)threads;
+}
+
+
+// Whether a scan of about records records should go through parallel_scan().
+int parallel_scan_worthwhile(long records) {
+    return !tree_concurrent && records >= SCAN_PARALLEL_MIN_RECORDS && scan_thread_count() > 1;
+}
+
+
+// Appends printf-style output to task's text.
+void scan_printf(ScanTask *task, const char *format, ...) {
+    for (;;) {
+        size_t space = task->capacity - task->length;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(task->text + task->length, space, format, args);
+        va_end(args);
+        if (written < 0) {
+            return;
+        }
+        if ((size_t)written < space) {
+            task->length += written;
+            return;
+        }
+        task->capacity = task->capacity ? task->capacity : 4096;
+        while (task->capacity - task->length <= (size_t)written) {
+            task->capacity *= 2;
+        }
+        task->text = (char *)realloc(task->text, task->capacity);
+        if (task->text == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(1);
+        }
+    }
+}
+
+
+// Emits the records of node's subtree with keys in the job's range, in key
+// order. lower_open / upper_open are as in node_range_aggregate().
+static void scan_subtree(const ScanJob *job, ScanTask *task, const Node *node, int lower_open, int upper_open) {
+    if (node->is_leaf) {
+        int i = lower_open ? 0 : node_lower_bound(node, job->lower);
+        for (; i < node->num_keys && (upper_open || node->keys[i] <= job->upper); i++) {
+            job->emit(task, node->elements[i]);
+            task->records++;
+        }
+        return;
+    }
+    int first = lower_open ? 0 : node_upper_bound(node, job->lower);
+    int last = upper_open ? node->num_keys : node_upper_bound(node, job->upper);
+    for (int i = first; i <= last; i++) {
+        scan_subtree(job, task, node->children[i], lower_open || i > first, upper_open || i < last);
+    }
+}
+
+
+static void scan_task_run(const ScanJob *job, ScanTask *task) {
+    if (task->node != NULL) {
+        scan_subtree(job, task, task->node, task->lower_open, task->upper_open);
+        return;
+    }
+    for (int i = 0; i < task->count; i++) {
+        job->emit(task, task->elements[i]);
+    }
+    task->records = task->count;
+}
+
+
+// Next task for worker id: the front of its own run, else the back half of
+// the first other run with anything left. -1 once every run is empty;
+// tasks only ever move to a worker that is about to run them, so none is lost.
+static int scan_take(ScanJob *job, int id) {
+    ScanQueue *own = &job->queues[id];
+    pthread_mutex_lock(&own->lock);
+    if (own->head < own->tail) {
+        int task = own->head++;
+        pthread_mutex_unlock(&own->lock);
+        return task;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    for (int k = 1; k < job->num_queues; k++) {
+        ScanQueue *victim = &job->queues[(id + k) % job->num_queues];
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->tail - victim->head;
+        if (left > 0) {
+            int from = victim->tail - (left + 1) / 2;
+            int to = victim->tail;
+            victim->tail = from;
+            pthread_mutex_unlock(&victim->lock);
+            pthread_mutex_lock(&own->lock);
+            own->head = from + 1;
+            own->tail = to;
+            pthread_mutex_unlock(&own->lock);
+            return from;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return -1;
+}
+
+
+static void scan_work(ScanJob *job, int id) {
+    int task;
+    while ((task = scan_take(job, id)) >= 0) {
+        scan_task_run(job, &job->tasks[task]);
+    }
+}
+
+
+static void *scan_worker(void *arg) {
+    int id = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&scan_lock);
+    for (;;) {
+        while (!scan_stopping && (scan_job == NULL || scan_generation == seen)) {
+            pthread_cond_wait(&scan_start, &scan_lock);
+        }
+        if (scan_stopping) {
+            break;
+        }
+        seen = scan_generation;
+        ScanJob *job = scan_job;
+        pthread_mutex_unlock(&scan_lock);
+        scan_work(job, id);
+        pthread_mutex_lock(&scan_lock);
+        if (--scan_busy == 0) {
+            pthread_cond_signal(&scan_done);
+        }
+    }
+    pthread_mutex_unlock(&scan_lock);
+    return NULL;
+}
+
+
+static void scan_pool_shutdown(void) {
+    pthread_mutex_lock(&scan_lock);
+    scan_stopping = 1;
+    pthread_cond_broadcast(&scan_start);
+    pthread_mutex_unlock(&scan_lock);
+    for (int i = 0; i < scan_num_workers; i++) {
+        pthread_join(scan_workers[i], NULL);
+    }
+    free(scan_workers);
+    scan_workers = NULL;
+    scan_num_workers = 0;
+    scan_stopping = 0;
+}
+
+
+// Stops the pool's threads; the next parallel scan starts them again.
+void scan_pool_stop(void) {
+    pthread_mutex_lock(&scan_run_mutex);
+    scan_pool_shutdown();
+    pthread_mutex_unlock(&scan_run_mutex);
+}
+
+
+// Runs every task of job on the pool, the calling thread included. The pool
+// is (re)started with scan_threads - 1 workers when that has changed.
+static void scan_run(ScanJob *job) {
+    pthread_mutex_lock(&scan_run_mutex);
+    int threads = scan_thread_count();
+    if (scan_num_workers != threads - 1) {
+        scan_pool_shutdown();
+        scan_workers = (pthread_t *)malloc((threads - 1) * sizeof(pthread_t));
+        while (scan_num_workers < threads - 1 &&
+               pthread_create(&scan_workers[scan_num_workers], NULL, scan_worker,
+                              (void *)(intptr_t)(scan_num_workers + 1)) == 0) {
+            scan_num_workers++;
+        }
+    }
+
+    job->num_queues = scan_num_workers + 1;
+    job->queues = (ScanQueue *)malloc(job->num_queues * sizeof(ScanQueue));
+    for (int q = 0; q < job->num_queues; q++) {
+        pthread_mutex_init(&job->queues[q].lock, NULL);
+        job->queues[q].head = (int)((long)job->num_tasks * q / job->num_queues);
+        job->queues[q].tail = (int)((long)job->num_tasks * (q + 1) / job->num_queues);
+    }
+
+    pthread_mutex_lock(&scan_lock);
+    scan_job = job;
+    scan_generation++;
+    scan_busy = scan_num_workers;
+    pthread_cond_broadcast(&scan_start);
+    pthread_mutex_unlock(&scan_lock);
+    scan_work(job, 0);
+    pthread_mutex_lock(&scan_lock);
+    while (scan_busy > 0) {
+        pthread_cond_wait(&scan_done, &scan_lock);
+    }
+    scan_job = NULL;
+    pthread_mutex_unlock(&scan_lock);
+
+    for (int q = 0; q < job->num_queues; q++) {
+        pthread_mutex_destroy(&job->queues[q].lock);
+    }
+    free(job->queues);
+    pthread_mutex_unlock(&scan_run_mutex);
+}
+
+
+// Writes the tasks' text to output in order and frees the job. Returns the
+// number of records scanned.
+static long scan_finish(ScanJob *job, FILE *output) {
+    long records = 0;
+    for (int i = 0; i < job->num_tasks; i++) {
+        if (job->tasks[i].length > 0) {
+            fwrite(job->tasks[i].text, 1, job->tasks[i].length, output);
+        }
+        free(job->tasks[i].text);
+        records += job->tasks[i].records;
+    }
+    free(job->tasks);
+    return records;
+}
+
+
+// Cuts [job->lower, job->upper] into subtrees, one level at a time, until
+// there are at least target of them or the next level would not fit.
+static void scan_partition(ScanJob *job, int target) {
+    ScanTask *current = (ScanTask *)calloc(MAX_SCAN_TASKS, sizeof(ScanTask));
+    ScanTask *next = (ScanTask *)calloc(MAX_SCAN_TASKS, sizeof(ScanTask));
+    int count = 1;
+    current[0].node = root;
+    while (count < target) {
+        int next_count = 0;
+        int internal = 0;
+        for (int i = 0; i < count; i++) {
+            const Node *node = current[i].node;
+            if (node->is_leaf) {
+                next_count++;
+            } else {
+                int first = current[i].lower_open ? 0 : node_upper_bound(node, job->lower);
+                int last = current[i].upper_open ? node->num_keys : node_upper_bound(node, job->upper);
+                next_count += last - first + 1;
+                internal = 1;
+            }
+        }
+        if (!internal || next_count > MAX_SCAN_TASKS) {
+            break;
+        }
+        next_count = 0;
+        for (int i = 0; i < count; i++) {
+            const ScanTask *task = &current[i];
+            if (task->node->is_leaf) {
+                next[next_count++] = *task;
+                continue;
+            }
+            int first = task->lower_open ? 0 : node_upper_bound(task->node, job->lower);
+            int last = task->upper_open ? task->node->num_keys : node_upper_bound(task->node, job->upper);
+            for (int c = first; c <= last; c++) {
+                ScanTask *child = &next[next_count++];
+                child->node = task->node->children[c];
+                child->lower_open = task->lower_open || c > first;
+                child->upper_open = task->upper_open || c < last;
+            }
+        }
+        ScanTask *swap = current;
+        current = next;
+        next = swap;
+        count = next_count;
+    }
+    free(next);
+    job->tasks = current;
+    job->num_tasks = count;
+}
+
+
+// Formats every record with an atomic number in [lower, upper] with emit,
+// spread over scan_threads threads, and writes the result to output in key
+// order. Returns the number of records. Not for concurrent mode.
+long parallel_scan(int lower, int upper, ScanEmit emit, FILE *output) {
+    if (root == NULL || lower > upper) {
+        return 0;
+    }
+    ScanJob job;
+    job.lower = lower;
+    job.upper = upper;
+    job.emit = emit;
+    scan_partition(&job, scan_thread_count() * SCAN_TASKS_PER_THREAD);
+    scan_run(&job);
+    return scan_finish(&job, output);
+}
+
+
+// Like parallel_scan(), over a list of elements (such as a block list).
+long parallel_scan_list(Element **elements, int count, ScanEmit emit, FILE *output) {
+    if (count <= 0) {
+        return 0;
+    }
+    ScanJob job;
+    job.emit = emit;
+    job.num_tasks = scan_thread_count() * SCAN_TASKS_PER_THREAD;
+    if (job.num_tasks > count) {
+        job.num_tasks = count;
+    }
+    job.tasks = (ScanTask *)calloc(job.num_tasks, sizeof(ScanTask));
+    for (int i = 0; i < job.num_tasks; i++) {
+        int from = (int)((long)count * i / job.num_tasks);
+        job.tasks[i].elements = elements + from;
+        job.tasks[i].count = (int)((long)count * (i + 1) / job.num_tasks) - from;
+    }
+    scan_run(&job);
+    return scan_finish(&job, output);
+}
+
+
+// The listing format of range_search(), print_tree() and the block displays.
+static void scan_emit_display(ScanTask *task, const Element *element) {
+    scan_printf(task, "%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", element->name,
+                element->symbol, element->atomic_number, element->atomic_mass);
+}
+
+
+static int print_element_match(Element *element, void *arg) {
+    printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", element->name, element->symbol,
+           element->atomic_number, element->atomic_mass);
+    return 1;
+}
+
+
+// Large ranges are listed by parallel_scan().
+void range_search(int lower, int upper) {
+    if (root == NULL && (packed_tree == NULL || packed_tree->count == 0)) {
+        printf("Tree is empty. No elements to search.\n");
+        return;
+    }
+    if (cached_range_listing(lower, upper, print_element_match, scan_emit_display, stdout) == 0) {
+        printf("No elements found in the specified range.\n");
+    }
+}
+
+
+static CacheEntry **result_cache_bucket(int lower, int upper) {
+    uint64_t hash = ((uint64_t)(uint32_t)lower << 32 | (uint32_t)upper) * 0x9E3779B97F4A7C15ULL;
+    return &result_cache.buckets[(hash >> 32) & (uint64_t)(result_cache.num_buckets - 1)];
+}
+
+
+static CacheEntry *result_cache_find(int lower, int upper) {
+    CacheEntry *entry = *result_cache_bucket(lower, upper);
+    while (entry != NULL && (entry->lower != lower || entry->upper != upper)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+
+static void result_cache_unlink(CacheEntry *entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        result_cache.newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        result_cache.oldest = entry->newer;
+    }
+}
+
+
+static void result_cache_push(CacheEntry *entry) {
+    entry->newer = NULL;
+    entry->older = result_cache.newest;
+    if (result_cache.newest != NULL) {
+        result_cache.newest->newer = entry;
+    } else {
+        result_cache.oldest = entry;
+    }
+    result_cache.newest = entry;
+}
+
+
+static void result_cache_remove(CacheEntry *entry) {
+    CacheEntry **link = result_cache_bucket(entry->lower, entry->upper);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    result_cache_unlink(entry);
+
+    // The last slot fills the hole.
+    int last = --result_cache.count;
+    result_cache.lowers[entry->slot] = result_cache.lowers[last];
+    result_cache.uppers[entry->slot] = result_cache.uppers[last];
+    result_cache.slots[entry->slot] = result_cache.slots[last];
+    result_cache.slots[entry->slot]->slot = entry->slot;
+
+    result_cache.records -= entry->count;
+    free(entry->elements);
+    free(entry);
+}
+
+
+// Takes ownership of elements. Makes room by dropping the least recently used entries.
+static void result_cache_add(int lower, int upper, Element **elements, int count) {
+    while (result_cache.count > 0 &&
+           (result_cache.count == result_cache.max_entries || result_cache.records + count > result_cache.max_records)) {
+        result_cache_remove(result_cache.oldest);
+        result_cache.evictions++;
+    }
+    CacheEntry *entry = (CacheEntry *)malloc(sizeof(CacheEntry));
+    entry->lower = lower;
+    entry->upper = upper;
+    entry->elements = elements;
+    entry->count = count;
+    entry->slot = result_cache.count++;
+    result_cache.lowers[entry->slot] = lower;
+    result_cache.uppers[entry->slot] = upper;
+    result_cache.slots[entry->slot] = entry;
+    CacheEntry **bucket = result_cache_bucket(lower, upper);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    result_cache_push(entry);
+    result_cache.records += count;
+}
+
+
+// Caches the results of up to max_entries ranges, holding at most
+// max_records records between them. Enabling again resizes and empties it.
+void result_cache_enable(int max_entries, long max_records) {
+    result_cache_disable();
+    if (max_entries < 1) {
+        max_entries = 1;
+    }
+    result_cache.num_buckets = 1;
+    while (result_cache.num_buckets < 2 * max_entries) {
+        result_cache.num_buckets *= 2;
+    }
+    result_cache.buckets = (CacheEntry **)calloc(result_cache.num_buckets, sizeof(CacheEntry *));
+    result_cache.lowers = (int *)malloc(max_entries * sizeof(int));
+    result_cache.uppers = (int *)malloc(max_entries * sizeof(int));
+    result_cache.slots = (CacheEntry **)malloc(max_entries * sizeof(CacheEntry *));
+    result_cache.max_entries = max_entries;
+    result_cache.max_records = max_records;
+    result_cache.enabled = 1;
+}
+
+
+void result_cache_disable(void) {
+    result_cache_clear();
+    free(result_cache.buckets);
+    free(result_cache.lowers);
+    free(result_cache.uppers);
+    free(result_cache.slots);
+    result_cache.buckets = NULL;
+    result_cache.lowers = NULL;
+    result_cache.uppers = NULL;
+    result_cache.slots = NULL;
+    result_cache.enabled = 0;
+}
+
+
+// Drops every entry; the counters are kept.
+void result_cache_clear(void) {
+    while (result_cache.count > 0) {
+        result_cache_remove(result_cache.oldest);
+    }
+}
+
+
+// Called for every record entering or leaving the tree (from
+// index_element() and unindex_element(), so under index_lock() in
+// concurrent mode): drops the cached ranges that hold the key.
+void result_cache_invalidate(int atomic_number) {
+    if (!result_cache.enabled) {
+        return;
+    }
+    result_cache.writes++;
+    int hit = 0;
+    for (int i = 0; i < result_cache.count; i++) {
+        hit |= (result_cache.lowers[i] <= atomic_number) & (atomic_number <= result_cache.uppers[i]);
+    }
+    if (!hit) {
+        return;
+    }
+    for (int i = 0; i < result_cache.count;) {
+        if (result_cache.lowers[i] <= atomic_number && atomic_number <= result_cache.uppers[i]) {
+            result_cache_remove(result_cache.slots[i]);
+            result_cache.invalidations++;
+        } else {
+            i++;
+        }
+    }
+}
+
+
+// Visits the records with keys in [lower, upper] in key order until visit
+// returns 0, and returns how many were visited. With the result cache on,
+// a range asked before and not written since is answered from the cached
+// records without touching the tree; otherwise the tree is scanned and the
+// result kept, unless it is too big or a write landed during the scan.
+// Cached records are only visited under index_lock(), which writers hold
+// while they drop the entries a record is leaving. A packed tree is scanned
+// by packed_scan() and never cached.
+//
+// With emit set, a range the cache can't answer is sized by
+// range_aggregate(), and one too big to be cached and big enough for
+// parallel_scan() goes there, with emit and output, instead of to visit.
+static long range_scan(int lower, int upper, int (*visit)(Element *element, void *arg), void *arg,
+                       ScanEmit emit, FILE *output) {
+    long count = 0;
+    Cursor cursor;
+    Element *element;
+    if (packed_tree != NULL) {
+        return packed_scan(lower, upper, visit, arg);
+    }
+
+    uint64_t writes = 0;
+    long limit = 0;
+    if (result_cache.enabled) {
+        index_lock();
+        CacheEntry *entry = result_cache_find(lower, upper);
+        if (entry != NULL) {
+            result_cache.hits++;
+            result_cache_unlink(entry);
+            result_cache_push(entry);
+            while (count < entry->count && visit(entry->elements[count++], arg)) {
+            }
+            index_unlock();
+            return count;
+        }
+        result_cache.misses++;
+        writes = result_cache.writes;
+        index_unlock();
+        limit = result_cache.max_records / RESULT_CACHE_ENTRY_SHARE;
+    }
+
+    if (emit != NULL && !tree_concurrent) {
+        long records = range_aggregate(lower, upper).count;
+        if (records > limit && parallel_scan_worthwhile(records)) {
+            return parallel_scan(lower, upper, emit, output);
+        }
+    }
+
+    int capacity = 16;
+    Element **elements = result_cache.enabled ? (Element **)malloc(capacity * sizeof(Element *)) : NULL;
+    cursor_seek(&cursor, lower, upper);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        if (elements != NULL && count == limit) {
+            free(elements);
+            elements = NULL;
+        } else if (elements != NULL) {
+            if (count == capacity) {
+                capacity *= 2;
+                elements = (Element **)realloc(elements, capacity * sizeof(Element *));
+            }
+            elements[count] = element;
+        }
+        count++;
+        if (!visit(element, arg)) {
+            free(elements);
+            return count;
+        }
+    }
+
+    if (elements != NULL) {
+        index_lock();
+        if (result_cache.enabled && result_cache.writes == writes && result_cache_find(lower, upper) == NULL) {
+            result_cache_add(lower, upper, elements, (int)count);
+            elements = NULL;
+        }
+        index_unlock();
+    }
+    free(elements);
+    return count;
+}
+
+
+long cached_range_scan(int lower, int upper, int (*visit)(Element *element, void *arg), void *arg) {
+    return range_scan(lower, upper, visit, arg, NULL, NULL);
+}
+
+
+// cached_range_scan() for listings (range_search(), batch RANGE): large
+// ranges the cache can't answer are listed by parallel_scan() with emit.
+long cached_range_listing(int lower, int upper, int (*visit)(Element *element, void *arg), ScanEmit emit,
+                          FILE *output) {
+    return range_scan(lower, upper, visit, output, emit, output);
+}
+
+
+// Adds the records of node's subtree with keys in [lower, upper] to result.
+// lower_open / upper_open say the subtree is already known to lie above
+// lower / below upper. Children strictly between the two boundary children
+// are covered whole, so only the two boundary paths are descended.
+static void node_range_aggregate(const Node *node, int lower, int upper, int lower_open, int upper_open,
+                                 Aggregate *result) {
+    if (lower_open && upper_open) {
+        aggregate_merge(result, &node->stats);
+        return;
+    }
+    if (node->is_leaf) {
+        int i = lower_open ? 0 : node_lower_bound(node, lower);
+        for (; i < node->num_keys && (upper_open || node->keys[i] <= upper); i++) {
+            aggregate_add(result, node->elements[i]->atomic_mass);
+        }
+        return;
+    }
+    int first = lower_open ? 0 : node_upper_bound(node, lower);
+    int last = upper_open ? node->num_keys : node_upper_bound(node, upper);
+    if (first == last) {
+        node_range_aggregate(node->children[first], lower, upper, lower_open, upper_open, result);
+        return;
+    }
+    node_range_aggregate(node->children[first], lower, upper, lower_open, 1, result);
+    for (int i = first + 1; i < last; i++) {
+        aggregate_merge(result, &node->children[i]->stats);
+    }
+    node_range_aggregate(node->children[last], lower, upper, 1, upper_open, result);
+}
+
+
+// Count, sum, min and max of the atomic masses of the records with atomic
+// numbers in [lower, upper], in O(log n) node visits. The subtree stats are
+// not kept in concurrent mode, so there the range is scanned instead.
+Aggregate range_aggregate(int lower, int upper) {
+    materialize_tree();
+    Aggregate result;
+    aggregate_clear(&result);
+    if (root == NULL || lower > upper) {
+        return result;
+    }
+    if (tree_concurrent) {
+        Cursor cursor;
+        Element *element;
+        cursor_seek(&cursor, lower, upper);
+        while ((element = cursor_next(&cursor)) != NULL) {
+            aggregate_add(&result, element->atomic_mass);
+        }
+        return result;
+    }
+    node_range_aggregate(root, lower, upper, 0, 0, &result);
+    return result;
+}
+
+
+// Number of records with an atomic number below atomic_number, i.e. the
+// position it has or would have in key order. At each level the children
+// on the shorter side of the path are counted.
+long rank(int atomic_number) {
+    materialize_tree();
+    if (root == NULL) {
+        return 0;
+    }
+    if (tree_concurrent) {
+        return atomic_number == INT_MIN ? 0 : range_aggregate(INT_MIN, atomic_number - 1).count;
+    }
+    long position = 0;
+    const Node *cur = root;
+    while (!cur->is_leaf) {
+        int i = node_upper_bound(cur, atomic_number);
+        if (i <= cur->num_keys / 2) {
+            for (int j = 0; j < i; j++) {
+                position += cur->children[j]->stats.count;
+            }
+        } else {
+            position += cur->stats.count;
+            for (int j = i; j <= cur->num_keys; j++) {
+                position -= cur->children[j]->stats.count;
+            }
+        }
+        cur = cur->children[i];
+    }
+    return position + node_lower_bound(cur, atomic_number);
+}
+
+
+// The record at position (counting from 0) in key order, or NULL if there
+// are not that many records. Children are skipped from whichever end of a
+// node is closer to the position.
+Element *select_element(long position) {
+    materialize_tree();
+    if (root == NULL || position < 0) {
+        return NULL;
+    }
+    if (tree_concurrent) {
+        Cursor cursor;
+        Element *element;
+        cursor_seek(&cursor, INT_MIN, INT_MAX);
+        while ((element = cursor_next(&cursor)) != NULL && position-- > 0) {
+        }
+        return element;
+    }
+    if (position >= root->stats.count) {
+        return NULL;
+    }
+    const Node *cur = root;
+    while (!cur->is_leaf) {
+        int i;
+        if (position < cur->stats.count / 2) {
+            for (i = 0; position >= cur->children[i]->stats.count; i++) {
+                position -= cur->children[i]->stats.count;
+            }
+        } else {
+            long remaining = cur->stats.count - position;
+            for (i = cur->num_keys; remaining > cur->children[i]->stats.count; i--) {
+                remaining -= cur->children[i]->stats.count;
+            }
+            position = cur->children[i]->stats.count - remaining;
+        }
+        cur = cur->children[i];
+    }
+    return cur->elements[position];
+}
+
+
+// Copy-on-write views. view_open() pins the tree as it is at that moment:
+// from then on a writer copies a node's old contents onto its version chain
+// before changing it (see cow_preserve()), and the nodes and elements the
+// tree lets go of are retired rather than freed, so a view can be scanned
+// for as long as needed while updates carry on. Live nodes are still
+// changed in place, which leaves the leaf chain, the optimistic locks and
+// the stats alone; a view reads only keys, elements and child pointers, and
+// walks down from its own root instead of along the leaf chain. Each node is
+// copied at most once per view_open(), and only while a view is open.
+// view_close() frees whatever no remaining view can reach.
+//
+// In concurrent mode views may be opened, read and closed from any thread
+// alongside readers and writers. Otherwise they are for a single thread
+// interleaving scans of a view with its own updates. Bulk loading, loading
+// a snapshot and destroy_tree() need every view closed.
+TreeView *view_open(void) {
+    materialize_tree();
+    TreeView *view = (TreeView *)malloc(sizeof(TreeView));
+    if (view == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&view_mutex);
+    if (tree_concurrent) {
+        int spins = 0;
+        __atomic_store_n(&cow_gate, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&cow_writers, __ATOMIC_SEQ_CST) != 0) {
+            version_backoff(&spins);
+        }
+    }
+    view->epoch = cow_epoch;
+    view->root = root;
+    __atomic_store_n(&newest_view_epoch, view->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cow_epoch, view->epoch + 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cow_gate, 0, __ATOMIC_RELEASE);
+    view->next = open_views;
+    open_views = view;
+    pthread_mutex_unlock(&view_mutex);
+    return view;
+}
+
+
+// Frees the retired objects no open view can reach any more: those that
+// stopped being current no later than the oldest view's epoch. A copy is
+// cut off its owner's version chain first; the copies that go at once are
+// always the oldest part of a chain. Called with view_mutex held.
+static void cow_reclaim(void) {
+    uint64_t oldest = UINT64_MAX;
+    for (const TreeView *view = open_views; view != NULL; view = view->next) {
+        if (view->epoch < oldest) {
+            oldest = view->epoch;
+        }
+    }
+    if (tree_concurrent) {
+        pthread_mutex_lock(&pool_mutex);
+    }
+    // Copies go in a first pass, while their owners are still allocated.
+    for (int copies = 1; copies >= 0; copies--) {
+        int kept = 0;
+        for (int i = 0; i < retired_version_count; i++) {
+            RetiredVersion *retired = &retired_versions[i];
+            if (retired->death > oldest || (retired->kind == RETIRED_COPY) != copies) {
+                retired_versions[kept++] = *retired;
+            } else if (retired->kind == RETIRED_COPY) {
+                Node **link = &retired->owner->prev_version;
+                while (*link != NULL && *link != retired->object) {
+                    link = &(*link)->prev_version;
+                }
+                if (*link != NULL) {
+                    __atomic_store_n(link, NULL, __ATOMIC_RELEASE);
+                }
+                pool_free(&node_pool, retired->object);
+            } else if (retired->kind == RETIRED_NODE) {
+                pool_free(&node_pool, retired->object);
+            } else {
+                element_release(retired->object);
+            }
+        }
+        retired_version_count = kept;
+    }
+    if (tree_concurrent) {
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+
+void view_close(TreeView *view) {
+    pthread_mutex_lock(&view_mutex);
+    TreeView **link = &open_views;
+    while (*link != view) {
+        link = &(*link)->next;
+    }
+    *link = view->next;
+    uint64_t newest = 0;
+    for (const TreeView *open = open_views; open != NULL; open = open->next) {
+        if (open->epoch > newest) {
+            newest = open->epoch;
+        }
+    }
+    __atomic_store_n(&newest_view_epoch, newest, __ATOMIC_SEQ_CST);
+    cow_reclaim();
+    pthread_mutex_unlock(&view_mutex);
+    free(view);
+}
+
+
+// Contents of node as of view's epoch: node itself if it has not been
+// changed since, otherwise the copy on its version chain. In concurrent mode
+// *seen gets the version a read of node itself must be validated against
+// (see view_validate()); a copy never changes.
+static Node *view_version(const TreeView *view, Node *node, uint64_t *seen) {
+    if (tree_concurrent) {
+        // A retired node may be marked obsolete; its contents stay readable.
+        int spins = 0;
+        uint64_t v;
+        while ((v = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & VERSION_LOCKED) {
+            version_backoff(&spins);
+        }
+        *seen = v;
+    }
+    if (__atomic_load_n(&node->epoch, __ATOMIC_ACQUIRE) <= view->epoch) {
+        return node;
+    }
+    Node *version = __atomic_load_n(&node->prev_version, __ATOMIC_ACQUIRE);
+    while (version->epoch > view->epoch) {
+        version = version->prev_version;
+    }
+    return version;
+}
+
+
+static inline int view_validate(Node *node, const Node *version, uint64_t seen) {
+    return !tree_concurrent || version != node || version_validate(&node->version, seen);
+}
+
+
+Element *view_search(const TreeView *view, int atomic_number) {
+    Node *node = view->root;
+    if (node == NULL) {
+        return NULL;
+    }
+    for (;;) {
+        uint64_t seen = 0;
+        Node *version = view_version(view, node, &seen);
+        int n = version->num_keys;
+        int is_leaf = version->is_leaf;
+        Node *child = NULL;
+        Element *found = NULL;
+        if (n >= 0 && n <= MAX_ELEMENTS) {
+            if (is_leaf) {
+                int i = keys_lower_bound(version->keys, n, atomic_number);
+                if (i < n && version->keys[i] == atomic_number) {
+                    found = version->elements[i];
+                }
+            } else {
+                child = version->children[keys_upper_bound(version->keys, n, atomic_number)];
+            }
+        }
+        if (!view_validate(node, version, seen)) {
+            continue;
+        }
+        if (is_leaf) {
+            return found;
+        }
+        node = child;
+    }
+}
+
+
+// Positions cursor on the first element of view with atomic number >= lower.
+void view_cursor_seek(ViewCursor *cursor, const TreeView *view, int lower, int upper) {
+    cursor->view = view;
+    cursor->upper = upper;
+    cursor->depth = -1;
+    Node *node = view->root;
+    int depth = 0;
+    while (node != NULL) {
+        uint64_t seen = 0;
+        Node *version = view_version(view, node, &seen);
+        int n = version->num_keys;
+        int is_leaf = version->is_leaf;
+        Node *child = NULL;
+        int i = 0;
+        if (n >= 0 && n <= MAX_ELEMENTS) {
+            if (is_leaf) {
+                i = keys_lower_bound(version->keys, n, lower);
+            } else {
+                i = keys_upper_bound(version->keys, n, lower);
+                child = version->children[i];
+            }
+        }
+        if (!view_validate(node, version, seen)) {
+            continue;
+        }
+        cursor->path[depth] = node;
+        cursor->index[depth] = i;
+        if (is_leaf) {
+            cursor->depth = depth;
+            return;
+        }
+        node = child;
+        depth++;
+    }
+}
+
+
+// Returns the next element of the view in key order, or NULL once the scan
+// passes upper. Past the end of a leaf the cursor climbs to the first level
+// with a child left and descends along its leftmost path.
+Element *view_cursor_next(ViewCursor *cursor) {
+    while (cursor->depth >= 0) {
+        int depth = cursor->depth;
+        Node *node = cursor->path[depth];
+        int i = cursor->index[depth];
+        uint64_t seen = 0;
+        Node *version = view_version(cursor->view, node, &seen);
+        int n = version->num_keys;
+        int is_leaf = version->is_leaf;
+        int key = 0;
+        Element *element = NULL;
+        Node *child = NULL;
+        if (n >= 0 && n <= MAX_ELEMENTS) {
+            if (is_leaf && i < n) {
+                key = version->keys[i];
+                element = version->elements[i];
+            } else if (!is_leaf && i <= n) {
+                child = version->children[i];
+            }
+        }
+        if (!view_validate(node, version, seen)) {
+            continue;
+        }
+        if (element != NULL) {
+            if (key > cursor->upper) {
+                cursor->depth = -1;
+                return NULL;
+            }
+            cursor->index[depth]++;
+            return element;
+        }
+        if (child != NULL) {
+            cursor->path[depth + 1] = child;
+            cursor->index[depth + 1] = 0;
+            cursor->depth++;
+        } else if (--cursor->depth >= 0) {
+            cursor->index[cursor->depth]++;
+        }
+    }
+    return NULL;
+}
+
+
+void view_range_search(const TreeView *view, int lower, int upper) {
+    ViewCursor cursor;
+    Element *element;
+    int found = 0;
+    view_cursor_seek(&cursor, view, lower, upper);
+    while ((element = view_cursor_next(&cursor)) != NULL) {
+        printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", element->name,
+               element->symbol, element->atomic_number, element->atomic_mass);
+        found = 1;
+    }
+    if (!found) {
+        printf("No elements found in the specified range.\n");
+    }
+}
+
+
+// Like display_block_elements(), but as of the view. Views don't keep the
+// block index, so this scans the view's records.
+void view_display_block_elements(const TreeView *view, char block) {
+    ViewCursor cursor;
+    Element *element;
+    view_cursor_seek(&cursor, view, INT_MIN, INT_MAX);
+    while ((element = view_cursor_next(&cursor)) != NULL) {
+        if (element->block == block) {
+            printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n",
+                   element->name, element->symbol, element->atomic_number, element->atomic_mass);
+        }
+    }
+}
+
+
+// Keeps every enabled secondary index in step with a record entering the tree.
+void index_element(Element *element) {
+    result_cache_invalidate(element->atomic_number);
+    if (element->block) {
+        block_list_insert(element);
+    }
+    if (symbol_index.enabled) {
+        symbol_index_insert(element);
+    }
+    if (name_index.enabled) {
+        ordered_index_insert(&name_index, element);
+    }
+    if (mass_index.enabled) {
+        ordered_index_insert(&mass_index, element);
+    }
+    if (name_trie.enabled) {
+        trie_insert(&name_trie, element);
+    }
+    if (symbol_trie.enabled) {
+        trie_insert(&symbol_trie, element);
+    }
+}
+
+
+// Drops a record that is leaving the tree from every enabled secondary index.
+void unindex_element(Element *element) {
+    result_cache_invalidate(element->atomic_number);
+    if (element->block) {
+        block_list_remove(element);
+    }
+    if (symbol_index.enabled) {
+        symbol_index_remove(element);
+    }
+    if (name_index.enabled) {
+        ordered_index_remove(&name_index, element);
+    }
+    if (mass_index.enabled) {
+        ordered_index_remove(&mass_index, element);
+    }
+    if (name_trie.enabled) {
+        trie_remove(&name_trie, element);
+    }
+    if (symbol_trie.enabled) {
+        trie_remove(&symbol_trie, element);
+    }
+}
+
+
+static unsigned int hash_symbol(const char *symbol) {
+    unsigned int hash = 2166136261u;
+    for (const char *c = symbol; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+
+static void string_pool_grow(StringPool *pool) {
+    int capacity = pool->capacity > 0 ? pool->capacity * 2 : 64;
+    InternedString **buckets = (InternedString **)calloc(capacity, sizeof(InternedString *));
+    for (int i = 0; i < pool->capacity; i++) {
+        InternedString *string = pool->buckets[i];
+        while (string != NULL) {
+            InternedString *next = string->next;
+            string->next = buckets[string->hash & (capacity - 1)];
+            buckets[string->hash & (capacity - 1)] = string;
+            string = next;
+        }
+    }
+    free(pool->buckets);
+    pool->buckets = buckets;
+    pool->capacity = capacity;
+}
+
+
+// Returns the pool's copy of text, taking a reference to it.
+const char *string_intern(StringPool *pool, const char *text) {
+    unsigned int hash = hash_symbol(text);
+    if (pool->capacity > 0) {
+        for (InternedString *string = pool->buckets[hash & (pool->capacity - 1)]; string != NULL; string = string->next) {
+            if (string->hash == hash && strcmp(string->text, text) == 0) {
+                string->refs++;
+                return string->text;
+            }
+        }
+    }
+    if (pool->count >= pool->capacity / 4 * 3) {
+        string_pool_grow(pool);
+    }
+    size_t size = sizeof(InternedString) + strlen(text) + 1;
+    InternedString *string = (InternedString *)malloc(size);
+    strcpy(string->text, text);
+    string->hash = hash;
+    string->refs = 1;
+    string->next = pool->buckets[hash & (pool->capacity - 1)];
+    pool->buckets[hash & (pool->capacity - 1)] = string;
+    pool->count++;
+    pool->bytes += size;
+    return string->text;
+}
+
+
+// Drops a reference taken by string_intern(); the last one frees the string.
+void string_release(StringPool *pool, const char *text) {
+    InternedString *string = (InternedString *)(text - offsetof(InternedString, text));
+    if (--string->refs > 0) {
+        return;
+    }
+    InternedString **link = &pool->buckets[string->hash & (pool->capacity - 1)];
+    while (*link != string) {
+        link = &(*link)->next;
+    }
+    *link = string->next;
+    pool->count--;
+    pool->bytes -= sizeof(InternedString) + strlen(string->text) + 1;
+    free(string);
+}
+
+
+void string_pool_destroy(StringPool *pool) {
+    for (int i = 0; i < pool->capacity; i++) {
+        InternedString *string = pool->buckets[i];
+        while (string != NULL) {
+            InternedString *next = string->next;
+            free(string);
+            string = next;
+        }
+    }
+    free(pool->buckets);
+    pool->buckets = NULL;
+    pool->capacity = 0;
+    pool->count = 0;
+    pool->bytes = 0;
+}
+
+
+// Returns the slot for symbol, claiming an empty one if create is set.
+static SymbolSlot *symbol_index_slot(const char *symbol, int create) {
+    if (symbol_index.capacity == 0) {
+        if (!create) {
+            return NULL;
+        }
+        symbol_index.capacity = 256;
+        symbol_index.slots = (SymbolSlot *)calloc(symbol_index.capacity, sizeof(SymbolSlot));
+    }
+    if (create && (symbol_index.used + 1) * 10 > symbol_index.capacity * 7) {
+        SymbolSlot *old_slots = symbol_index.slots;
+        int old_capacity = symbol_index.capacity;
+        symbol_index.capacity *= 2;
+        symbol_index.slots = (SymbolSlot *)calloc(symbol_index.capacity, sizeof(SymbolSlot));
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_slots[i].symbol[0] != '\0') {
+                unsigned int j = hash_symbol(old_slots[i].symbol) & (symbol_index.capacity - 1);
+                while (symbol_index.slots[j].symbol[0] != '\0') {
+                    j = (j + 1) & (symbol_index.capacity - 1);
+                }
+                symbol_index.slots[j] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    unsigned int i = hash_symbol(symbol) & (symbol_index.capacity - 1);
+    while (symbol_index.slots[i].symbol[0] != '\0') {
+        if (strcmp(symbol_index.slots[i].symbol, symbol) == 0) {
+            return &symbol_index.slots[i];
+        }
+        i = (i + 1) & (symbol_index.capacity - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+    strncpy(symbol_index.slots[i].symbol, symbol, sizeof(symbol_index.slots[i].symbol) - 1);
+    symbol_index.slots[i].head = NULL;
+    symbol_index.used++;
+    return &symbol_index.slots[i];
+}
+
+
+void symbol_index_insert(Element *element) {
+    SymbolSlot *slot = symbol_index_slot(element->symbol, 1);
+    element->symbol_prev = NULL;
+    element->symbol_next = slot->head;
+    if (slot->head != NULL) {
+        slot->head->symbol_prev = element;
+    }
+    slot->head = element;
+}
+
+
+void symbol_index_remove(Element *element) {
+    if (element->symbol_prev != NULL) {
+        element->symbol_prev->symbol_next = element->symbol_next;
+    } else {
+        SymbolSlot *slot = symbol_index_slot(element->symbol, 0);
+        if (slot != NULL && slot->head == element) {
+            slot->head = element->symbol_next;
+        }
+    }
+    if (element->symbol_next != NULL) {
+        element->symbol_next->symbol_prev = element->symbol_prev;
+    }
+    element->symbol_next = NULL;
+    element->symbol_prev = NULL;
+}
+
+
+int compare_by_name(const Element *a, const Element *b) {
+    int c = strcmp(a->name, b->name);
+    if (c != 0) {
+        return c;
+    }
+    return (a->atomic_number > b->atomic_number) - (a->atomic_number < b->atomic_number);
+}
+
+
+// Orders by atomic mass, then atomic number. A NaN mass sorts after every
+// number so the order stays total.
+int compare_by_mass(const Element *a, const Element *b) {
+    int a_nan = isnan(a->atomic_mass);
+    int b_nan = isnan(b->atomic_mass);
+    if (a_nan != b_nan) {
+        return a_nan - b_nan;
+    }
+    if (!a_nan && a->atomic_mass != b->atomic_mass) {
+        return a->atomic_mass < b->atomic_mass ? -1 : 1;
+    }
+    return (a->atomic_number > b->atomic_number) - (a->atomic_number < b->atomic_number);
+}
+
+
+int compare_by_number(const Element *a, const Element *b) {
+    return (a->atomic_number > b->atomic_number) - (a->atomic_number < b->atomic_number);
+}
+
+
+const char *element_name_key(const Element *element) {
+    return element->name;
+}
+
+
+const char *element_symbol_key(const Element *element) {
+    return element->symbol;
+}
+
+
+static unsigned int index_priority_state = 2463534242u;
+
+static unsigned int next_index_priority(void) {
+    index_priority_state ^= index_priority_state << 13;
+    index_priority_state ^= index_priority_state >> 17;
+    index_priority_state ^= index_priority_state << 5;
+    return index_priority_state;
+}
+
+
+static IndexNode *treap_insert(IndexNode *node, IndexNode *item, int (*compare)(const Element *a, const Element *b)) {
+    if (node == NULL) {
+        return item;
+    }
+    if (compare(item->element, node->element) < 0) {
+        node->left = treap_insert(node->left, item, compare);
+        if (node->left->priority > node->priority) {
+            IndexNode *left = node->left;
+            node->left = left->right;
+            left->right = node;
+            return left;
+        }
+    } else {
+        node->right = treap_insert(node->right, item, compare);
+        if (node->right->priority > node->priority) {
+            IndexNode *right = node->right;
+            node->right = right->left;
+            right->left = node;
+            return right;
+        }
+    }
+    return node;
+}
+
+
+// Joins two treaps where every element of left orders before every element of right.
+static IndexNode *treap_join(IndexNode *left, IndexNode *right) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    if (left->priority > right->priority) {
+        left->right = treap_join(left->right, right);
+        return left;
+    }
+    right->left = treap_join(left, right->left);
+    return right;
+}
+
+
+static IndexNode *treap_remove(IndexNode *node, Element *element, int (*compare)(const Element *a, const Element *b)) {
+    if (node == NULL) {
+        return NULL;
+    }
+    int c = compare(element, node->element);
+    if (c < 0) {
+        node->left = treap_remove(node->left, element, compare);
+    } else if (c > 0) {
+        node->right = treap_remove(node->right, element, compare);
+    } else {
+        IndexNode *joined = treap_join(node->left, node->right);
+        pool_free(&index_node_pool, node);
+        return joined;
+    }
+    return node;
+}
+
+
+void ordered_index_insert(OrderedIndex *index, Element *element) {
+    IndexNode *item = (IndexNode *)pool_alloc(&index_node_pool);
+    item->element = element;
+    item->priority = next_index_priority();
+    item->left = NULL;
+    item->right = NULL;
+    index->root = treap_insert(index->root, item, index->compare);
+}
+
+
+void ordered_index_remove(OrderedIndex *index, Element *element) {
+    index->root = treap_remove(index->root, element, index->compare);
+}
+
+
+// Visits, in order, every element between lower and upper inclusive.
+// Stops early and returns 0 as soon as visit returns 0.
+int ordered_index_scan(IndexNode *node, int (*compare)(const Element *a, const Element *b),
+                       const Element *lower, const Element *upper,
+                       int (*visit)(Element *element, void *arg), void *arg) {
+    while (node != NULL) {
+        if (compare(node->element, lower) < 0) {
+            node = node->right;
+        } else if (compare(node->element, upper) > 0) {
+            node = node->left;
+        } else {
+            if (!ordered_index_scan(node->left, compare, lower, upper, visit, arg)) {
+                return 0;
+            }
+            if (!visit(node->element, arg)) {
+                return 0;
+            }
+            node = node->right;
+        }
+    }
+    return 1;
+}
+
+
+// Turns on the symbol index and fills it from the records already in the tree.
+void enable_symbol_index(void) {
+    if (symbol_index.enabled) {
+        return;
+    }
+    symbol_index.enabled = 1;
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        symbol_index_insert(element);
+    }
+}
+
+
+// Turns on the name index and fills it from the records already in the tree.
+void enable_name_index(void) {
+    if (name_index.enabled) {
+        return;
+    }
+    name_index.enabled = 1;
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        ordered_index_insert(&name_index, element);
+    }
+}
+
+
+// Turns on the atomic mass index and fills it from the records already in the tree.
+void enable_mass_index(void) {
+    if (mass_index.enabled) {
+        return;
+    }
+    mass_index.enabled = 1;
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        ordered_index_insert(&mass_index, element);
+    }
+}
+
+
+// Returns the first element in the chain of records with this symbol (follow
+// symbol_next for the rest), or NULL. Without the index this is a full scan.
+Element *search_by_symbol(const char *symbol) {
+    materialize_tree();
+    if (symbol_index.enabled) {
+        index_lock();
+        SymbolSlot *slot = symbol_index_slot(symbol, 0);
+        Element *head = slot != NULL ? slot->head : NULL;
+        index_unlock();
+        return head;
+    }
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        if (strcmp(element->symbol, symbol) == 0) {
+            return element;
+        }
+    }
+    return NULL;
+}
+
+
+static int take_first(Element *element, void *arg) {
+    *(Element **)arg = element;
+    return 0;
+}
+
+
+// Returns the record with this name (the lowest atomic number if several
+// share it), or NULL. Without the index this is a full scan.
+Element *search_by_name(const char *name) {
+    materialize_tree();
+    Element *found = NULL;
+    if (name_index.enabled) {
+        Element lower;
+        Element upper;
+        lower.name = name;
+        upper.name = name;
+        lower.atomic_number = INT_MIN;
+        upper.atomic_number = INT_MAX;
+        index_lock();
+        ordered_index_scan(name_index.root, name_index.compare, &lower, &upper, take_first, &found);
+        index_unlock();
+        return found;
+    }
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        if (strcmp(element->name, name) == 0) {
+            return element;
+        }
+    }
+    return NULL;
+}
+
+
+typedef struct {
+    int (*visit)(Element *element, void *arg);
+    void *arg;
+    long count;
+} MassVisit;
+
+static int mass_visit_counted(Element *element, void *arg) {
+    MassVisit *state = (MassVisit *)arg;
+    state->count++;
+    return state->visit(element, state->arg);
+}
+
+
+static int compare_mass_pointers(const void *a, const void *b) {
+    return compare_by_mass(*(Element *const *)a, *(Element *const *)b);
+}
+
+
+// Calls visit on every record whose atomic mass lies in [lower, upper], in
+// order of mass (ties by atomic number), until visit returns 0. Returns the
+// number of records visited. In concurrent mode visit runs under the index
+// lock, so it must not change the tree. Without the index the whole tree is
+// scanned and the matches are sorted.
+long mass_range_scan(double lower, double upper, int (*visit)(Element *element, void *arg), void *arg) {
+    materialize_tree();
+    MassVisit state = {visit, arg, 0};
+    if (!(lower <= upper)) {
+        return 0;
+    }
+    if (mass_index.enabled) {
+        Element low;
+        Element high;
+        low.atomic_mass = lower;
+        low.atomic_number = INT_MIN;
+        high.atomic_mass = upper;
+        high.atomic_number = INT_MAX;
+        index_lock();
+        ordered_index_scan(mass_index.root, mass_index.compare, &low, &high, mass_visit_counted, &state);
+        index_unlock();
+        return state.count;
+    }
+    Element **matches = NULL;
+    long count = 0;
+    long capacity = 0;
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        if (element->atomic_mass >= lower && element->atomic_mass <= upper) {
+            if (count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                matches = (Element **)realloc(matches, capacity * sizeof(Element *));
+            }
+            matches[count++] = element;
+        }
+    }
+    if (count > 0) {
+        qsort(matches, count, sizeof(Element *), compare_mass_pointers);
+    }
+    for (long i = 0; i < count && mass_visit_counted(matches[i], &state); i++) {
+    }
+    free(matches);
+    return state.count;
+}
+
+
+void mass_range_search(double lower, double upper) {
+    if (mass_range_scan(lower, upper, print_element_match, NULL) == 0) {
+        printf("No elements with an atomic mass in that range.\n");
+    }
+}
+
+
+// Lower-cases key into folded, which has room for capacity bytes. Returns
+// the key's length, or -1 if it does not fit.
+static int trie_fold(const char *key, char *folded, int capacity) {
+    int length = 0;
+    for (; key[length] != '\0'; length++) {
+        if (length == capacity - 1) {
+            return -1;
+        }
+        folded[length] = (char)tolower((unsigned char)key[length]);
+    }
+    folded[length] = '\0';
+    return length;
+}
+
+
+static TrieNode *trie_node_create(const char *label, int length) {
+    TrieNode *node = (TrieNode *)pool_alloc(&trie_node_pool);
+    memcpy(node->label, label, length);
+    node->length = (unsigned char)length;
+    node->child = NULL;
+    node->sibling = NULL;
+    node->entries.root = NULL;
+    node->entries.compare = compare_by_number;
+    node->entries.enabled = 1;
+    return node;
+}
+
+
+void trie_insert(Trie *trie, Element *element) {
+    char key[TRIE_KEY_MAX];
+    int length = trie_fold(trie->key(element), key, sizeof(key));
+    if (length < 0) {
+        return;
+    }
+    if (trie->root == NULL) {
+        trie->root = trie_node_create("", 0);
+    }
+    TrieNode *node = trie->root;
+    int pos = 0;
+    while (pos < length) {
+        TrieNode **link = &node->child;
+        while (*link != NULL && (unsigned char)(*link)->label[0] < (unsigned char)key[pos]) {
+            link = &(*link)->sibling;
+        }
+        TrieNode *child = *link;
+        if (child == NULL || child->label[0] != key[pos]) {
+            node = trie_node_create(key + pos, length - pos);
+            node->sibling = child;
+            *link = node;
+            break;
+        }
+        int common = 1;
+        while (common < child->length && pos + common < length && child->label[common] == key[pos + common]) {
+            common++;
+        }
+        if (common < child->length) {
+            // The key leaves the edge part way along: split it, with a new
+            // node taking the shared part of the label.
+            TrieNode *middle = trie_node_create(child->label, common);
+            middle->sibling = child->sibling;
+            middle->child = child;
+            child->sibling = NULL;
+            child->length -= common;
+            memmove(child->label, child->label + common, child->length);
+            *link = middle;
+            child = middle;
+        }
+        node = child;
+        pos += common;
+    }
+    ordered_index_insert(&node->entries, element);
+}
+
+
+// Removes element, then restores the shape rules on the way back up: a node
+// left with neither records nor children is unlinked, and one left with no
+// records and a single child absorbs that child.
+void trie_remove(Trie *trie, Element *element) {
+    char key[TRIE_KEY_MAX];
+    int length = trie_fold(trie->key(element), key, sizeof(key));
+    if (length < 0 || trie->root == NULL) {
+        return;
+    }
+    TrieNode **path[TRIE_KEY_MAX];
+    int depth = 0;
+    TrieNode *node = trie->root;
+    int pos = 0;
+    while (pos < length) {
+        TrieNode **link = &node->child;
+        while (*link != NULL && (*link)->label[0] != key[pos]) {
+            link = &(*link)->sibling;
+        }
+        TrieNode *child = *link;
+        if (child == NULL || child->length > length - pos || memcmp(child->label, key + pos, child->length) != 0) {
+            return;
+        }
+        path[depth++] = link;
+        node = child;
+        pos += child->length;
+    }
+    ordered_index_remove(&node->entries, element);
+    while (depth > 0 && node->entries.root == NULL) {
+        if (node->child == NULL) {
+            *path[depth - 1] = node->sibling;
+            pool_free(&trie_node_pool, node);
+            depth--;
+            node = depth > 0 ? *path[depth - 1] : trie->root;
+            continue;
+        }
+        if (node->child->sibling == NULL) {
+            TrieNode *child = node->child;
+            memcpy(node->label + node->length, child->label, child->length);
+            node->length += child->length;
+            node->child = child->child;
+            node->entries = child->entries;
+            pool_free(&trie_node_pool, child);
+        }
+        break;
+    }
+}
+
+
+static void trie_fill(Trie *trie) {
+    if (trie->enabled) {
+        return;
+    }
+    trie->enabled = 1;
+    Cursor cursor;
+    Element *element;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        trie_insert(trie, element);
+    }
+}
+
+
+// Turns on the name and symbol tries and fills them from the records already in the tree.
+void enable_prefix_index(void) {
+    trie_fill(&name_trie);
+    trie_fill(&symbol_trie);
+}
+
+
+// Top matches of one lookup, best first: by distance, then by folded key,
+// then by atomic number. Once the list is full, bound drops to the worst
+// distance kept, so the search can skip anything further away.
+typedef struct TrieSearch {
+    const Trie *trie;
+    TrieMatch *matches;
+    int count;
+    int limit;
+    int bound;
+    const char *query;
+    int query_length;
+} TrieSearch;
+
+static int trie_match_before(const TrieSearch *search, Element *element, int distance, const TrieMatch *match) {
+    if (distance != match->distance) {
+        return distance < match->distance;
+    }
+    int c = strcasecmp(search->trie->key(element), search->trie->key(match->element));
+    if (c != 0) {
+        return c < 0;
+    }
+    return element->atomic_number < match->element->atomic_number;
+}
+
+
+static void trie_offer(TrieSearch *search, Element *element, int distance) {
+    if (distance > search->bound) {
+        return;
+    }
+    int pos = search->count;
+    while (pos > 0 && trie_match_before(search, element, distance, &search->matches[pos - 1])) {
+        pos--;
+    }
+    if (pos == search->limit) {
+        return;
+    }
+    int moved = (search->count < search->limit ? search->count : search->limit - 1) - pos;
+    memmove(&search->matches[pos + 1], &search->matches[pos], moved * sizeof(TrieMatch));
+    search->matches[pos].element = element;
+    search->matches[pos].distance = distance;
+    if (search->count < search->limit) {
+        search->count++;
+    }
+    if (search->count == search->limit) {
+        search->bound = search->matches[search->limit - 1].distance;
+    }
+}
+
+
+// Offers every record in a node's entries, in order of atomic number. A
+// prefix listing (no query) stops, returning 0, once the list is full.
+static int trie_offer_entries(TrieSearch *search, IndexNode *entry, int distance) {
+    while (entry != NULL) {
+        if (!trie_offer_entries(search, entry->left, distance)) {
+            return 0;
+        }
+        if (search->query == NULL && search->count == search->limit) {
+            return 0;
+        }
+        trie_offer(search, entry->element, distance);
+        entry = entry->right;
+    }
+    return search->query != NULL || search->count < search->limit;
+}
+
+
+// Keys are visited in order, so the first limit records found are the answer.
+static int trie_list(TrieSearch *search, TrieNode *node) {
+    if (!trie_offer_entries(search, node->entries.root, 0)) {
+        return 0;
+    }
+    for (TrieNode *child = node->child; child != NULL; child = child->sibling) {
+        if (!trie_list(search, child)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// Fills matches with up to limit records whose name or symbol (as the trie
+// is keyed) starts with prefix, ignoring case, and returns how many. Without
+// the trie this is a full scan.
+int prefix_search(Trie *trie, const char *prefix, TrieMatch *matches, int limit) {
+    materialize_tree();
+    char folded[TRIE_KEY_MAX];
+    int length = trie_fold(prefix, folded, sizeof(folded));
+    TrieSearch search = {trie, matches, 0, limit, 0, NULL, 0};
+    if (length < 0 || limit <= 0) {
+        return 0;
+    }
+    if (!trie->enabled) {
+        Cursor cursor;
+        Element *element;
+        cursor_seek(&cursor, INT_MIN, INT_MAX);
+        while ((element = cursor_next(&cursor)) != NULL) {
+            if (strncasecmp(trie->key(element), folded, length) == 0) {
+                trie_offer(&search, element, 0);
+            }
+        }
+        return search.count;
+    }
+    index_lock();
+    // Walk down to the node whose subtree holds exactly the keys with this prefix.
+    TrieNode *node = trie->root;
+    int pos = 0;
+    while (node != NULL && pos < length) {
+        TrieNode *child = node->child;
+        while (child != NULL && child->label[0] != folded[pos]) {
+            child = child->sibling;
+        }
+        int shared = child != NULL && child->length < length - pos ? child->length : length - pos;
+        if (child == NULL || memcmp(child->label, folded + pos, shared) != 0) {
+            node = NULL;
+            break;
+        }
+        node = child;
+        pos += shared;
+    }
+    if (node != NULL) {
+        trie_list(&search, node);
+    }
+    index_unlock();
+    return search.count;
+}
+
+
+// Advances one row of the edit distance table by character c. Returns the
+// smallest entry of the new row, a lower bound on the distance of any key
+// continuing from here.
+static int trie_distance_row(const char *query, int query_length, const int *previous, int *row, char c) {
+    row[0] = previous[0] + 1;
+    int smallest = row[0];
+    for (int j = 1; j <= query_length; j++) {
+        int cost = previous[j - 1] + (query[j - 1] != c);
+        if (previous[j] + 1 < cost) {
+            cost = previous[j] + 1;
+        }
+        if (row[j - 1] + 1 < cost) {
+            cost = row[j - 1] + 1;
+        }
+        row[j] = cost;
+        if (cost < smallest) {
+            smallest = cost;
+        }
+    }
+    return smallest;
+}
+
+
+static void trie_fuzzy_walk(TrieSearch *search, TrieNode *node, const int *previous) {
+    int rows[2][TRIE_QUERY_MAX + 1];
+    const int *row = previous;
+    for (int i = 0; i < node->length; i++) {
+        int *next = rows[i & 1];
+        if (trie_distance_row(search->query, search->query_length, row, next, node->label[i]) > search->bound) {
+            return;
+        }
+        row = next;
+    }
+    if (row[search->query_length] <= search->bound) {
+        trie_offer_entries(search, node->entries.root, row[search->query_length]);
+    }
+    for (TrieNode *child = node->child; child != NULL; child = child->sibling) {
+        trie_fuzzy_walk(search, child, row);
+    }
+}
+
+
+// Fills matches with up to limit records whose name or symbol (as the trie
+// is keyed) is within max_distance edits (insertions, deletions or
+// substitutions, ignoring case) of query, closest first, and returns how
+// many. Branches of the trie that are already too far away are skipped.
+// Without the trie this is a full scan.
+int fuzzy_search(Trie *trie, const char *query, int max_distance, TrieMatch *matches, int limit) {
+    materialize_tree();
+    char folded[TRIE_QUERY_MAX];
+    int length = trie_fold(query, folded, sizeof(folded));
+    TrieSearch search = {trie, matches, 0, limit, max_distance, folded, length};
+    if (length < 0 || limit <= 0 || max_distance < 0) {
+        return 0;
+    }
+    int first_row[TRIE_QUERY_MAX + 1];
+    for (int j = 0; j <= length; j++) {
+        first_row[j] = j;
+    }
+    if (!trie->enabled) {
+        int rows[2][TRIE_QUERY_MAX + 1];
+        Cursor cursor;
+        Element *element;
+        cursor_seek(&cursor, INT_MIN, INT_MAX);
+        while ((element = cursor_next(&cursor)) != NULL) {
+            const char *key = trie->key(element);
+            const int *row = first_row;
+            int i = 0;
+            for (; key[i] != '\0'; i++) {
+                int *next = rows[i & 1];
+                if (trie_distance_row(folded, length, row, next, (char)tolower((unsigned char)key[i])) >
+                    search.bound) {
+                    break;
+                }
+                row = next;
+            }
+            if (key[i] == '\0') {
+                trie_offer(&search, element, row[length]);
+            }
+        }
+        return search.count;
+    }
+    index_lock();
+    if (trie->root != NULL) {
+        trie_fuzzy_walk(&search, trie->root, first_row);
+    }
+    index_unlock();
+    return search.count;
+}
+
+
+// The whole tree goes through parallel_scan() when it is large enough.
+void print_tree(Node *node) {
+    if (node != NULL && node == root && !tree_concurrent && parallel_scan_worthwhile(root->stats.count)) {
+        parallel_scan(INT_MIN, INT_MAX, scan_emit_display, stdout);
+        return;
+    }
+    if (node != NULL && node->is_leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", node->elements[i]->name,
+                   node->elements[i]->symbol, node->elements[i]->atomic_number, node->elements[i]->atomic_mass);
+        }
+    } else if (node != NULL) {
+        for (int i = 0; i <= node->num_keys; i++) {
+            print_tree(node->children[i]);
+        }
+    }
+}
+
+
+BlockList *block_list(char block) {
+    for (int i = 0; i < 4; i++) {
+        if (block_names[i] == block) {
+            return &block_lists[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Position of the first element in list with atomic number >= atomic_number.
+static int block_list_position(const BlockList *list, int atomic_number) {
+    int low = 0;
+    int high = list->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (list->elements[mid]->atomic_number < atomic_number) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+
+void block_list_insert(Element *element) {
+    BlockList *list = block_list(element->block);
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 32;
+        list->elements = (Element **)realloc(list->elements, list->capacity * sizeof(Element *));
+    }
+    int pos = block_list_position(list, element->atomic_number);
+    memmove(&list->elements[pos + 1], &list->elements[pos], (list->count - pos) * sizeof(Element *));
+    list->elements[pos] = element;
+    list->count++;
+}
+
+
+void block_list_remove(Element *element) {
+    BlockList *list = block_list(element->block);
+    int pos = block_list_position(list, element->atomic_number);
+    if (pos < list->count && list->elements[pos] == element) {
+        memmove(&list->elements[pos], &list->elements[pos + 1], (list->count - pos - 1) * sizeof(Element *));
+        list->count--;
+    }
+}
+
+
+// Lists the elements of one block ('s', 'p', 'd' or 'f') in atomic number order.
+void display_block_elements(char block) {
+    materialize_tree();
+    BlockList *list = block_list(block);
+    if (list == NULL) {
+        return;
+    }
+    if (parallel_scan_worthwhile(list->count)) {
+        parallel_scan_list(list->elements, list->count, scan_emit_display, stdout);
+        return;
+    }
+    index_lock();
+    for (int i = 0; i < list->count; i++) {
+        Element *element = list->elements[i];
+        printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n",
+               element->name, element->symbol, element->atomic_number, element->atomic_mass);
+    }
+    index_unlock();
+}
+
+
+static uint32_t crc32_table[256];
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    if (crc32_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc32_table[i] = c;
+        }
+    }
+    const unsigned char *bytes = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+static size_t snapshot_refs_offset(uint32_t node_order) {
+    return (sizeof(SnapshotNode) + node_order * sizeof(int32_t) + 7) / 8 * 8;
+}
+
+
+static size_t snapshot_node_size(uint32_t node_order) {
+    return snapshot_refs_offset(node_order) + (node_order + 1) * sizeof(uint64_t);
+}
+
+
+typedef struct SnapshotWriter {
+    char *buffer;
+    size_t node_size;
+    size_t refs_offset;
+    uint64_t nodes_offset;
+    uint64_t records_offset;
+    uint64_t next_node;
+    uint64_t next_record;
+    SnapshotNode *prev_leaf;
+} SnapshotWriter;
+
+
+static void snapshot_count(const Node *node, uint64_t *nodes, uint64_t *records) {
+    (*nodes)++;
+    if (node->is_leaf) {
+        *records += node->num_keys;
+        return;
+    }
+    for (int i = 0; i <= node->num_keys; i++) {
+        snapshot_count(node->children[i], nodes, records);
+    }
+}
+
+
+// Lays node and its subtree out in pre-order; returns the node's file offset.
+static uint64_t snapshot_write_node(SnapshotWriter *writer, const Node *node) {
+    uint64_t offset = writer->nodes_offset + writer->next_node++ * writer->node_size;
+    SnapshotNode *out = (SnapshotNode *)(writer->buffer + offset);
+    uint64_t *refs = (uint64_t *)((char *)out + writer->refs_offset);
+    out->num_keys = node->num_keys;
+    out->is_leaf = node->is_leaf;
+    out->next = 0;
+    memcpy(out->keys, node->keys, node->num_keys * sizeof(int32_t));
+
+    if (node->is_leaf) {
+        SnapshotRecord *records = (SnapshotRecord *)(writer->buffer + writer->records_offset);
+        for (int i = 0; i < node->num_keys; i++) {
+            const Element *element = node->elements[i];
+            SnapshotRecord *record = &records[writer->next_record];
+            record->atomic_number = element->atomic_number;
+            memcpy(record->symbol, element->symbol, sizeof(element->symbol));
+            strncpy(record->name, element->name, sizeof(record->name) - 1);
+            record->atomic_mass = element->atomic_mass;
+            refs[i] = writer->next_record++;
+        }
+        if (writer->prev_leaf != NULL) {
+            writer->prev_leaf->next = offset;
+        }
+        writer->prev_leaf = out;
+    } else {
+        for (int i = 0; i <= node->num_keys; i++) {
+            refs[i] = snapshot_write_node(writer, node->children[i]);
+        }
+    }
+    return offset;
+}
+
+
+// Writes the in-memory tree to path (via a temporary file and rename).
+// Returns 0 on failure.
+int snapshot_save(const char *path) {
+    materialize_tree();
+    uint64_t node_count = 0;
+    uint64_t record_count = 0;
+    if (root != NULL) {
+        snapshot_count(root, &node_count, &record_count);
+    }
+
+    SnapshotWriter writer;
+    writer.node_size = snapshot_node_size(MAX_ELEMENTS);
+    writer.refs_offset = snapshot_refs_offset(MAX_ELEMENTS);
+    writer.records_offset = sizeof(SnapshotHeader);
+    writer.nodes_offset = (writer.records_offset + record_count * sizeof(SnapshotRecord) + 63) / 64 * 64;
+    writer.next_node = 0;
+    writer.next_record = 0;
+    writer.prev_leaf = NULL;
+    size_t file_size = writer.nodes_offset + node_count * writer.node_size;
+    writer.buffer = (char *)calloc(1, file_size);
+    if (writer.buffer == NULL) {
+        return 0;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *)writer.buffer;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->node_order = MAX_ELEMENTS;
+    header->file_size = file_size;
+    header->record_count = record_count;
+    header->node_count = node_count;
+    header->records_offset = writer.records_offset;
+    header->nodes_offset = writer.nodes_offset;
+    header->root_offset = root != NULL ? snapshot_write_node(&writer, root) : 0;
+    header->payload_checksum = crc32_update(0, writer.buffer + sizeof(SnapshotHeader), file_size - sizeof(SnapshotHeader));
+    header->header_checksum = 0;
+    header->header_checksum = crc32_update(0, header, sizeof(SnapshotHeader));
+
+    size_t path_length = strlen(path);
+    char *tmp_path = (char *)malloc(path_length + 5);
+    memcpy(tmp_path, path, path_length);
+    memcpy(tmp_path + path_length, ".tmp", 5);
+
+    int ok = 0;
+    FILE *file = fopen(tmp_path, "wb");
+    if (file != NULL) {
+        ok = fwrite(writer.buffer, 1, file_size, file) == file_size;
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if (!ok) {
+            remove(tmp_path);
+        }
+    }
+    free(tmp_path);
+    free(writer.buffer);
+    return ok;
+}
+
+
+// Maps a snapshot file read-only. The header is always validated; the
+// payload checksum costs a full read of the file and is only checked when
+// verify_payload is set. Without it the payload is untrusted, so every
+// node offset and record index read from it is checked before it is
+// followed (see snapshot_node()). Returns NULL if the file is missing or
+// invalid.
+SnapshotFile *snapshot_open(const char *path, int verify_payload) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    SnapshotHeader header = *(const SnapshotHeader *)base;
+    uint32_t stored_checksum = header.header_checksum;
+    header.header_checksum = 0;
+    int valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+                header.version == SNAPSHOT_VERSION &&
+                crc32_update(0, &header, sizeof(header)) == stored_checksum &&
+                header.file_size == (uint64_t)st.st_size &&
+                header.node_order >= 3 &&
+                header.node_count <= header.file_size / snapshot_node_size(header.node_order) &&
+                header.record_count <= header.file_size / sizeof(SnapshotRecord) &&
+                header.nodes_offset <= header.file_size && header.records_offset <= header.nodes_offset &&
+                header.nodes_offset + header.node_count * snapshot_node_size(header.node_order) <= header.file_size &&
+                header.records_offset + header.record_count * sizeof(SnapshotRecord) <= header.nodes_offset &&
+                (header.root_offset == 0 || header.root_offset >= header.nodes_offset) &&
+                header.root_offset < header.file_size;
+    if (valid && verify_payload) {
+        valid = crc32_update(0, (const char *)base + sizeof(SnapshotHeader), st.st_size - sizeof(SnapshotHeader)) == header.payload_checksum;
+    }
+    if (!valid) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    SnapshotFile *snapshot = (SnapshotFile *)malloc(sizeof(SnapshotFile));
+    snapshot->base = (const char *)base;
+    snapshot->size = st.st_size;
+    snapshot->header = (const SnapshotHeader *)base;
+    snapshot->refs_offset = snapshot_refs_offset(header.node_order);
+    snapshot->node_size = snapshot_node_size(header.node_order);
+    return snapshot;
+}
+
+
+void snapshot_close(SnapshotFile *snapshot) {
+    munmap((void *)snapshot->base, snapshot->size);
+    free(snapshot);
+}
+
+
+// The node at offset, read from the node at from (0 for the root). Nodes are
+// laid out in pre-order, so children and next leaves always lie further
+// into the file; an offset that doesn't, or doesn't name a node slot, or a
+// node with more than node_order keys, means the file is corrupt and
+// gives NULL. Following only increasing offsets, a walk always ends.
+static const SnapshotNode *snapshot_node(const SnapshotFile *snapshot, uint64_t offset, uint64_t from) {
+    const SnapshotHeader *header = snapshot->header;
+    if (offset <= from || offset < header->nodes_offset || (offset - header->nodes_offset) % snapshot->node_size != 0 ||
+        (offset - header->nodes_offset) / snapshot->node_size >= header->node_count) {
+        return NULL;
+    }
+    const SnapshotNode *node = (const SnapshotNode *)(snapshot->base + offset);
+    if (node->num_keys > header->node_order || node->is_leaf > 1) {
+        return NULL;
+    }
+    return node;
+}
+
+
+static uint64_t snapshot_offset(const SnapshotFile *snapshot, const SnapshotNode *node) {
+    return (uint64_t)((const char *)node - snapshot->base);
+}
+
+
+static const uint64_t *snapshot_refs(const SnapshotFile *snapshot, const SnapshotNode *node) {
+    return (const uint64_t *)((const char *)node + snapshot->refs_offset);
+}
+
+
+// NULL for an index past the records.
+static const SnapshotRecord *snapshot_record(const SnapshotFile *snapshot, uint64_t index) {
+    if (index >= snapshot->header->record_count) {
+        return NULL;
+    }
+    return (const SnapshotRecord *)(snapshot->base + snapshot->header->records_offset) + index;
+}
+
+
+// Descends the mapped tree to the leaf that would hold atomic_number.
+static const SnapshotNode *snapshot_find_leaf(const SnapshotFile *snapshot, int atomic_number) {
+    if (snapshot->header->root_offset == 0) {
+        return NULL;
+    }
+    const SnapshotNode *node = snapshot_node(snapshot, snapshot->header->root_offset, 0);
+    while (node != NULL && !node->is_leaf) {
+        int i = keys_upper_bound(node->keys, node->num_keys, atomic_number);
+        node = snapshot_node(snapshot, snapshot_refs(snapshot, node)[i], snapshot_offset(snapshot, node));
+    }
+    return node;
+}
+
+
+// Point lookup straight against the mapped pages.
+const SnapshotRecord *snapshot_search(const SnapshotFile *snapshot, int atomic_number) {
+    const SnapshotNode *leaf = snapshot_find_leaf(snapshot, atomic_number);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    int i = keys_lower_bound(leaf->keys, leaf->num_keys, atomic_number);
+    if (i < (int)leaf->num_keys && leaf->keys[i] == atomic_number) {
+        return snapshot_record(snapshot, snapshot_refs(snapshot, leaf)[i]);
+    }
+    return NULL;
+}
+
+
+void snapshot_cursor_seek(SnapshotCursor *cursor, const SnapshotFile *snapshot, int lower, int upper) {
+    cursor->snapshot = snapshot;
+    cursor->upper = upper;
+    cursor->leaf = snapshot_find_leaf(snapshot, lower);
+    cursor->pos = cursor->leaf != NULL ? keys_lower_bound(cursor->leaf->keys, cursor->leaf->num_keys, lower) : 0;
+}
+
+
+const SnapshotRecord *snapshot_cursor_next(SnapshotCursor *cursor) {
+    while (cursor->leaf != NULL && cursor->pos == cursor->leaf->num_keys) {
+        uint64_t next = cursor->leaf->next;
+        uint64_t from = snapshot_offset(cursor->snapshot, cursor->leaf);
+        cursor->leaf = next ? snapshot_node(cursor->snapshot, next, from) : NULL;
+        cursor->pos = 0;
+    }
+    if (cursor->leaf == NULL || cursor->leaf->keys[cursor->pos] > cursor->upper) {
+        cursor->leaf = NULL;
+        return NULL;
+    }
+    const uint64_t *refs = snapshot_refs(cursor->snapshot, cursor->leaf);
+    const SnapshotRecord *record = snapshot_record(cursor->snapshot, refs[cursor->pos++]);
+    if (record == NULL) {
+        cursor->leaf = NULL;
+    }
+    return record;
+}
+
+
+// Rebuilds the in-memory tree from the mapped snapshot's records (already
+// sorted, so no parsing and no splits) and drops the mapping. Needed before
+// anything but a point or range lookup. The tree is empty while a snapshot
+// is mapped, so it is not destroyed first: an element the caller already
+// created for the write that triggered this stays valid.
+void snapshot_materialize(void) {
+    if (mapped_snapshot == NULL) {
+        return;
+    }
+    uint64_t count = mapped_snapshot->header->record_count;
+    Element **elements = (Element **)malloc((count ? count : 1) * sizeof(Element *));
+    const SnapshotHeader *header = mapped_snapshot->header;
+    const SnapshotRecord *records = (const SnapshotRecord *)(mapped_snapshot->base + header->records_offset);
+    for (uint64_t i = 0; i < count; i++) {
+        char symbol[3];
+        char name[30];
+        memcpy(symbol, records[i].symbol, sizeof(symbol) - 1);
+        symbol[sizeof(symbol) - 1] = '\0';
+        memcpy(name, records[i].name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+        elements[i] = create_element(records[i].atomic_number, symbol, name, records[i].atomic_mass);
+    }
+    // Records out of order can only come from a corrupt file; bulk_load() must not see them.
+    int unique = sort_unique(elements, (int)count, UPSERT_KEEP);
+    bulk_load(elements, unique);
+    free(elements);
+    snapshot_close(mapped_snapshot);
+    mapped_snapshot = NULL;
+}
+
+
+// Growing byte array for pack_tree().
+typedef struct PackedBuffer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} PackedBuffer;
+
+
+static void packed_reserve(PackedBuffer *buffer, size_t more) {
+    if (buffer->size + more <= buffer->capacity) {
+        return;
+    }
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->size + more) {
+        capacity *= 2;
+    }
+    buffer->data = (unsigned char *)realloc(buffer->data, capacity);
+    if (buffer->data == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+}
+
+
+// LEB128: seven bits per byte, low bits first, the high bit set on all but the last byte.
+static void packed_put(PackedBuffer *buffer, uint32_t value) {
+    packed_reserve(buffer, 5);
+    while (value >= 0x80) {
+        buffer->data[buffer->size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer->data[buffer->size++] = (unsigned char)value;
+}
+
+
+static inline uint32_t packed_get(const unsigned char **codes) {
+    const unsigned char *code = *codes;
+    uint32_t value = *code & 0x7F;
+    for (int shift = 7; *code++ & 0x80; shift += 7) {
+        value |= (uint32_t)(*code & 0x7F) << shift;
+    }
+    *codes = code;
+    return value;
+}
+
+
+// String table under construction: the strings and their offsets in the
+// PackedTree, plus an open-addressing hash of ids (-1 for a free slot).
+typedef struct PackedStrings {
+    PackedBuffer text;
+    uint32_t *offsets;
+    int count;
+    int *slots;
+    int capacity;
+} PackedStrings;
+
+
+static uint32_t packed_string_id(PackedStrings *strings, const char *text) {
+    if (strings->count >= strings->capacity / 2) {
+        int capacity = strings->capacity > 0 ? strings->capacity * 2 : 1024;
+        free(strings->slots);
+        strings->slots = (int *)malloc(capacity * sizeof(int));
+        memset(strings->slots, 0xFF, capacity * sizeof(int));
+        strings->offsets = (uint32_t *)realloc(strings->offsets, (capacity / 2) * sizeof(uint32_t));
+        strings->capacity = capacity;
+        for (int id = 0; id < strings->count; id++) {
+            unsigned int slot = hash_symbol((const char *)strings->text.data + strings->offsets[id]);
+            while (strings->slots[slot & (capacity - 1)] >= 0) {
+                slot++;
+            }
+            strings->slots[slot & (capacity - 1)] = id;
+        }
+    }
+    unsigned int slot = hash_symbol(text);
+    for (;; slot++) {
+        int id = strings->slots[slot & (strings->capacity - 1)];
+        if (id < 0) {
+            break;
+        }
+        if (strcmp((const char *)strings->text.data + strings->offsets[id], text) == 0) {
+            return (uint32_t)id;
+        }
+    }
+    size_t length = strlen(text) + 1;
+    packed_reserve(&strings->text, length);
+    memcpy(strings->text.data + strings->text.size, text, length);
+    strings->offsets[strings->count] = (uint32_t)strings->text.size;
+    strings->text.size += length;
+    strings->slots[slot & (strings->capacity - 1)] = strings->count;
+    return (uint32_t)strings->count++;
+}
+
+
+void packed_free(PackedTree *packed) {
+    free(packed->first_keys);
+    free(packed->run_offsets);
+    free(packed->codes);
+    free(packed->masses);
+    free(packed->string_offsets);
+    free(packed->strings);
+    free(packed);
+}
+
+
+// Packs the records into a PackedTree and frees the tree, its elements and
+// the secondary indexes: about 10 to 15 bytes a record instead of some 60,
+// for data that is only read. Lookups (search(), and range scans through
+// cached_range_scan() or range_search()) decode what they return from the
+// packed records; every other entry point unpacks them first (see
+// materialize_tree()). The tree must not be in concurrent mode and must
+// have no open views. Returns 0 if it could not be packed.
+int pack_tree(void) {
+    if (packed_tree != NULL) {
+        return 1;
+    }
+    if (refuse_concurrent("pack_tree()")) {
+        return 0;
+    }
+    if (open_views != NULL) {
+        fprintf(stderr, "pack_tree() needs every view closed.\n");
+        return 0;
+    }
+    snapshot_materialize();
+
+    long count = root != NULL ? root->stats.count : 0;
+    PackedTree *packed = (PackedTree *)calloc(1, sizeof(PackedTree));
+    packed->count = count;
+    packed->num_runs = (count + PACKED_RUN_RECORDS - 1) / PACKED_RUN_RECORDS;
+    packed->first_keys = (int *)malloc((packed->num_runs + 1) * sizeof(int));
+    packed->run_offsets = (size_t *)malloc((packed->num_runs + 1) * sizeof(size_t));
+    packed->masses = (double *)malloc((count + 1) * sizeof(double));
+    PackedBuffer codes = {NULL, 0, 0};
+    PackedStrings strings = {{NULL, 0, 0}, NULL, 0, NULL, 0};
+
+    Cursor cursor;
+    Element *element;
+    long i = 0;
+    int previous = 0;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        if (i % PACKED_RUN_RECORDS == 0) {
+            packed->first_keys[i / PACKED_RUN_RECORDS] = element->atomic_number;
+            packed->run_offsets[i / PACKED_RUN_RECORDS] = codes.size;
+            previous = element->atomic_number;
+        }
+        packed_put(&codes, (uint32_t)element->atomic_number - (uint32_t)previous);
+        packed_put(&codes, packed_string_id(&strings, element->name));
+        packed_put(&codes, packed_string_id(&strings, element->symbol));
+        packed->masses[i++] = element->atomic_mass;
+        previous = element->atomic_number;
+    }
+    packed->run_offsets[packed->num_runs] = codes.size;
+    packed->codes = (unsigned char *)realloc(codes.data, codes.size + 1);
+    packed->strings = (char *)realloc(strings.text.data, strings.text.size + 1);
+    packed->string_offsets = strings.offsets;
+    packed->num_strings = strings.count;
+    free(strings.slots);
+    packed->bytes = sizeof(PackedTree) + (packed->num_runs + 1) * (sizeof(int) + sizeof(size_t)) +
+                    codes.size + count * sizeof(double) + strings.text.size +
+                    (strings.capacity / 2) * sizeof(uint32_t);
+
+    destroy_tree();
+    packed_tree = packed;
+    return 1;
+}
+
+
+// Decodes the record at codes, the one after the record with key previous
+// (or the first of its run), into element. Returns the next record's codes.
+static inline const unsigned char *packed_decode(const PackedTree *packed, const unsigned char *codes,
+                                                 int previous, long position, Element *element) {
+    element->atomic_number = (int)((uint32_t)previous + packed_get(&codes));
+    element->name = packed->strings + packed->string_offsets[packed_get(&codes)];
+    strcpy(element->symbol, packed->strings + packed->string_offsets[packed_get(&codes)]);
+    element->block = element_block(element->atomic_number);
+    element->atomic_mass = packed->masses[position];
+    element->symbol_next = NULL;
+    element->symbol_prev = NULL;
+    return codes;
+}
+
+
+// Index of the run that would hold atomic_number: the last one starting at or below it.
+static long packed_run(const PackedTree *packed, int atomic_number) {
+    long low = 0;
+    long high = packed->num_runs;
+    while (low < high) {
+        long mid = low + (high - low) / 2;
+        if (packed->first_keys[mid] <= atomic_number) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+
+// search() on a packed tree. The element is decoded into storage of the
+// calling thread, valid until its next packed search.
+Element *packed_search(int atomic_number) {
+    static __thread Element found;
+    const PackedTree *packed = packed_tree;
+    if (packed->count == 0) {
+        return NULL;
+    }
+    long run = packed_run(packed, atomic_number);
+    const unsigned char *codes = packed->codes + packed->run_offsets[run];
+    const unsigned char *end = packed->codes + packed->run_offsets[run + 1];
+    int previous = packed->first_keys[run];
+    for (long position = run * PACKED_RUN_RECORDS; codes < end; position++) {
+        codes = packed_decode(packed, codes, previous, position, &found);
+        if (found.atomic_number >= atomic_number) {
+            return found.atomic_number == atomic_number ? &found : NULL;
+        }
+        previous = found.atomic_number;
+    }
+    return NULL;
+}
+
+
+// Visits the packed records with keys in [lower, upper] in key order until
+// visit returns 0, and returns how many were visited. Each element is
+// decoded for the call to visit and is not valid after it.
+long packed_scan(int lower, int upper, int (*visit)(Element *element, void *arg), void *arg) {
+    const PackedTree *packed = packed_tree;
+    long count = 0;
+    if (packed->count == 0 || lower > upper) {
+        return 0;
+    }
+    Element element;
+    long run = packed_run(packed, lower);
+    const unsigned char *codes = packed->codes + packed->run_offsets[run];
+    const unsigned char *end = packed->codes + packed->run_offsets[packed->num_runs];
+    int previous = packed->first_keys[run];
+    for (long position = run * PACKED_RUN_RECORDS; codes < end; position++) {
+        if (position % PACKED_RUN_RECORDS == 0) {
+            previous = packed->first_keys[position / PACKED_RUN_RECORDS];
+        }
+        codes = packed_decode(packed, codes, previous, position, &element);
+        previous = element.atomic_number;
+        if (element.atomic_number < lower) {
+            continue;
+        }
+        if (element.atomic_number > upper) {
+            break;
+        }
+        count++;
+        if (!visit(&element, arg)) {
+            break;
+        }
+    }
+    return count;
+}
+
+
+// Rebuilds the in-memory tree (and its indexes) from the packed records,
+// which are already sorted, and frees them. pack_tree() left the tree empty,
+// and elements created since (for the write that unpacks) are kept.
+void unpack_tree(void) {
+    PackedTree *packed = packed_tree;
+    if (packed == NULL) {
+        return;
+    }
+    packed_tree = NULL;
+    Element **elements = (Element **)malloc((packed->count + 1) * sizeof(Element *));
+    Element element;
+    const unsigned char *codes = packed->codes;
+    int previous = 0;
+    for (long i = 0; i < packed->count; i++) {
+        if (i % PACKED_RUN_RECORDS == 0) {
+            previous = packed->first_keys[i / PACKED_RUN_RECORDS];
+        }
+        codes = packed_decode(packed, codes, previous, i, &element);
+        previous = element.atomic_number;
+        elements[i] = create_element(element.atomic_number, element.symbol, element.name, element.atomic_mass);
+    }
+    bulk_load(elements, (int)packed->count);
+    free(elements);
+    packed_free(packed);
+}
+
+
+// Write-ahead log. Every successful insert(), delete() and delete_range()
+// appends one fixed-size record; records are collected in memory and written with a
+// single write() + fdatasync() once sync_every of them are pending (group
+// commit), or on wal_sync(). So that a trickle of writes is not left
+// pending for as long as it takes to fill a group, a background thread also
+// commits the group once its oldest record has waited sync_delay_ms. A
+// crash loses at most the unsynced group, none of it older than that.
+//
+// The log sits on top of a checkpoint: wal_open() replays it onto the tree
+// loaded from the checkpoint snapshot, and wal_checkpoint() saves a new
+// snapshot and truncates the log. Replay is idempotent on a tree that
+// already contains some of the logged changes (only successful mutations
+// are logged, so the last record per key decides), which covers a crash
+// between the snapshot rename and the truncation.
+#define WAL_MAGIC "RUN2WAL"
+#define WAL_VERSION 1
+#define WAL_INSERT 1
+#define WAL_DELETE 2
+#define WAL_DELETE_RANGE 3
+
+typedef struct WalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_checksum;    // CRC-32 of the header with this field zeroed
+    uint64_t first_lsn;          // LSN of the first record in the file
+} WalHeader;
+
+typedef struct WalRecord {
+    uint32_t checksum;           // CRC-32 of the record with this field zeroed
+    uint32_t type;
+    uint64_t lsn;                // consecutive across the file
+    int32_t atomic_number;       // the lower bound of a WAL_DELETE_RANGE
+    char symbol[4];
+    union {
+        char name[32];
+        int32_t upper;           // the upper bound of a WAL_DELETE_RANGE
+    };
+    double atomic_mass;
+} WalRecord;
+
+typedef struct WriteAheadLog {
+    int fd;
+    char *path;
+    char *snapshot_path;         // where checkpoints go
+    int sync_every;              // records per group commit
+    uint64_t sync_delay_ns;      // longest a record waits for its group commit, 0 for no limit
+    uint64_t oldest_pending_ns;  // when the first pending record was logged
+    uint64_t checkpoint_every;   // records between automatic checkpoints, 0 for never
+    uint64_t next_lsn;
+    uint64_t logged;             // records since the last checkpoint
+    WalRecord *pending;
+    int num_pending;
+    int replaying;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t pending_changed;
+    pthread_t flusher;
+} WriteAheadLog;
+
+WriteAheadLog *wal = NULL;
+
+
+static int wal_write_all(int fd, const void *data, size_t length) {
+    const char *bytes = (const char *)data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            return 0;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 1;
+}
+
+
+// Makes a rename inside path's directory durable.
+static int sync_parent_directory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *directory = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    int fd = open(directory, O_RDONLY);
+    free(directory);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+
+// Empties the log file down to a fresh header that starts at next_lsn.
+static int wal_reset_file(WriteAheadLog *log) {
+    WalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_MAGIC, sizeof(WAL_MAGIC));
+    header.version = WAL_VERSION;
+    header.first_lsn = log->next_lsn;
+    header.header_checksum = crc32_update(0, &header, sizeof(header));
+    return ftruncate(log->fd, 0) == 0 && lseek(log->fd, 0, SEEK_SET) == 0 &&
+           wal_write_all(log->fd, &header, sizeof(header)) && fdatasync(log->fd) == 0;
+}
+
+
+static uint64_t wal_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Writes and syncs the pending group. The caller holds log->lock.
+static int wal_flush_locked(WriteAheadLog *log) {
+    if (log->num_pending == 0) {
+        return 1;
+    }
+    int ok = wal_write_all(log->fd, log->pending, log->num_pending * sizeof(WalRecord)) && fdatasync(log->fd) == 0;
+    if (!ok) {
+        fprintf(stderr, "Failed to write the write-ahead log %s.\n", log->path);
+    }
+    log->num_pending = 0;
+    return ok;
+}
+
+
+int wal_sync(void) {
+    if (wal == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&wal->lock);
+    int ok = wal_flush_locked(wal);
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+
+static void wal_append(int type, int atomic_number, int upper, const Element *element) {
+    if (wal == NULL || wal->replaying) {
+        return;
+    }
+    pthread_mutex_lock(&wal->lock);
+    WalRecord *record = &wal->pending[wal->num_pending++];
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->lsn = wal->next_lsn++;
+    record->atomic_number = atomic_number;
+    if (element != NULL) {
+        memcpy(record->symbol, element->symbol, sizeof(element->symbol));
+        strncpy(record->name, element->name, sizeof(record->name) - 1);
+        record->atomic_mass = element->atomic_mass;
+    } else if (type == WAL_DELETE_RANGE) {
+        record->upper = upper;
+    }
+    record->checksum = crc32_update(0, record, sizeof(*record));
+    wal->logged++;
+    if (wal->num_pending == wal->sync_every) {
+        wal_flush_locked(wal);
+    } else if (wal->num_pending == 1 && wal->sync_delay_ns != 0) {
+        wal->oldest_pending_ns = wal_clock_ns();
+        pthread_cond_signal(&wal->pending_changed);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+
+void wal_log_insert(const Element *element) {
+    wal_append(WAL_INSERT, element->atomic_number, 0, element);
+}
+
+
+void wal_log_delete(int atomic_number) {
+    wal_append(WAL_DELETE, atomic_number, 0, NULL);
+}
+
+
+void wal_log_delete_range(int lower, int upper) {
+    wal_append(WAL_DELETE_RANGE, lower, upper, NULL);
+}
+
+
+// Saves the tree to the checkpoint snapshot and truncates the log. Needs the
+// tree to itself (not in concurrent mode). Returns 0 if the snapshot could not
+// be written, in which case the log is kept as it was.
+int wal_checkpoint(void) {
+    if (wal == NULL) {
+        return 0;
+    }
+    materialize_tree();
+    pthread_mutex_lock(&wal->lock);
+    int ok = wal_flush_locked(wal) && snapshot_save(wal->snapshot_path) &&
+             sync_parent_directory(wal->snapshot_path) && wal_reset_file(wal);
+    if (ok) {
+        wal->logged = 0;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+
+// Checkpoints once checkpoint_every records have been logged since the last one.
+void wal_maybe_checkpoint(void) {
+    if (wal != NULL && wal->checkpoint_every != 0 && wal->logged >= wal->checkpoint_every &&
+        !wal->replaying && !tree_concurrent) {
+        wal_checkpoint();
+    }
+}
+
+
+// Applies every intact record in the log to the tree. A torn or corrupt tail
+// (from a crash mid-write) is cut off. Returns the number of records applied.
+static long wal_replay(WriteAheadLog *log) {
+    WalHeader header;
+    if (read(log->fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        return 0;
+    }
+    log->next_lsn = header.first_lsn;
+    off_t valid_end = sizeof(header);
+    long applied = 0;
+    WalRecord record;
+    log->replaying = 1;
+    while (read(log->fd, &record, sizeof(record)) == (ssize_t)sizeof(record)) {
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        if (crc32_update(0, &record, sizeof(record)) != checksum || record.lsn != log->next_lsn ||
+            (record.type != WAL_INSERT && record.type != WAL_DELETE && record.type != WAL_DELETE_RANGE)) {
+            break;
+        }
+        if (applied == 0) {
+            snapshot_materialize();
+        }
+        if (record.type == WAL_INSERT) {
+            char symbol[3];
+            char name[30];
+            memcpy(symbol, record.symbol, sizeof(symbol) - 1);
+            symbol[sizeof(symbol) - 1] = '\0';
+            memcpy(name, record.name, sizeof(name) - 1);
+            name[sizeof(name) - 1] = '\0';
+            Element *element = create_element(record.atomic_number, symbol, name, record.atomic_mass);
+            if (!insert(element)) {
+                free_element(element);
+            }
+        } else if (record.type == WAL_DELETE) {
+            delete(record.atomic_number);
+        } else {
+            delete_range(record.atomic_number, record.upper);
+        }
+        log->next_lsn++;
+        log->logged++;
+        applied++;
+        valid_end += sizeof(record);
+    }
+    log->replaying = 0;
+    if (ftruncate(log->fd, valid_end) != 0 || lseek(log->fd, valid_end, SEEK_SET) != valid_end) {
+        return -1;
+    }
+    return applied;
+}
+
+
+// Background thread (while sync_delay_ns is set): sleeps until a group is
+// pending, then until its oldest record is due, and commits it unless a
+// full group or wal_sync() got there first.
+static void *wal_flusher(void *arg) {
+    WriteAheadLog *log = (WriteAheadLog *)arg;
+    pthread_mutex_lock(&log->lock);
+    while (!log->stopping) {
+        if (log->num_pending == 0) {
+            pthread_cond_wait(&log->pending_changed, &log->lock);
+            continue;
+        }
+        uint64_t due = log->oldest_pending_ns + log->sync_delay_ns;
+        if (wal_clock_ns() >= due) {
+            wal_flush_locked(log);
+            continue;
+        }
+        struct timespec deadline;
+        deadline.tv_sec = (time_t)(due / 1000000000ULL);
+        deadline.tv_nsec = (long)(due % 1000000000ULL);
+        pthread_cond_timedwait(&log->pending_changed, &log->lock, &deadline);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+
+// Opens (or creates) the log at path, replays it onto the tree already
+// loaded from snapshot_path's checkpoint, and starts logging mutations.
+// A pending group is committed after at most sync_delay_ms (0 waits for a
+// full group). Returns 0 if the file can't be used.
+int wal_open(const char *path, const char *snapshot_path, int sync_every, int sync_delay_ms,
+             uint64_t checkpoint_every) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+    WriteAheadLog *log = (WriteAheadLog *)calloc(1, sizeof(WriteAheadLog));
+    log->fd = fd;
+    log->path = strdup(path);
+    log->snapshot_path = strdup(snapshot_path);
+    log->sync_every = sync_every > 0 ? sync_every : 1;
+    log->sync_delay_ns = sync_delay_ms > 0 ? (uint64_t)sync_delay_ms * 1000000ULL : 0;
+    log->checkpoint_every = checkpoint_every;
+    log->pending = (WalRecord *)malloc(log->sync_every * sizeof(WalRecord));
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&log->pending_changed, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    WalHeader header;
+    ssize_t got = pread(fd, &header, sizeof(header), 0);
+    int valid = 0;
+    if (got == (ssize_t)sizeof(header) && memcmp(header.magic, WAL_MAGIC, sizeof(WAL_MAGIC)) == 0 &&
+        header.version == WAL_VERSION) {
+        uint32_t checksum = header.header_checksum;
+        header.header_checksum = 0;
+        valid = crc32_update(0, &header, sizeof(header)) == checksum;
+    }
+    long applied = 0;
+    if (valid) {
+        applied = wal_replay(log);
+    } else if (got != 0 || !wal_reset_file(log)) {
+        // Not empty and not a log: refuse rather than overwrite someone's file.
+        applied = -1;
+    }
+    if (applied < 0) {
+        close(fd);
+        pthread_cond_destroy(&log->pending_changed);
+        pthread_mutex_destroy(&log->lock);
+        free(log->pending);
+        free(log->snapshot_path);
+        free(log->path);
+        free(log);
+        return 0;
+    }
+    if (log->sync_delay_ns != 0 && pthread_create(&log->flusher, NULL, wal_flusher, log) != 0) {
+        // Without the thread, groups are still committed when full and on wal_sync().
+        log->sync_delay_ns = 0;
+    }
+    wal = log;
+    if (applied > 0) {
+        fprintf(stderr, "Replayed %ld logged changes from %s.\n", applied, path);
+    }
+    return 1;
+}
+
+
+// Syncs anything pending and stops logging.
+void wal_close(void) {
+    if (wal == NULL) {
+        return;
+    }
+    if (wal->sync_delay_ns != 0) {
+        pthread_mutex_lock(&wal->lock);
+        wal->stopping = 1;
+        pthread_cond_signal(&wal->pending_changed);
+        pthread_mutex_unlock(&wal->lock);
+        pthread_join(wal->flusher, NULL);
+    }
+    wal_sync();
+    close(wal->fd);
+    pthread_cond_destroy(&wal->pending_changed);
+    pthread_mutex_destroy(&wal->lock);
+    free(wal->pending);
+    free(wal->snapshot_path);
+    free(wal->path);
+    free(wal);
+    wal = NULL;
+}
+
+
+// Instrumentation. While stats are on, the tree counts descents and node
+// visits, splits, borrows, merges, root changes, optimistic restarts and
+// view copies, and times search(), insert(), delete() and delete_range()
+// into log2 latency histograms. Turned off, each counter costs one
+// predictable branch; built with -DTREE_STATS=0 it costs nothing.
+// stats_enable(1) also opens hardware counters with perf_event_open(2) for
+// this thread and the threads it starts afterwards; where the kernel or
+// the machine refuses one (perf_event_paranoid, containers, VMs) that
+// counter is reported as null.
+static const char *const perf_names[STATS_PERF_COUNTERS] = {
+    "cycles", "instructions", "cache_references", "cache_misses", "branch_misses",
+};
+
+#if STATS_HARDWARE
+static int perf_open(int counter) {
+    static const uint64_t configs[STATS_PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[counter];
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+
+void stats_enable(int hardware) {
+    stats_enabled = TREE_STATS;
+#if STATS_HARDWARE
+    for (int i = 0; hardware && i < STATS_PERF_COUNTERS; i++) {
+        if (perf_fds[i] < 0) {
+            perf_fds[i] = perf_open(i);
+        }
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)hardware;
+#endif
+}
+
+
+void stats_disable(void) {
+    stats_enabled = 0;
+#if STATS_HARDWARE
+    for (int i = 0; i < STATS_PERF_COUNTERS; i++) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+}
+
+
+void stats_reset(void) {
+    memset(&tree_stats, 0, sizeof(tree_stats));
+#if STATS_HARDWARE
+    for (int i = 0; i < STATS_PERF_COUNTERS; i++) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+        }
+    }
+#endif
+}
+
+
+static void tree_shape(const Node *node, int depth, TreeShape *shape) {
+    if (depth + 1 > shape->height) {
+        shape->height = depth + 1;
+    }
+    if (node->is_leaf) {
+        shape->leaves++;
+        shape->records += node->num_keys;
+        return;
+    }
+    shape->internal_nodes++;
+    shape->internal_keys += node->num_keys;
+    for (int i = 0; i <= node->num_keys; i++) {
+        tree_shape(node->children[i], depth + 1, shape);
+    }
+}
+
+
+// Upper bound of the histogram bucket holding the fraction p of operations.
+static uint64_t histogram_percentile(const LatencyHistogram *histogram, double p) {
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen > 0 && seen >= p * histogram->count) {
+            return (uint64_t)2 << b;
+        }
+    }
+    return 0;
+}
+
+
+static void json_pool(FILE *output, const char *name, const Pool *pool) {
+    fprintf(output, "\"%s\":{\"live\":%zu,\"live_bytes\":%zu,\"reserved_bytes\":%zu}", name,
+            pool->live_objects, pool->live_objects * pool->object_size, pool->chunk_count * (size_t)POOL_CHUNK_BYTES);
+}
+
+
+// Writes everything as one line of JSON: tree shape and fill (computed
+// now, so not in concurrent mode), pool memory, the counters, latency
+// histograms (bucket lower bounds in ns) and the hardware counters.
+void stats_dump_json(FILE *output) {
+    fprintf(output, "{\"compiled\":%s,\"enabled\":%s,\"node_order\":%d,", TREE_STATS ? "true" : "false",
+            stats_enabled ? "true" : "false", MAX_ELEMENTS);
+
+    if (tree_concurrent) {
+        fputs("\"tree\":null,", output);
+    } else {
+        TreeShape shape = {0};
+        if (root != NULL) {
+            tree_shape(root, 0, &shape);
+        }
+        fprintf(output, "\"tree\":{\"height\":%d,\"records\":%ld,\"leaves\":%ld,\"internal_nodes\":%ld,"
+                        "\"leaf_fill\":%.3f,\"internal_fill\":%.3f,\"deferred_deletes\":%ld},",
+                shape.height, shape.records, shape.leaves, shape.internal_nodes,
+                shape.leaves ? (double)shape.records / (shape.leaves * (double)MAX_ELEMENTS) : 0.0,
+                shape.internal_nodes ? (double)shape.internal_keys / (shape.internal_nodes * (double)MAX_ELEMENTS) : 0.0,
+                deferred_deletes);
+    }
+
+    fputs("\"memory\":{", output);
+    json_pool(output, "nodes", &node_pool);
+    fputc(',', output);
+    json_pool(output, "elements", &element_pool);
+    fputc(',', output);
+    json_pool(output, "index_nodes", &index_node_pool);
+    fputc(',', output);
+    json_pool(output, "trie_nodes", &trie_node_pool);
+    fprintf(output, ",\"names\":{\"live\":%d,\"live_bytes\":%zu}", name_strings.count, name_strings.bytes);
+    fprintf(output, ",\"packed\":{\"records\":%ld,\"bytes\":%zu}", packed_tree ? packed_tree->count : 0L,
+            packed_tree ? packed_tree->bytes : (size_t)0);
+    fprintf(output, ",\"retired\":%d},", retired_version_count + retired_count);
+
+    fprintf(output, "\"result_cache\":{\"enabled\":%s,\"entries\":%d,\"records\":%ld,\"hits\":%llu,\"misses\":%llu,"
+                    "\"hit_rate\":%.3f,\"invalidations\":%llu,\"evictions\":%llu},",
+            result_cache.enabled ? "true" : "false", result_cache.count, result_cache.records,
+            (unsigned long long)result_cache.hits, (unsigned long long)result_cache.misses,
+            result_cache.hits + result_cache.misses
+                ? (double)result_cache.hits / (double)(result_cache.hits + result_cache.misses) : 0.0,
+            (unsigned long long)result_cache.invalidations, (unsigned long long)result_cache.evictions);
+
+    const struct {
+        const char *name;
+        uint64_t value;
+    } counters[] = {
+        {"descents", tree_stats.descents},
+        {"node_visits", tree_stats.node_visits},
+        {"search_misses", tree_stats.search_misses},
+        {"insert_duplicates", tree_stats.insert_duplicates},
+        {"delete_misses", tree_stats.delete_misses},
+        {"range_scans", tree_stats.range_scans},
+        {"leaf_splits", tree_stats.leaf_splits},
+        {"internal_splits", tree_stats.internal_splits},
+        {"root_splits", tree_stats.root_splits},
+        {"borrows", tree_stats.borrows},
+        {"merges", tree_stats.merges},
+        {"root_collapses", tree_stats.root_collapses},
+        {"restarts", tree_stats.restarts},
+        {"cow_copies", tree_stats.cow_copies},
+    };
+    fputs("\"counters\":{", output);
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(output, "%s\"%s\":%llu", i ? "," : "", counters[i].name, (unsigned long long)counters[i].value);
+    }
+    fprintf(output, ",\"visits_per_descent\":%.2f},",
+            tree_stats.descents ? (double)tree_stats.node_visits / tree_stats.descents : 0.0);
+
+    static const char *const op_names[STAT_NUM_OPS] = {"search", "insert", "delete", "delete_range"};
+    fputs("\"latency\":{", output);
+    for (int op = 0; op < STAT_NUM_OPS; op++) {
+        const LatencyHistogram *histogram = &tree_stats.latency[op];
+        fprintf(output, "%s\"%s\":{\"count\":%llu,\"mean_ns\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,"
+                        "\"histogram\":{",
+                op ? "," : "", op_names[op], (unsigned long long)histogram->count,
+                histogram->count ? (double)histogram->total_ns / histogram->count : 0.0,
+                (unsigned long long)histogram_percentile(histogram, 0.50),
+                (unsigned long long)histogram_percentile(histogram, 0.99), (unsigned long long)histogram->max_ns);
+        int first = 1;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (histogram->buckets[b] != 0) {
+                fprintf(output, "%s\"%llu\":%llu", first ? "" : ",", 1ULL << b,
+                        (unsigned long long)histogram->buckets[b]);
+                first = 0;
+            }
+        }
+        fputs("}}", output);
+    }
+    fputs("},", output);
+
+    fputs("\"hardware\":{", output);
+    for (int i = 0; i < STATS_PERF_COUNTERS; i++) {
+        long long value = -1;
+#if STATS_HARDWARE
+        if (perf_fds[i] >= 0 && read(perf_fds[i], &value, sizeof(value)) != (ssize_t)sizeof(value)) {
+            value = -1;
+        }
+#endif
+        if (value < 0) {
+            fprintf(output, "%s\"%s\":null", i ? "," : "", perf_names[i]);
+        } else {
+            fprintf(output, "%s\"%s\":%lld", i ? "," : "", perf_names[i], value);
+        }
+    }
+    fputs("}}\n", output);
+}
+
+
+// Batch mode: runs a command stream without prompts. One command per line,
+// words separated by blanks, '#' starts a comment:
+//
+//   INSERT number symbol name mass    -> OK | EXISTS number
+//   MINSERT keep|replace number symbol name mass...
+//                                     -> INSERTED count; one batch (see insert_batch())
+//   DELETE number                     -> OK | NOT_FOUND number
+//   DELETE_RANGE lower upper          -> DELETED count
+//   DEFER on|off                      -> OK (deferred rebalancing for DELETE)
+//   COMPACT                           -> OK once underfull nodes are rebuilt
+//   PACK | UNPACK                     -> OK; packs the records for lookups only
+//                                        (see pack_tree()); any other command unpacks
+//   GET number                        -> record | NOT_FOUND number
+//   MGET number...                    -> one GET reply per number
+//   RANGE lower upper                 -> records, then END count
+//   BLOCK s|p|d|f                     -> records, then END count
+//   SYMBOL symbol                     -> records, then END count
+//   NAME name                         -> record | NOT_FOUND name
+//   MASS lower upper                  -> records by atomic mass, then END count
+//   PREFIX name|symbol prefix [limit] -> up to limit (10) records, then END count
+//   FUZZY name|symbol query distance [limit]
+//                                     -> up to limit (10) lines of edit distance
+//                                        and record, closest first, then END count
+//   AGGREGATE lower upper             -> count, sum, average, min and max of the atomic masses
+//   RANK number                       -> records with a smaller atomic number
+//   SELECT position                   -> record at that position (from 0) | NOT_FOUND position
+//   SNAPSHOT path                     -> OK | ERROR
+//   CHECKPOINT                        -> OK | ERROR (with a write-ahead log)
+//   SYNC                              -> OK once logged changes are on disk
+//   VIEW OPEN | VIEW CLOSE            -> OK; pins the tree as it is now (see view_open())
+//   VIEW GET number                   -> as GET, but as of the open view
+//   VIEW RANGE lower upper            -> as RANGE, but as of the open view
+//   VIEW BLOCK s|p|d|f                -> as BLOCK, but as of the open view
+//   STATS                             -> one line of JSON (see stats_dump_json())
+//   STATS on|hardware|off|reset       -> OK; hardware also starts the CPU counters
+//   CACHE on [entries [records]]|off|clear
+//                                     -> OK; result cache for RANGE (see cached_range_scan())
+//
+// Records are written in the elements.txt format. Output goes through one
+// large stdio buffer and is only flushed when it fills up or the stream
+// ends, so throughput is bound by the tree rather than the terminal.
+#define BATCH_LINE_MAX 4096
+#define BATCH_MAX_WORDS (BATCH_LINE_MAX / 2)
+#define BATCH_OUTPUT_BUFFER (1 << 20)
+
+// The view opened by VIEW OPEN, if any.
+static TreeView *batch_view = NULL;
+
+static void batch_print_element(FILE *output, const Element *element) {
+    fprintf(output, "%d\t%s\t%s\t%.3f\n", element->atomic_number, element->symbol,
+            element->name, element->atomic_mass);
+}
+
+
+static void batch_emit_element(ScanTask *task, const Element *element) {
+    scan_printf(task, "%d\t%s\t%s\t%.3f\n", element->atomic_number, element->symbol,
+                element->name, element->atomic_mass);
+}
+
+
+static void batch_print_record(FILE *output, const SnapshotRecord *record) {
+    fprintf(output, "%d\t%.*s\t%.*s\t%.3f\n", record->atomic_number, (int)sizeof(record->symbol),
+            record->symbol, (int)sizeof(record->name), record->name, record->atomic_mass);
+}
+
+
+// Parses a whole word as an int. Returns 0 on anything else.
+static int batch_parse_int(const char *word, int *value) {
+    char *end;
+    long parsed = strtol(word, &end, 10);
+    if (*word == '\0' || *end != '\0' || parsed < INT_MIN || parsed > INT_MAX) {
+        return 0;
+    }
+    *value = (int)parsed;
+    return 1;
+}
+
+
+// Parses a whole word as a number, rejecting NaN.
+static int batch_parse_double(const char *word, double *value) {
+    char *end;
+    double parsed = strtod(word, &end);
+    if (*word == '\0' || *end != '\0' || isnan(parsed)) {
+        return 0;
+    }
+    *value = parsed;
+    return 1;
+}
+
+
+// The trie a PREFIX or FUZZY command names, or NULL.
+static Trie *batch_trie(const char *field) {
+    if (strcasecmp(field, "name") == 0) {
+        return &name_trie;
+    }
+    if (strcasecmp(field, "symbol") == 0) {
+        return &symbol_trie;
+    }
+    return NULL;
+}
+
+
+static int batch_emit_match(Element *element, void *arg) {
+    batch_print_element((FILE *)arg, element);
+    return 1;
+}
+
+
+static void batch_get(FILE *output, int atomic_number) {
+    if (mapped_snapshot != NULL) {
+        const SnapshotRecord *record = snapshot_search(mapped_snapshot, atomic_number);
+        if (record != NULL) {
+            batch_print_record(output, record);
+        } else {
+            fprintf(output, "NOT_FOUND %d\n", atomic_number);
+        }
+        return;
+    }
+    Element *element = search(atomic_number);
+    if (element != NULL) {
+        batch_print_element(output, element);
+    } else {
+        fprintf(output, "NOT_FOUND %d\n", atomic_number);
+    }
+}
+
+
+// VIEW subcommands, words[1] onwards.
+static const char *batch_view_command(FILE *output, char **words, int num_words) {
+    const char *command = num_words >= 2 ? words[1] : "";
+    int number;
+    int upper;
+    int count = 0;
+    Element *element;
+
+    if (strcasecmp(command, "OPEN") == 0 && num_words == 2) {
+        if (batch_view != NULL) {
+            return "a view is already open";
+        }
+        batch_view = view_open();
+        fputs("OK\n", output);
+        return NULL;
+    }
+    if (batch_view == NULL) {
+        return "no open view";
+    }
+    if (strcasecmp(command, "CLOSE") == 0 && num_words == 2) {
+        view_close(batch_view);
+        batch_view = NULL;
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "GET") == 0 && num_words == 3 && batch_parse_int(words[2], &number)) {
+        element = view_search(batch_view, number);
+        if (element != NULL) {
+            batch_print_element(output, element);
+        } else {
+            fprintf(output, "NOT_FOUND %d\n", number);
+        }
+    } else if (strcasecmp(command, "RANGE") == 0 && num_words == 4 && batch_parse_int(words[2], &number) &&
+               batch_parse_int(words[3], &upper)) {
+        ViewCursor cursor;
+        view_cursor_seek(&cursor, batch_view, number, upper);
+        while ((element = view_cursor_next(&cursor)) != NULL) {
+            batch_print_element(output, element);
+            count++;
+        }
+        fprintf(output, "END %d\n", count);
+    } else if (strcasecmp(command, "BLOCK") == 0 && num_words == 3 && strlen(words[2]) == 1 &&
+               block_list(words[2][0]) != NULL) {
+        ViewCursor cursor;
+        view_cursor_seek(&cursor, batch_view, INT_MIN, INT_MAX);
+        while ((element = view_cursor_next(&cursor)) != NULL) {
+            if (element->block == words[2][0]) {
+                batch_print_element(output, element);
+                count++;
+            }
+        }
+        fprintf(output, "END %d\n", count);
+    } else {
+        return "usage: VIEW OPEN | CLOSE | GET number | RANGE lower upper | BLOCK s|p|d|f";
+    }
+    return NULL;
+}
+
+
+// Runs one command split into words. Returns an error message, or NULL.
+static const char *batch_command(FILE *output, char **words, int num_words) {
+    const char *command = words[0];
+    int number;
+    int upper;
+
+    // Lookups are served straight from a mapped snapshot or a packed tree; anything
+    // else needs the tree, except STATS, which reports a packed tree as it is.
+    int lookup = strcasecmp(command, "GET") == 0 || strcasecmp(command, "MGET") == 0 ||
+                 strcasecmp(command, "RANGE") == 0;
+    if (mapped_snapshot != NULL && !lookup) {
+        snapshot_materialize();
+    }
+    if (packed_tree != NULL && !lookup && strcasecmp(command, "PACK") != 0 && strcasecmp(command, "STATS") != 0) {
+        unpack_tree();
+    }
+
+    if (strcasecmp(command, "INSERT") == 0) {
+        if (num_words != 5 || !batch_parse_int(words[1], &number)) {
+            return "usage: INSERT number symbol name mass";
+        }
+        if (strlen(words[2]) > 2 || strlen(words[3]) > 29) {
+            return "symbol or name too long";
+        }
+        char *end;
+        double atomic_mass = strtod(words[4], &end);
+        if (*end != '\0') {
+            return "bad atomic mass";
+        }
+        Element *element = create_element(number, words[2], words[3], atomic_mass);
+        if (insert(element)) {
+            fputs("OK\n", output);
+        } else {
+            free_element(element);
+            fprintf(output, "EXISTS %d\n", number);
+        }
+    } else if (strcasecmp(command, "MINSERT") == 0) {
+        int policy = num_words > 1 && strcasecmp(words[1], "replace") == 0 ? UPSERT_REPLACE : UPSERT_KEEP;
+        if (num_words < 6 || (num_words - 2) % 4 != 0 ||
+            (policy == UPSERT_KEEP && strcasecmp(words[1], "keep") != 0)) {
+            return "usage: MINSERT keep|replace number symbol name mass...";
+        }
+        int count = (num_words - 2) / 4;
+        double *masses = (double *)malloc(count * sizeof(double));
+        for (int i = 0; i < count; i++) {
+            char **fields = &words[2 + 4 * i];
+            char *end;
+            if (!batch_parse_int(fields[0], &number)) {
+                free(masses);
+                return "usage: MINSERT keep|replace number symbol name mass...";
+            }
+            if (strlen(fields[1]) > 2 || strlen(fields[2]) > 29) {
+                free(masses);
+                return "symbol or name too long";
+            }
+            masses[i] = strtod(fields[3], &end);
+            if (*end != '\0') {
+                free(masses);
+                return "bad atomic mass";
+            }
+        }
+        Element **elements = (Element **)malloc(count * sizeof(Element *));
+        for (int i = 0; i < count; i++) {
+            char **fields = &words[2 + 4 * i];
+            elements[i] = create_element(atoi(fields[0]), fields[1], fields[2], masses[i]);
+        }
+        long inserted = insert_batch(elements, count, policy);
+        if (inserted < 0) {
+            for (int i = 0; i < count; i++) {
+                free_element(elements[i]);
+            }
+        }
+        free(elements);
+        free(masses);
+        if (inserted < 0) {
+            return "not available in concurrent mode";
+        }
+        fprintf(output, "INSERTED %ld\n", inserted);
+    } else if (strcasecmp(command, "DELETE") == 0) {
+        if (num_words != 2 || !batch_parse_int(words[1], &number)) {
+            return "usage: DELETE number";
+        }
+        if (delete(number)) {
+            fputs("OK\n", output);
+        } else {
+            fprintf(output, "NOT_FOUND %d\n", number);
+        }
+    } else if (strcasecmp(command, "DELETE_RANGE") == 0) {
+        if (num_words != 3 || !batch_parse_int(words[1], &number) || !batch_parse_int(words[2], &upper)) {
+            return "usage: DELETE_RANGE lower upper";
+        }
+        long deleted = delete_range(number, upper);
+        if (deleted < 0) {
+            return "not available in concurrent mode";
+        }
+        fprintf(output, "DELETED %ld\n", deleted);
+    } else if (strcasecmp(command, "DEFER") == 0) {
+        if (num_words != 2 || (strcasecmp(words[1], "on") != 0 && strcasecmp(words[1], "off") != 0)) {
+            return "usage: DEFER on|off";
+        }
+        defer_rebalance = strcasecmp(words[1], "on") == 0;
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "COMPACT") == 0) {
+        if (!compact_tree()) {
+            return "not available in concurrent mode";
+        }
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "PACK") == 0) {
+        if (batch_view != NULL) {
+            return "close the view first";
+        }
+        if (!pack_tree()) {
+            return "not available in concurrent mode";
+        }
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "UNPACK") == 0) {
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "GET") == 0) {
+        if (num_words != 2 || !batch_parse_int(words[1], &number)) {
+            return "usage: GET number";
+        }
+        batch_get(output, number);
+    } else if (strcasecmp(command, "MGET") == 0) {
+        if (num_words < 2) {
+            return "usage: MGET number...";
+        }
+        int *keys = (int *)malloc((num_words - 1) * sizeof(int));
+        for (int i = 1; i < num_words; i++) {
+            if (!batch_parse_int(words[i], &keys[i - 1])) {
+                free(keys);
+                return "usage: MGET number...";
+            }
+        }
+        if (mapped_snapshot != NULL || packed_tree != NULL) {
+            for (int i = 0; i < num_words - 1; i++) {
+                batch_get(output, keys[i]);
+            }
+        } else {
+            Element **found = (Element **)malloc((num_words - 1) * sizeof(Element *));
+            search_batch(keys, num_words - 1, found);
+            for (int i = 0; i < num_words - 1; i++) {
+                if (found[i] != NULL) {
+                    batch_print_element(output, found[i]);
+                } else {
+                    fprintf(output, "NOT_FOUND %d\n", keys[i]);
+                }
+            }
+            free(found);
+        }
+        free(keys);
+    } else if (strcasecmp(command, "RANGE") == 0) {
+        if (num_words != 3 || !batch_parse_int(words[1], &number) || !batch_parse_int(words[2], &upper)) {
+            return "usage: RANGE lower upper";
+        }
+        int count = 0;
+        if (mapped_snapshot != NULL) {
+            SnapshotCursor cursor;
+            const SnapshotRecord *record;
+            snapshot_cursor_seek(&cursor, mapped_snapshot, number, upper);
+            while ((record = snapshot_cursor_next(&cursor)) != NULL) {
+                batch_print_record(output, record);
+                count++;
+            }
+        } else {
+            count = (int)cached_range_listing(number, upper, batch_emit_match, batch_emit_element, output);
+        }
+        fprintf(output, "END %d\n", count);
+    } else if (strcasecmp(command, "BLOCK") == 0) {
+        BlockList *list = num_words == 2 && strlen(words[1]) == 1 ? block_list(words[1][0]) : NULL;
+        if (list == NULL) {
+            return "usage: BLOCK s|p|d|f";
+        }
+        if (parallel_scan_worthwhile(list->count)) {
+            parallel_scan_list(list->elements, list->count, batch_emit_element, output);
+        } else {
+            for (int i = 0; i < list->count; i++) {
+                batch_print_element(output, list->elements[i]);
+            }
+        }
+        fprintf(output, "END %d\n", list->count);
+    } else if (strcasecmp(command, "SYMBOL") == 0) {
+        if (num_words != 2) {
+            return "usage: SYMBOL symbol";
+        }
+        int count = 0;
+        for (Element *match = search_by_symbol(words[1]); match != NULL; match = match->symbol_next) {
+            batch_print_element(output, match);
+            count++;
+        }
+        fprintf(output, "END %d\n", count);
+    } else if (strcasecmp(command, "NAME") == 0) {
+        if (num_words != 2) {
+            return "usage: NAME name";
+        }
+        Element *named = search_by_name(words[1]);
+        if (named != NULL) {
+            batch_print_element(output, named);
+        } else {
+            fprintf(output, "NOT_FOUND %s\n", words[1]);
+        }
+    } else if (strcasecmp(command, "MASS") == 0) {
+        double mass_lower;
+        double mass_upper;
+        if (num_words != 3 || !batch_parse_double(words[1], &mass_lower) ||
+            !batch_parse_double(words[2], &mass_upper)) {
+            return "usage: MASS lower upper";
+        }
+        long count = mass_range_scan(mass_lower, mass_upper, batch_emit_match, output);
+        fprintf(output, "END %ld\n", count);
+    } else if (strcasecmp(command, "PREFIX") == 0 || strcasecmp(command, "FUZZY") == 0) {
+        int fuzzy = strcasecmp(command, "FUZZY") == 0;
+        int limit = TRIE_DEFAULT_LIMIT;
+        int distance = 0;
+        Trie *trie = num_words >= 3 ? batch_trie(words[1]) : NULL;
+        if (trie == NULL || num_words < 3 + fuzzy || num_words > 4 + fuzzy ||
+            (fuzzy && (!batch_parse_int(words[3], &distance) || distance < 0)) ||
+            (num_words == 4 + fuzzy && (!batch_parse_int(words[3 + fuzzy], &limit) || limit <= 0))) {
+            return fuzzy ? "usage: FUZZY name|symbol query distance [limit]" : "usage: PREFIX name|symbol prefix [limit]";
+        }
+        if (limit > 100000) {
+            limit = 100000;
+        }
+        TrieMatch *matches = (TrieMatch *)malloc(limit * sizeof(TrieMatch));
+        int count = fuzzy ? fuzzy_search(trie, words[2], distance, matches, limit)
+                          : prefix_search(trie, words[2], matches, limit);
+        for (int i = 0; i < count; i++) {
+            if (fuzzy) {
+                fprintf(output, "%d\t", matches[i].distance);
+            }
+            batch_print_element(output, matches[i].element);
+        }
+        fprintf(output, "END %d\n", count);
+        free(matches);
+    } else if (strcasecmp(command, "AGGREGATE") == 0) {
+        if (num_words != 3 || !batch_parse_int(words[1], &number) || !batch_parse_int(words[2], &upper)) {
+            return "usage: AGGREGATE lower upper";
+        }
+        Aggregate aggregate = range_aggregate(number, upper);
+        if (aggregate.count == 0) {
+            fputs("0\t0.000\t-\t-\t-\n", output);
+        } else {
+            fprintf(output, "%ld\t%.3f\t%.3f\t%.3f\t%.3f\n", aggregate.count, aggregate.sum,
+                    aggregate.sum / aggregate.count, aggregate.min, aggregate.max);
+        }
+    } else if (strcasecmp(command, "RANK") == 0) {
+        if (num_words != 2 || !batch_parse_int(words[1], &number)) {
+            return "usage: RANK number";
+        }
+        fprintf(output, "%ld\n", rank(number));
+    } else if (strcasecmp(command, "SELECT") == 0) {
+        if (num_words != 2 || !batch_parse_int(words[1], &number)) {
+            return "usage: SELECT position";
+        }
+        Element *element = select_element(number);
+        if (element != NULL) {
+            batch_print_element(output, element);
+        } else {
+            fprintf(output, "NOT_FOUND %d\n", number);
+        }
+    } else if (strcasecmp(command, "SNAPSHOT") == 0) {
+        if (num_words != 2) {
+            return "usage: SNAPSHOT path";
+        }
+        if (!snapshot_save(words[1])) {
+            return "failed to write snapshot";
+        }
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "CHECKPOINT") == 0) {
+        if (wal == NULL) {
+            return "no write-ahead log";
+        }
+        if (!wal_checkpoint()) {
+            return "checkpoint failed";
+        }
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "SYNC") == 0) {
+        if (!wal_sync()) {
+            return "log sync failed";
+        }
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "VIEW") == 0) {
+        return batch_view_command(output, words, num_words);
+    } else if (strcasecmp(command, "STATS") == 0) {
+        if (num_words == 1) {
+            stats_dump_json(output);
+            return NULL;
+        }
+        if (num_words != 2) {
+            return "usage: STATS [on|hardware|off|reset]";
+        }
+        if (strcasecmp(words[1], "on") == 0 || strcasecmp(words[1], "hardware") == 0) {
+            stats_enable(strcasecmp(words[1], "hardware") == 0);
+        } else if (strcasecmp(words[1], "off") == 0) {
+            stats_disable();
+        } else if (strcasecmp(words[1], "reset") == 0) {
+            stats_reset();
+        } else {
+            return "usage: STATS [on|hardware|off|reset]";
+        }
+        fputs("OK\n", output);
+    } else if (strcasecmp(command, "CACHE") == 0) {
+        long max_records = RESULT_CACHE_RECORDS;
+        number = RESULT_CACHE_ENTRIES;
+        if (num_words >= 2 && num_words <= 4 && strcasecmp(words[1], "on") == 0 &&
+            (num_words < 3 || (batch_parse_int(words[2], &number) && number > 0)) &&
+            (num_words < 4 || (batch_parse_int(words[3], &upper) && upper > 0))) {
+            result_cache_enable(number, num_words == 4 ? upper : max_records);
+        } else if (num_words == 2 && strcasecmp(words[1], "off") == 0) {
+            result_cache_disable();
+        } else if (num_words == 2 && strcasecmp(words[1], "clear") == 0) {
+            result_cache_clear();
+        } else {
+            return "usage: CACHE on [entries [records]]|off|clear";
+        }
+        fputs("OK\n", output);
+    } else {
+        return "unknown command";
+    }
+    return NULL;
+}
+
+
+// Runs every command in input, writing replies to output and one
+// "ERROR line N: ..." reply per bad command. Returns the number of errors.
+int run_batch(FILE *input, FILE *output) {
+    char line[BATCH_LINE_MAX];
+    char **words = (char **)malloc(BATCH_MAX_WORDS * sizeof(char *));
+    int line_number = 0;
+    int errors = 0;
+
+    setvbuf(output, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    while (fgets(line, sizeof(line), input) != NULL) {
+        line_number++;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            fprintf(output, "ERROR line %d: line too long\n", line_number);
+            errors++;
+            int c;
+            while ((c = fgetc(input)) != EOF && c != '\n') {
+            }
+            continue;
+        }
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        int num_words = 0;
+        char *save;
+        for (char *word = strtok_r(line, " \t\r\n", &save); word != NULL && num_words < BATCH_MAX_WORDS;
+             word = strtok_r(NULL, " \t\r\n", &save)) {
+            words[num_words++] = word;
+        }
+        if (num_words == 0) {
+            continue;
+        }
+        const char *error = batch_command(output, words, num_words);
+        if (error != NULL) {
+            fprintf(output, "ERROR line %d: %s\n", line_number, error);
+            errors++;
+        }
+    }
+    if (batch_view != NULL) {
+        view_close(batch_view);
+        batch_view = NULL;
+    }
+    fflush(output);
+    free(words);
+    return errors;
+}
+
+
+// Server mode (--serve ADDRESS): the tree is loaded once and served to any
+// number of local clients by one epoll loop over non-blocking sockets. With
+// --pack, lookups are served from the packed records until the first INSERT
+// or DELETE unpacks them.
+// ADDRESS is a port number, for TCP on 127.0.0.1, or else the path of a Unix
+// domain socket.
+//
+// Requests and replies are binary frames in host byte order (server and
+// clients share the machine), each a uint32 length of what follows:
+//
+//   request  uint8 opcode, then
+//              SERVER_GET, SERVER_DELETE  int32 number
+//              SERVER_RANGE               int32 lower, int32 upper
+//              SERVER_BLOCK               uint8 block ('s', 'p', 'd' or 'f')
+//              SERVER_INSERT              one record
+//   reply    uint8 status, uint32 record count, then the records
+//   record   int32 number, double atomic mass, char symbol[3] (NUL padded),
+//            uint8 name length, then the name
+//
+// GET, RANGE and BLOCK reply OK with their records (GET may say NOT_FOUND);
+// INSERT replies OK or EXISTS and DELETE OK or NOT_FOUND, with no records.
+// A client may pipeline any number of requests; replies come back in order.
+// Replies to changes are only sent once the write-ahead log has them on disk,
+// one sync per round of the loop.
+#define SERVER_GET 1
+#define SERVER_RANGE 2
+#define SERVER_BLOCK 3
+#define SERVER_INSERT 4
+#define SERVER_DELETE 5
+
+#define SERVER_OK 0
+#define SERVER_NOT_FOUND 1
+#define SERVER_EXISTS 2
+#define SERVER_ERROR 3
+
+// Largest request frame, length prefix included.
+#define SERVER_FRAME_MAX 64
+#define SERVER_REPLY_HEADER 9
+#define SERVER_INPUT_BUFFER (64 * 1024)
+// A connection with this much unsent reply stops being read until it drains.
+#define SERVER_OUTPUT_HIGH (1 << 20)
+#define SERVER_EVENTS 64
+
+typedef struct ServerConnection {
+    int fd;
+    char *input;                 // SERVER_INPUT_BUFFER bytes
+    size_t input_used;
+    char *output;
+    size_t output_used;
+    size_t output_sent;
+    size_t output_capacity;
+    uint32_t events;             // epoll interest currently registered
+    int eof;                     // the client has stopped sending
+    int failed;                  // close without sending the rest
+    int queued;                  // on the round's work list
+    struct ServerConnection *next_queued;
+    struct ServerConnection *next;
+    struct ServerConnection *prev;
+} ServerConnection;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+
+static void server_stop(int signal_number) {
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+
+static size_t wire_put(char *out, const void *value, size_t size) {
+    memcpy(out, value, size);
+    return size;
+}
+
+
+// Writes element as a wire record and returns its size (at most 16 + 255 bytes).
+static size_t wire_put_record(char *out, const Element *element) {
+    int32_t number = element->atomic_number;
+    char symbol[3] = {0, 0, 0};
+    size_t name_length = strlen(element->name);
+    uint8_t length = (uint8_t)(name_length < 255 ? name_length : 255);
+    size_t size = wire_put(out, &number, sizeof(number));
+    size += wire_put(out + size, &element->atomic_mass, sizeof(double));
+    strncpy(symbol, element->symbol, sizeof(symbol));
+    size += wire_put(out + size, symbol, sizeof(symbol));
+    size += wire_put(out + size, &length, 1);
+    size += wire_put(out + size, element->name, length);
+    return size;
+}
+
+
+// Encodes one request into frame, which has room for SERVER_FRAME_MAX bytes,
+// and returns its size. BLOCK takes the block letter as lower; INSERT sends
+// record, whose name must be under 30 characters.
+size_t server_encode_request(char *frame, int opcode, int lower, int upper, const Element *record) {
+    uint8_t op = (uint8_t)opcode;
+    int32_t first = lower;
+    int32_t second = upper;
+    uint8_t block = (uint8_t)lower;
+    size_t size = 4 + wire_put(frame + 4, &op, 1);
+    if (opcode == SERVER_BLOCK) {
+        size += wire_put(frame + size, &block, 1);
+    } else if (opcode == SERVER_INSERT) {
+        size += wire_put_record(frame + size, record);
+    } else {
+        size += wire_put(frame + size, &first, sizeof(first));
+        if (opcode == SERVER_RANGE) {
+            size += wire_put(frame + size, &second, sizeof(second));
+        }
+    }
+    uint32_t length = (uint32_t)(size - 4);
+    memcpy(frame, &length, sizeof(length));
+    return size;
+}
+
+
+static void server_reserve(ServerConnection *connection, size_t bytes) {
+    if (connection->output_used + bytes <= connection->output_capacity) {
+        return;
+    }
+    size_t capacity = connection->output_capacity > 0 ? connection->output_capacity : 4096;
+    while (connection->output_used + bytes > capacity) {
+        capacity *= 2;
+    }
+    if (capacity != connection->output_capacity) {
+        connection->output = (char *)realloc(connection->output, capacity);
+        connection->output_capacity = capacity;
+    }
+}
+
+
+// Starts a reply and returns the offset of its header, filled in by server_reply_end().
+static size_t server_reply_begin(ServerConnection *connection) {
+    server_reserve(connection, SERVER_REPLY_HEADER);
+    size_t header = connection->output_used;
+    connection->output_used += SERVER_REPLY_HEADER;
+    return header;
+}
+
+
+static void server_reply_record(ServerConnection *connection, const Element *element) {
+    server_reserve(connection, 16 + 255);
+    connection->output_used += wire_put_record(connection->output + connection->output_used, element);
+}
+
+
+static int server_visit_record(Element *element, void *arg) {
+    server_reply_record((ServerConnection *)arg, element);
+    return 1;
+}
+
+
+// SERVER_BLOCK on a packed tree, which keeps no block lists: every record is
+// decoded and those of the block are sent.
+typedef struct ServerBlockScan {
+    ServerConnection *connection;
+    char block;
+    uint32_t count;
+} ServerBlockScan;
+
+
+static int server_visit_block(Element *element, void *arg) {
+    ServerBlockScan *scan = (ServerBlockScan *)arg;
+    if (element->block == scan->block) {
+        server_reply_record(scan->connection, element);
+        scan->count++;
+    }
+    return 1;
+}
+
+
+static void server_reply_end(ServerConnection *connection, size_t header, int status, uint32_t count) {
+    uint32_t length = (uint32_t)(connection->output_used - header - 4);
+    uint8_t code = (uint8_t)status;
+    char *out = connection->output + header;
+    out += wire_put(out, &length, sizeof(length));
+    out += wire_put(out, &code, 1);
+    wire_put(out, &count, sizeof(count));
+}
+
+
+// Runs one request (the frame after its length). Returns 0 if it is malformed.
+static int server_request(ServerConnection *connection, const char *body, uint32_t length) {
+    int32_t first = 0;
+    int32_t second;
+    double atomic_mass;
+    char symbol[3];
+    char name[30];
+    uint8_t name_length;
+    uint32_t count = 0;
+    int status = SERVER_OK;
+    size_t header = server_reply_begin(connection);
+    if (length >= 5) {
+        memcpy(&first, body + 1, sizeof(first));
+    }
+    switch (body[0]) {
+        case SERVER_GET:
+            if (length != 5) {
+                return 0;
+            }
+            Element *found = search(first);
+            if (found != NULL) {
+                server_reply_record(connection, found);
+                count = 1;
+            } else {
+                status = SERVER_NOT_FOUND;
+            }
+            break;
+        case SERVER_RANGE:
+            if (length != 9) {
+                return 0;
+            }
+            memcpy(&second, body + 5, sizeof(second));
+            count = (uint32_t)cached_range_scan(first, second, server_visit_record, connection);
+            break;
+        case SERVER_BLOCK:
+            if (length != 2) {
+                return 0;
             }
-            i++;
-            if (cur->children[i]->num_keys == MAX_ELEMENTS) {
-                split_node(cur, i, cur->children[i]);
-                if (element->atomic_number > cur->elements[i]->atomic_number) {
-                    i++;
-                }
+            BlockList *list = block_list(body[1]);
+            if (list == NULL) {
+                status = SERVER_ERROR;
+                break;
             }
-            cur = cur->children[i];
-        }
-        int i = cur->num_keys - 1;
-        while (i >= 0 && element->atomic_number < cur->elements[i]->atomic_number) {
-            cur->elements[i + 1] = cur->elements[i];
-            i--;
-        }
-        cur->elements[i + 1] = element;
-        cur->num_keys++;
+            if (packed_tree != NULL) {
+                ServerBlockScan scan = {connection, body[1], 0};
+                packed_scan(INT_MIN, INT_MAX, server_visit_block, &scan);
+                count = scan.count;
+                break;
+            }
+            for (int i = 0; i < list->count; i++) {
+                server_reply_record(connection, list->elements[i]);
+            }
+            count = list->count;
+            break;
+        case SERVER_INSERT:
+            if (length < 17) {
+                return 0;
+            }
+            memcpy(&atomic_mass, body + 5, sizeof(atomic_mass));
+            memcpy(symbol, body + 13, 2);
+            symbol[2] = '\0';
+            name_length = (uint8_t)body[16];
+            if (length != 17u + name_length) {
+                return 0;
+            }
+            if (name_length >= sizeof(name)) {
+                status = SERVER_ERROR;
+                break;
+            }
+            memcpy(name, body + 17, name_length);
+            name[name_length] = '\0';
+            Element *inserted = create_element(first, symbol, name, atomic_mass);
+            if (!insert(inserted)) {
+                free_element(inserted);
+                status = SERVER_EXISTS;
+            }
+            break;
+        case SERVER_DELETE:
+            if (length != 5) {
+                return 0;
+            }
+            if (!delete(first)) {
+                status = SERVER_NOT_FOUND;
+            }
+            break;
+        default:
+            return 0;
     }
+    server_reply_end(connection, header, status, count);
+    return 1;
 }
 
 
-Element *search(int atomic_number) {
-    Node *cur = root;
-    while (cur != NULL) {
-        int i = 0;
-        while (i < cur->num_keys && atomic_number > cur->elements[i]->atomic_number) {
-            i++;
+// Runs the complete requests in the input buffer, pausing while too much
+// output is waiting. A malformed frame fails the connection.
+static void server_run_requests(ServerConnection *connection) {
+    size_t pos = 0;
+    // Replies are addressed by offset while they are built, so the sent part
+    // of the output is only dropped here, between requests.
+    if (connection->output_sent > 0) {
+        memmove(connection->output, connection->output + connection->output_sent,
+                connection->output_used - connection->output_sent);
+        connection->output_used -= connection->output_sent;
+        connection->output_sent = 0;
+    }
+    while (!connection->failed && connection->output_used - connection->output_sent < SERVER_OUTPUT_HIGH &&
+           connection->input_used - pos >= 4) {
+        uint32_t length;
+        memcpy(&length, connection->input + pos, sizeof(length));
+        if (length == 0 || length > SERVER_FRAME_MAX - 4) {
+            connection->failed = 1;
+            break;
         }
-        if (i < cur->num_keys && atomic_number == cur->elements[i]->atomic_number) {
-            return cur->elements[i];
+        if (connection->input_used - pos < 4 + length) {
+            break;
         }
-        if (cur->is_leaf) {
-            return NULL;
+        if (!server_request(connection, connection->input + pos + 4, length)) {
+            connection->failed = 1;
+            break;
         }
-        cur = cur->children[i];
+        pos += 4 + length;
     }
-    return NULL;
+    memmove(connection->input, connection->input + pos, connection->input_used - pos);
+    connection->input_used -= pos;
 }
 
 
-void delete_adjust(Node *parent) {
-    Node *cur = root;
-    Node *left_sibling = NULL;
-    Node *right_sibling = NULL;
-    int index = 0;
-
-    
-    while (index <= parent->num_keys && parent->children[index] != NULL) {
-        if (parent->children[index] == parent) {
-            break;
-        }
-        index++;
-    }
-    
-    if (index > 0) {
-        left_sibling = parent->children[index - 1];
+static int server_has_request(const ServerConnection *connection) {
+    uint32_t length;
+    if (connection->input_used < 4) {
+        return 0;
     }
+    memcpy(&length, connection->input, sizeof(length));
+    return connection->input_used >= 4 + (size_t)length || length == 0 || length > SERVER_FRAME_MAX - 4;
+}
 
-    
-    if (index < parent->num_keys) {
-        right_sibling = parent->children[index + 1];
-    }
 
-    // Try redistributing keys from left sibling
-    if (left_sibling && left_sibling->num_keys > (MAX_ELEMENTS + 1) / 2) {
-        for (int i = cur->num_keys; i > 0; i--) {
-            cur->elements[i] = cur->elements[i - 1];
-        }
-        cur->elements[0] = left_sibling->elements[left_sibling->num_keys - 1];
-        if (!cur->is_leaf) {
-            for (int i = cur->num_keys + 1; i > 0; i--) {
-                cur->children[i] = cur->children[i - 1];
+static void server_read(ServerConnection *connection) {
+    while (connection->input_used < SERVER_INPUT_BUFFER) {
+        ssize_t got = read(connection->fd, connection->input + connection->input_used,
+                           SERVER_INPUT_BUFFER - connection->input_used);
+        if (got > 0) {
+            connection->input_used += got;
+        } else if (got == 0) {
+            connection->eof = 1;
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connection->failed = 1;
             }
-            cur->children[0] = left_sibling->children[left_sibling->num_keys];
+            return;
         }
-        cur->num_keys++;
-        left_sibling->num_keys--;
-        parent->elements[index - 1] = cur->elements[0];
     }
-    
-    else if (right_sibling && right_sibling->num_keys > (MAX_ELEMENTS + 1) / 2) {
-        cur->elements[cur->num_keys] = right_sibling->elements[0];
-        if (!cur->is_leaf) {
-            cur->children[cur->num_keys + 1] = right_sibling->children[0];
-        }
-        cur->num_keys++;
-        right_sibling->num_keys--;
-        parent->elements[index] = right_sibling->elements[0];
-        for (int i = 0; i < right_sibling->num_keys; i++) {
-            right_sibling->elements[i] = right_sibling->elements[i + 1];
-        }
-        if (!right_sibling->is_leaf) {
-            for (int i = 0; i <= right_sibling->num_keys; i++) {
-                right_sibling->children[i] = right_sibling->children[i + 1];
+}
+
+
+static void server_flush(ServerConnection *connection) {
+    while (connection->output_sent < connection->output_used) {
+        ssize_t sent = write(connection->fd, connection->output + connection->output_sent,
+                             connection->output_used - connection->output_sent);
+        if (sent > 0) {
+            connection->output_sent += sent;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (sent == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                connection->failed = 1;
             }
+            return;
         }
     }
-    
-    else if (left_sibling) {
-        left_sibling->elements[left_sibling->num_keys] = cur->elements[0];
-        for (int i = 0; i < cur->num_keys; i++) {
-            left_sibling->elements[left_sibling->num_keys + 1 + i] = cur->elements[i + 1];
+    connection->output_used = 0;
+    connection->output_sent = 0;
+}
+
+
+// The TCP port an address names, or 0 if it is a socket path.
+static int server_port(const char *address) {
+    char *end;
+    long port = strtol(address, &end, 10);
+    return *address != '\0' && *end == '\0' && port > 0 && port <= 65535 ? (int)port : 0;
+}
+
+
+static int server_listen(const char *address) {
+    int port = server_port(address);
+    int listener;
+    if (port != 0) {
+        struct sockaddr_in in;
+        int on = 1;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons((uint16_t)port);
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener < 0) {
+            return -1;
         }
-        if (!cur->is_leaf) {
-            for (int i = 0; i <= cur->num_keys; i++) {
-                left_sibling->children[left_sibling->num_keys + 1 + i] = cur->children[i];
-            }
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(listener, (struct sockaddr *)&in, sizeof(in)) != 0) {
+            close(listener);
+            return -1;
         }
-        left_sibling->num_keys += (1 + cur->num_keys);
-        for (int i = index; i < parent->num_keys - 1; i++) {
-            parent->elements[i] = parent->elements[i + 1];
-            parent->children[i + 1] = parent->children[i + 2];
+    } else {
+        struct sockaddr_un un;
+        struct stat st;
+        if (strlen(address) >= sizeof(un.sun_path)) {
+            return -1;
         }
-        parent->num_keys--;
-        free(cur);
-    }
-    
-    else if (right_sibling) {
-        cur->elements[cur->num_keys] = right_sibling->elements[0];
-        for (int i = 0; i < right_sibling->num_keys; i++) {
-            cur->elements[cur->num_keys + 1 + i] = right_sibling->elements[i + 1];
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, address);
+        // A socket left behind by an earlier run is replaced; any other file is not.
+        if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(address);
         }
-        if (!right_sibling->is_leaf) {
-            for (int i = 0; i <= right_sibling->num_keys; i++) {
-                cur->children[cur->num_keys + 1 + i] = right_sibling->children[i];
-            }
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener < 0) {
+            return -1;
         }
-        cur->num_keys += (1 + right_sibling->num_keys);
-        for (int i = index; i < parent->num_keys - 1; i++) {
-            parent->elements[i] = parent->elements[i + 1];
-            parent->children[i + 1] = parent->children[i + 2];
+        if (bind(listener, (struct sockaddr *)&un, sizeof(un)) != 0) {
+            close(listener);
+            return -1;
         }
-        parent->num_keys--;
-        free(right_sibling);
     }
-
-    
-    if (parent != root && parent->num_keys < (MAX_ELEMENTS + 1) / 2) {
-        delete_adjust(parent);
+    if (listen(listener, SOMAXCONN) != 0) {
+        close(listener);
+        return -1;
     }
+    return listener;
 }
 
 
-void delete(int atomic_number) {
-    if (root == NULL) {
-        printf("Tree is empty. Cannot delete.\n");
-        return;
+static void server_set_events(int epoll_fd, ServerConnection *connection, uint32_t events) {
+    if (events != connection->events) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = connection;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
     }
+}
 
-    
-    Node *cur = root;
-    Node *parent = NULL;
-    int index;
-    while (cur != NULL) {
-        index = 0;
-        while (index < cur->num_keys && atomic_number > cur->elements[index]->atomic_number) {
-            index++;
-        }
-        if (index < cur->num_keys && atomic_number == cur->elements[index]->atomic_number) {
-            break;
-        }
-        parent = cur;
-        cur = cur->is_leaf ? NULL : cur->children[index];
-    }
 
-    if (cur == NULL) {
-        printf("Element with atomic number %d not found. Cannot delete.\n", atomic_number);
-        return;
+static void server_queue(ServerConnection **queue, ServerConnection *connection) {
+    if (!connection->queued) {
+        connection->queued = 1;
+        connection->next_queued = *queue;
+        *queue = connection;
     }
+}
 
-    
-    for (int i = index; i < cur->num_keys - 1; i++) {
-        cur->elements[i] = cur->elements[i + 1];
-    }
-    cur->num_keys--;
 
-    
-    if (cur == root || cur->num_keys >= (MAX_ELEMENTS + 1) / 2) {
-        return;
+static void server_close(ServerConnection **connections, ServerConnection *connection) {
+    close(connection->fd);
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        *connections = connection->next;
     }
-
-    
-    Node *left_sibling = NULL;
-    if (index > 0) {
-        left_sibling = parent->children[index - 1];
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
     }
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
 
-    
-    Node *right_sibling = NULL;
-    if (index < parent->num_keys) {
-        right_sibling = parent->children[index + 1];
+
+// Serves requests on address until SIGINT or SIGTERM. Each round of the loop
+// reads whatever the ready clients sent, runs their complete requests, syncs
+// the write-ahead log once, and only then sends the replies. Returns 0 if
+// address can't be listened on.
+int run_server(const char *address) {
+    int listener = server_listen(address);
+    if (listener < 0) {
+        return 0;
     }
+    snapshot_materialize();
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, server_stop);
+    signal(SIGTERM, server_stop);
+    fprintf(stderr, "Serving on %s.\n", address);
 
-    
-    if (left_sibling && left_sibling->num_keys > (MAX_ELEMENTS + 1) / 2) {
-        for (int i = cur->num_keys; i > 0; i--) {
-            cur->elements[i] = cur->elements[i - 1];
+    struct epoll_event events[SERVER_EVENTS];
+    ServerConnection *connections = NULL;
+    ServerConnection *queue = NULL;      // connections to look at after this round's reads
+    while (!server_stopping) {
+        int ready = epoll_wait(epoll_fd, events, SERVER_EVENTS, queue != NULL ? 0 : -1);
+        if (ready < 0 && errno != EINTR) {
+            break;
         }
-        cur->elements[0] = left_sibling->elements[left_sibling->num_keys - 1];
-        if (!cur->is_leaf) {
-            for (int i = cur->num_keys + 1; i > 0; i--) {
-                cur->children[i] = cur->children[i - 1];
+        for (int i = 0; i < ready; i++) {
+            ServerConnection *connection = (ServerConnection *)events[i].data.ptr;
+            if (connection == NULL) {
+                int fd;
+                while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                    int on = 1;
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    connection = (ServerConnection *)calloc(1, sizeof(ServerConnection));
+                    connection->fd = fd;
+                    connection->input = (char *)malloc(SERVER_INPUT_BUFFER);
+                    connection->events = EPOLLIN;
+                    connection->next = connections;
+                    if (connections != NULL) {
+                        connections->prev = connection;
+                    }
+                    connections = connection;
+                    event.events = EPOLLIN;
+                    event.data.ptr = connection;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+                }
+                continue;
             }
-            cur->children[0] = left_sibling->children[left_sibling->num_keys];
-        }
-        cur->num_keys++;
-        left_sibling->num_keys--;
-        parent->elements[index - 1] = cur->elements[0];
-    }
-    
-    else if (right_sibling && right_sibling->num_keys > (MAX_ELEMENTS + 1) / 2) {
-        cur->elements[cur->num_keys] = right_sibling->elements[0];
-        if (!cur->is_leaf) {
-            cur->children[cur->num_keys + 1] = right_sibling->children[0];
-        }
-        cur->num_keys++;
-        right_sibling->num_keys--;
-        parent->elements[index] = right_sibling->elements[0];
-        for (int i = 0; i < right_sibling->num_keys; i++) {
-            right_sibling->elements[i] = right_sibling->elements[i + 1];
-        }
-        if (!right_sibling->is_leaf) {
-            for (int i = 0; i <= right_sibling->num_keys; i++) {
-                right_sibling->children[i] = right_sibling->children[i + 1];
+            if (events[i].events & EPOLLIN) {
+                server_read(connection);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                connection->failed = 1;
             }
+            server_queue(&queue, connection);
         }
-    }
-    
-    else if (left_sibling) {
-        left_sibling->elements[left_sibling->num_keys] = cur->elements[0];
-        for (int i = 0; i < cur->num_keys; i++) {
-            left_sibling->elements[left_sibling->num_keys + 1 + i] = cur->elements[i + 1];
+
+        for (ServerConnection *connection = queue; connection != NULL; connection = connection->next_queued) {
+            server_run_requests(connection);
         }
-        if (!cur->is_leaf) {
-            for (int i = 0; i <= cur->num_keys; i++) {
-                left_sibling->children[left_sibling->num_keys + 1 + i] = cur->children[i];
+        // Replies to changes go out only once the changes are durable.
+        wal_sync();
+
+        ServerConnection *round = queue;
+        queue = NULL;
+        while (round != NULL) {
+            ServerConnection *connection = round;
+            round = round->next_queued;
+            connection->queued = 0;
+            if (!connection->failed) {
+                server_flush(connection);
             }
-        }
-        left_sibling->num_keys += (1 + cur->num_keys);
-        for (int i = index; i < parent->num_keys - 1; i++) {
-            parent->elements[i] = parent->elements[i + 1];
-            parent->children[i + 1] = parent->children[i + 2];
-        }
-        parent->num_keys--;
-        free(cur);
-    }
-    
-    else if (right_sibling) {
-        cur->elements[cur->num_keys] = right_sibling->elements[0];
-        for (int i = 0; i < right_sibling->num_keys; i++) {
-            cur->elements[cur->num_keys + 1 + i] = right_sibling->elements[i + 1];
-        }
-        if (!right_sibling->is_leaf) {
-            for (int i = 0; i <= right_sibling->num_keys; i++) {
-                cur->children[cur->num_keys + 1 + i] = right_sibling->children[i];
+            int waiting = connection->output_used - connection->output_sent >= SERVER_OUTPUT_HIGH;
+            if (connection->failed ||
+                (connection->eof && connection->output_used == 0 && !server_has_request(connection))) {
+                server_close(&connections, connection);
+                continue;
+            }
+            uint32_t interest = 0;
+            if (!waiting && !connection->eof && connection->input_used < SERVER_INPUT_BUFFER) {
+                interest |= EPOLLIN;
+            }
+            if (connection->output_used > 0) {
+                interest |= EPOLLOUT;
+            }
+            server_set_events(epoll_fd, connection, interest);
+            // Requests still buffered run next round, without waiting for the socket.
+            if (!waiting && server_has_request(connection)) {
+                server_queue(&queue, connection);
             }
         }
-        cur->num_keys += (1 + right_sibling->num_keys);
-        for (int i = index; i < parent->num_keys - 1; i++) {
-            parent->elements[i] = parent->elements[i + 1];
-            parent->children[i + 1] = parent->children[i + 2];
-        }
-        parent->num_keys--;
-        free(right_sibling);
     }
 
-    
-    if (parent != root && parent->num_keys < (MAX_ELEMENTS + 1) / 2) {
-        delete_adjust(parent);
+    while (connections != NULL) {
+        server_close(&connections, connections);
     }
+    close(epoll_fd);
+    close(listener);
+    if (server_port(address) == 0) {
+        unlink(address);
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    return 1;
 }
 
 
-void range_search(int lower, int upper) {
-    if (root == NULL) {
-        printf("Tree is empty. No elements to search.\n");
-        return;
-    }
-    
+#ifndef RUN2_NO_MAIN
+int main(int argc, char **argv) {
+    int choice;
+    int atomic_number;
+    char symbol[3];
+    char name[30];
+    double atomic_mass;
+    char path[256];
+    const char *data_path = "elements.txt";
+    const char *snapshot_path = NULL;
+    const char *batch_path = NULL;
+    const char *serve_address = NULL;
+    const char *wal_path = NULL;
+    int wal_sync_every = 64;
+    int wal_sync_ms = 10;
+    long checkpoint_every = 100000;
+    int result_cache_entries = 0;
+    int pack = 0;
 
-    Node *cur = root;
-    while (!cur->is_leaf) {
-        int i = 0;
-        while (i < cur->num_keys && lower >= cur->elements[i]->atomic_number) {
-            i++;
-        }
-        cur = cur->children[i];
-    }
-    
-    
-    int found = 0;
-    while (cur != NULL) {
-        for (int i = 0; i < cur->num_keys; i++) {
-            if (cur->elements[i]->atomic_number >= lower && cur->elements[i]->atomic_number <= upper) {
-                printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", cur->elements[i]->name,
-                       cur->elements[i]->symbol, cur->elements[i]->atomic_number, cur->elements[i]->atomic_mass);
-                found = 1;
-            }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+            data_path = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_path = i + 1 < argc ? argv[++i] : "-";
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_address = argv[++i];
+        } else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+            wal_path = argv[++i];
+        } else if (strcmp(argv[i], "--wal-sync") == 0 && i + 1 < argc) {
+            wal_sync_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--wal-sync-ms") == 0 && i + 1 < argc) {
+            wal_sync_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_every = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+            scan_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--result-cache") == 0 && i + 1 < argc) {
+            result_cache_entries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats-hardware") == 0) {
+            stats_enable(strcmp(argv[i], "--stats-hardware") == 0);
+        } else if (strcmp(argv[i], "--pack") == 0) {
+            pack = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--data FILE] [--snapshot FILE] [--batch FILE|-] [--serve PORT|PATH] "
+                            "[--wal FILE [--wal-sync N] [--wal-sync-ms MS] [--checkpoint-every N]] "
+                            "[--scan-threads N] [--result-cache ENTRIES] [--stats|--stats-hardware] [--pack]\n"
+                            "  --wal-sync N       commit the log in groups of N records (default 64)\n"
+                            "  --wal-sync-ms MS   and at most MS ms after a record is logged (default 10, 0 for\n"
+                            "                     no limit)\n"
+                            "  --pack             keep the records packed, in a fraction of the memory, until\n"
+                            "                     something other than a lookup needs the tree\n",
+                    argv[0]);
+            return 1;
         }
-        cur = cur->next;
-    }
-    
-    if (!found) {
-        printf("No elements found in the specified range.\n");
     }
-}
 
-
-void print_tree(Node *node) {
-    if (node != NULL) {
-        for (int i = 0; i < node->num_keys; i++) {
-            printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", node->elements[i]->name,
-                   node->elements[i]->symbol, node->elements[i]->atomic_number, node->elements[i]->atomic_mass);
-        }
-        if (!node->is_leaf) {
-            for (int i = 0; i <= node->num_keys; i++) {
-                print_tree(node->children[i]);
-            }
+    // With a log, checkpoints go to the --snapshot file, or to FILE.snap next
+    // to the log; an existing checkpoint is the state the log is replayed onto.
+    char *checkpoint_path = NULL;
+    if (wal_path != NULL && snapshot_path == NULL) {
+        checkpoint_path = (char *)malloc(strlen(wal_path) + 6);
+        sprintf(checkpoint_path, "%s.snap", wal_path);
+        if (access(checkpoint_path, F_OK) == 0) {
+            snapshot_path = checkpoint_path;
         }
     }
-}
-
 
-void display_s_block_elements(Node *node) {
-    if (node != NULL) {
-        for (int i = 0; i < node->num_keys; i++) {
-            int atomic_number = node->elements[i]->atomic_number;
-            if ((atomic_number >= 1 && atomic_number <= 2) ||  // Hydrogen and Helium
-                (atomic_number >= 3 && atomic_number <= 4) ||  // Lithium and Beryllium
-                (atomic_number >= 11 && atomic_number <= 12) || // Sodium and Magnesium
-                (atomic_number >= 19 && atomic_number <= 20) || // Potassium and Calcium
-                (atomic_number >= 37 && atomic_number <= 38) || // Rubidium and Strontium
-                (atomic_number >= 55 && atomic_number <= 56) || // Cesium and Barium
-                (atomic_number >= 87 && atomic_number <= 88)) { // Francium and Radium
-                printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", 
-                       node->elements[i]->name, node->elements[i]->symbol, 
-                       node->elements[i]->atomic_number, node->elements[i]->atomic_mass);
-            }
-        }
-        if (!node->is_leaf) {
-            for (int i = 0; i <= node->num_keys; i++) {
-                display_s_block_elements(node->children[i]);
-            }
-        }
+    enable_symbol_index();
+    enable_name_index();
+    enable_mass_index();
+    enable_prefix_index();
+    if (result_cache_entries > 0) {
+        result_cache_enable(result_cache_entries, RESULT_CACHE_RECORDS);
     }
-}
-
-
-void display_p_block_elements(Node *node) {
-    if (node != NULL) {
-        for (int i = 0; i < node->num_keys; i++) {
-            int atomic_number = node->elements[i]->atomic_number;
-            if ((atomic_number >=5 && atomic_number<=10) ||         // Boron to neons
-                (atomic_number >= 13 && atomic_number <= 18) ||    // Aluminium to Argon
-                (atomic_number >= 31 && atomic_number <= 36) ||    // Gallium to Krypton
-                (atomic_number >= 49 && atomic_number <= 54) ||    // Indium to Xenon
-                (atomic_number >= 81 && atomic_number <= 86) ||    // Thallium to Radon
-                (atomic_number >= 113 && atomic_number <= 118)) {  // Nihonium to Oganesson
-                printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n",
-                       node->elements[i]->name, node->elements[i]->symbol,
-                       node->elements[i]->atomic_number, node->elements[i]->atomic_mass);
-            }
-        }
-        if (!node->is_leaf) {
-            for (int i = 0; i <= node->num_keys; i++) {
-                display_p_block_elements(node->children[i]);
-            }
+    if (snapshot_path != NULL) {
+        mapped_snapshot = snapshot_open(snapshot_path, 0);
+        if (mapped_snapshot == NULL) {
+            printf("Could not open snapshot %s, loading %s instead.\n", snapshot_path, data_path);
         }
     }
-}
-
+    if (mapped_snapshot == NULL) {
+        initialize_tree_from_file(data_path);
+    }
+    if (wal_path != NULL &&
+        !wal_open(wal_path, snapshot_path != NULL ? snapshot_path : checkpoint_path, wal_sync_every, wal_sync_ms,
+                  checkpoint_every > 0 ? (uint64_t)checkpoint_every : 0)) {
+        fprintf(stderr, "Could not open write-ahead log %s.\n", wal_path);
+        return 1;
+    }
+    if (pack) {
+        pack_tree();
+    }
 
-void display_d_block_elements(Node *node) {
-    if (node != NULL) {
-        for (int i = 0; i < node->num_keys; i++) {
-            int atomic_number = node->elements[i]->atomic_number;
-            if ((atomic_number >= 21 && atomic_number <= 30) ||    // Scandium to Zinc
-                (atomic_number >= 39 && atomic_number <= 48) ||    // Yttrium to Cadmium
-                (atomic_number >=72  && atomic_number<=80) ||   // Lanthanum to Mercury
-                (atomic_number >= 104 && atomic_number <= 112)) {  // Dubnium to Copernicium
-                printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n",
-                       node->elements[i]->name, node->elements[i]->symbol,
-                       node->elements[i]->atomic_number, node->elements[i]->atomic_mass);
-            }
+    if (serve_address != NULL) {
+        int served = run_server(serve_address);
+        if (!served) {
+            fprintf(stderr, "Could not listen on %s.\n", serve_address);
         }
-        if (!node->is_leaf) {
-            for (int i = 0; i <= node->num_keys; i++) {
-                display_d_block_elements(node->children[i]);
-            }
+        wal_close();
+        free(checkpoint_path);
+        if (mapped_snapshot != NULL) {
+            snapshot_close(mapped_snapshot);
         }
+        scan_pool_stop();
+        destroy_tree();
+        return served ? 0 : 1;
     }
-}
 
-
-void display_f_block_elements(Node *node) {
-    if (node != NULL) {
-        for (int i = 0; i < node->num_keys; i++) {
-            int atomic_number = node->elements[i]->atomic_number;
-            if ((atomic_number >= 57 && atomic_number <= 71) ||    // Lanthanum to Lutetium
-                (atomic_number >= 89 && atomic_number <= 103))   // Actinium to Lawrencium
-              {  // Nihonium to Oganesson
-                printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n",
-                       node->elements[i]->name, node->elements[i]->symbol,
-                       node->elements[i]->atomic_number, node->elements[i]->atomic_mass);
-            }
+    if (batch_path != NULL) {
+        FILE *input = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (input == NULL) {
+            fprintf(stderr, "Failed to open %s.\n", batch_path);
+            return 1;
         }
-        if (!node->is_leaf) {
-            for (int i = 0; i <= node->num_keys; i++) {
-                display_f_block_elements(node->children[i]);
-            }
+        int errors = run_batch(input, stdout);
+        if (input != stdin) {
+            fclose(input);
+        }
+        wal_close();
+        free(checkpoint_path);
+        if (mapped_snapshot != NULL) {
+            snapshot_close(mapped_snapshot);
         }
+        scan_pool_stop();
+        destroy_tree();
+        return errors == 0 ? 0 : 1;
     }
-}
-
-
-int main() {
-    int choice;
-    int atomic_number;
-    char symbol[3];
-    char name[30];
-    double atomic_mass;
-
-    initialize_tree_from_file("elements.txt");
     
     while (1) {
         printf("\nMenu:\n");
@@ -562,8 +7615,30 @@ int main() {
         printf("7. Display D-Block Elements\n");
         printf("8. Display F-Block Elements\n");
         printf("9. Exit\n");
+        printf("10. Search by symbol\n");
+        printf("11. Search by name\n");
+        printf("12. Save snapshot\n");
+        printf("13. Load snapshot\n");
+        printf("14. Search for several elements\n");
+        printf("15. Checkpoint the write-ahead log\n");
+        printf("16. Atomic mass statistics for a range\n");
+        printf("17. Rank of an atomic number\n");
+        printf("18. Element at a position\n");
+        printf("19. Delete a range of elements\n");
+        printf("20. Compact the tree\n");
+        printf("21. Show statistics (JSON)\n");
+        printf("22. Search by atomic mass range\n");
+        printf("23. Prefix search by name or symbol\n");
+        printf("24. Fuzzy search by name or symbol\n");
         printf("Enter your choice: ");
         scanf("%d", &choice);
+
+        // Point and range lookups run against a mapped snapshot or a packed tree; everything else needs the real tree.
+        if ((mapped_snapshot != NULL || packed_tree != NULL) && choice != 3 && choice != 4 && choice != 9 &&
+            choice != 15) {
+            snapshot_materialize();
+            unpack_tree();
+        }
         
         switch (choice) {
             case 1:
@@ -575,18 +7650,40 @@ int main() {
                 scanf("%s", name);
                 printf("Enter atomic mass: ");
                 scanf("%lf", &atomic_mass);
-                insert(create_element(atomic_number, symbol, name, atomic_mass));
-                printf("Element inserted successfully.\n");
+                Element *element = create_element(atomic_number, symbol, name, atomic_mass);
+                if (insert(element)) {
+                    printf("Element inserted successfully.\n");
+                } else {
+                    free_element(element);
+                    printf("Element with atomic number %d already exists.\n", atomic_number);
+                }
                 break;
             case 2:
                 printf("Enter the atomic number of the element to delete: ");
                 scanf("%d", &atomic_number);
-                delete(atomic_number);
-                printf("Element deleted successfully.\n");
+                if (root == NULL) {
+                    printf("Tree is empty. Cannot delete.\n");
+                } else if (delete(atomic_number)) {
+                    printf("Element deleted successfully.\n");
+                } else {
+                    printf("Element with atomic number %d not found. Cannot delete.\n", atomic_number);
+                }
                 break;
             case 3:
                 printf("Enter the atomic number of the element to search: ");
                 scanf("%d", &atomic_number);
+                if (mapped_snapshot != NULL) {
+                    const SnapshotRecord *record = snapshot_search(mapped_snapshot, atomic_number);
+                    if (record != NULL) {
+                        printf("Element found:\n");
+                        printf("Name: %.*s\n", (int)sizeof(record->name), record->name);
+                        printf("Symbol: %.*s\n", (int)sizeof(record->symbol), record->symbol);
+                        printf("Atomic Mass: %.2f\n", record->atomic_mass);
+                    } else {
+                        printf("Element with atomic number %d not found.\n", atomic_number);
+                    }
+                    break;
+                }
                 Element *result = search(atomic_number);
                 if (result != NULL) {
                     printf("Element found:\n");
@@ -601,32 +7698,221 @@ int main() {
                 printf("Enter the range of atomic numbers (lower and upper bounds): ");
                 int lower, upper;
                 scanf("%d %d", &lower, &upper);
+                if (mapped_snapshot != NULL) {
+                    SnapshotCursor cursor;
+                    const SnapshotRecord *record;
+                    int found = 0;
+                    snapshot_cursor_seek(&cursor, mapped_snapshot, lower, upper);
+                    while ((record = snapshot_cursor_next(&cursor)) != NULL) {
+                        printf("%.*s (%.*s) - Atomic Number: %d, Atomic Mass: %.2f\n",
+                               (int)sizeof(record->name), record->name, (int)sizeof(record->symbol), record->symbol,
+                               record->atomic_number, record->atomic_mass);
+                        found = 1;
+                    }
+                    if (!found) {
+                        printf("No elements found in the specified range.\n");
+                    }
+                    break;
+                }
                 range_search(lower, upper);
                 break;
             case 5:
                 printf("Displaying s-block elements:\n");
-                display_s_block_elements(root);
+                display_block_elements('s');
                 break;
             case 6:
                 printf("Displaying p-block elements:\n");
-                display_p_block_elements(root);
+                display_block_elements('p');
                 break;
             case 7:
                 printf("Displaying d-block elements:\n");
-                display_d_block_elements(root);
+                display_block_elements('d');
                 break;
             case 8:
                 printf("Displaying f-block elements:\n");
-                display_f_block_elements(root);
+                display_block_elements('f');
                 break;
             case 9:
                 printf("Exiting program...\n");
+                wal_close();
+                free(checkpoint_path);
+                if (mapped_snapshot != NULL) {
+                    snapshot_close(mapped_snapshot);
+                }
+                scan_pool_stop();
+                destroy_tree();
                 exit(0);
+            case 10:
+                printf("Enter the symbol of the element to search: ");
+                scanf("%2s", symbol);
+                Element *match = search_by_symbol(symbol);
+                if (match == NULL) {
+                    printf("No element with symbol %s found.\n", symbol);
+                }
+                for (; match != NULL; match = match->symbol_next) {
+                    printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", match->name,
+                           match->symbol, match->atomic_number, match->atomic_mass);
+                }
+                break;
+            case 11:
+                printf("Enter the name of the element to search: ");
+                scanf("%29s", name);
+                Element *named = search_by_name(name);
+                if (named != NULL) {
+                    printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", named->name,
+                           named->symbol, named->atomic_number, named->atomic_mass);
+                } else {
+                    printf("No element named %s found.\n", name);
+                }
+                break;
+            case 12:
+                printf("Enter the snapshot file to write: ");
+                scanf("%255s", path);
+                if (snapshot_save(path)) {
+                    printf("Snapshot saved to %s.\n", path);
+                } else {
+                    printf("Failed to write snapshot %s.\n", path);
+                }
+                break;
+            case 13:
+                printf("Enter the snapshot file to load: ");
+                scanf("%255s", path);
+                SnapshotFile *loaded = snapshot_open(path, 1);
+                if (loaded != NULL) {
+                    destroy_tree();
+                    mapped_snapshot = loaded;
+                    // The log must now be replayed onto the loaded state, so it starts over from it.
+                    if (wal_path != NULL) {
+                        wal_checkpoint();
+                    }
+                    printf("Snapshot %s loaded.\n", path);
+                } else {
+                    printf("Could not open snapshot %s.\n", path);
+                }
+                break;
+            case 14:
+                printf("How many atomic numbers? ");
+                int batch_count = 0;
+                scanf("%d", &batch_count);
+                if (batch_count <= 0) {
+                    break;
+                }
+                int *batch_keys = (int *)malloc(batch_count * sizeof(int));
+                Element **batch_results = (Element **)malloc(batch_count * sizeof(Element *));
+                printf("Enter the atomic numbers: ");
+                for (int i = 0; i < batch_count; i++) {
+                    scanf("%d", &batch_keys[i]);
+                }
+                search_batch(batch_keys, batch_count, batch_results);
+                for (int i = 0; i < batch_count; i++) {
+                    if (batch_results[i] != NULL) {
+                        printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", batch_results[i]->name,
+                               batch_results[i]->symbol, batch_results[i]->atomic_number, batch_results[i]->atomic_mass);
+                    } else {
+                        printf("Element with atomic number %d not found.\n", batch_keys[i]);
+                    }
+                }
+                free(batch_results);
+                free(batch_keys);
+                break;
+            case 15:
+                if (wal_path == NULL) {
+                    printf("No write-ahead log is open (start with --wal FILE).\n");
+                } else if (wal_checkpoint()) {
+                    printf("Checkpoint written, log truncated.\n");
+                } else {
+                    printf("Checkpoint failed; the log is kept.\n");
+                }
+                break;
+            case 16:
+                printf("Enter the range of atomic numbers (lower and upper bounds): ");
+                int stats_lower, stats_upper;
+                scanf("%d %d", &stats_lower, &stats_upper);
+                Aggregate aggregate = range_aggregate(stats_lower, stats_upper);
+                if (aggregate.count == 0) {
+                    printf("No elements found in the specified range.\n");
+                } else {
+                    printf("Elements: %ld, Total Mass: %.2f, Average Mass: %.2f, Min Mass: %.2f, Max Mass: %.2f\n",
+                           aggregate.count, aggregate.sum, aggregate.sum / aggregate.count, aggregate.min, aggregate.max);
+                }
+                break;
+            case 17:
+                printf("Enter atomic number: ");
+                scanf("%d", &atomic_number);
+                printf("%ld elements have a smaller atomic number.\n", rank(atomic_number));
+                break;
+            case 18:
+                printf("Enter a position (0 is the smallest atomic number): ");
+                long position = -1;
+                scanf("%ld", &position);
+                Element *selected = select_element(position);
+                if (selected != NULL) {
+                    printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", selected->name,
+                           selected->symbol, selected->atomic_number, selected->atomic_mass);
+                } else {
+                    printf("No element at position %ld.\n", position);
+                }
+                break;
+            case 19:
+                printf("Enter the range of atomic numbers to delete (lower and upper bounds): ");
+                int delete_lower, delete_upper;
+                scanf("%d %d", &delete_lower, &delete_upper);
+                printf("Deleted %ld elements.\n", delete_range(delete_lower, delete_upper));
+                break;
+            case 20:
+                compact_tree();
+                printf("Tree compacted.\n");
+                break;
+            case 21:
+                if (!stats_enabled) {
+                    printf("Counters are off; start with --stats to collect them.\n");
+                }
+                stats_dump_json(stdout);
+                break;
+            case 22:
+                printf("Enter the range of atomic masses (lower and upper bounds): ");
+                double mass_lower, mass_upper;
+                scanf("%lf %lf", &mass_lower, &mass_upper);
+                mass_range_search(mass_lower, mass_upper);
+                break;
+            case 23:
+            case 24:
+                printf("Search names or symbols (n/s): ");
+                char field[8];
+                char query[TRIE_QUERY_MAX];
+                int max_distance = 0;
+                TrieMatch matches[TRIE_DEFAULT_LIMIT];
+                scanf("%7s", field);
+                Trie *trie = tolower((unsigned char)field[0]) == 's' ? &symbol_trie : &name_trie;
+                if (choice == 23) {
+                    printf("Enter the prefix: ");
+                    scanf("%63s", query);
+                } else {
+                    printf("Enter the text and the largest edit distance: ");
+                    scanf("%63s %d", query, &max_distance);
+                }
+                int count = choice == 23 ? prefix_search(trie, query, matches, TRIE_DEFAULT_LIMIT)
+                                         : fuzzy_search(trie, query, max_distance, matches, TRIE_DEFAULT_LIMIT);
+                if (count == 0) {
+                    printf("No matching elements found.\n");
+                }
+                for (int i = 0; i < count; i++) {
+                    Element *found = matches[i].element;
+                    printf("%s (%s) - Atomic Number: %d, Atomic Mass: %.2f", found->name, found->symbol,
+                           found->atomic_number, found->atomic_mass);
+                    if (choice == 24) {
+                        printf(", Distance: %d", matches[i].distance);
+                    }
+                    printf("\n");
+                }
+                break;
             default:
-                printf("Invalid choice. Please enter a number between 1 and 5.\n");
+                printf("Invalid choice. Please enter a number between 1 and 24.\n");
         }
+        // Each interactive change is durable once its menu command returns.
+        wal_sync();
     }
 
     return 0;
 }
-
+#endif
@@ -0,0 +1,1487 @@
+#define RUN2_NO_MAIN
+#include "run2.c"
+
+// Unit tests. Every test starts from an empty tree and checks the results
+// of the public API against a plain reference of the keys that should be
+// present (present[] and masses[]), and after each round of changes the
+// tree's structural invariants (see check_tree()). make test runs them at
+// the default node order and at orders 3 and 16, where a few dozen keys are
+// enough to split and merge nodes at every level.
+//
+// Usage: tests [NAME...]
+//
+// With names, only the tests whose names contain one of them run. The exit
+// status is nonzero if any check failed.
+
+#define TEST_KEYS 4096
+
+typedef struct Test {
+    const char *name;
+    void (*run)(void);
+} Test;
+
+int checks = 0;
+int failures = 0;
+const char *current_test = "";
+
+char present[TEST_KEYS];
+double masses[TEST_KEYS];
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        checks++;                                                                         \
+        if (!(condition)) {                                                               \
+            failures++;                                                                   \
+            printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, current_test, #condition); \
+        }                                                                                 \
+    } while (0)
+
+
+static unsigned long long test_rng_state = 88172645463325252ULL;
+
+static unsigned int test_rand(void) {
+    test_rng_state ^= test_rng_state << 13;
+    test_rng_state ^= test_rng_state >> 7;
+    test_rng_state ^= test_rng_state << 17;
+    return (unsigned int)(test_rng_state >> 32);
+}
+
+
+static void shuffle(int *keys, int n) {
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)(test_rand() % (unsigned int)(i + 1));
+        int tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+
+static void reset(void) {
+    destroy_tree();
+    memset(present, 0, sizeof(present));
+    memset(masses, 0, sizeof(masses));
+}
+
+
+// Synthetic records: the name and symbol are derived from the key, so a
+// record read back can be checked against it.
+static void test_name(int key, char *name) {
+    snprintf(name, 30, "Element%d", key);
+}
+
+
+static void test_symbol(int key, char *symbol) {
+    symbol[0] = 'A' + key % 26;
+    symbol[1] = 'a' + key / 26 % 26;
+    symbol[2] = '\0';
+}
+
+
+static Element *test_element(int key, double mass) {
+    char name[30];
+    char symbol[3];
+    test_name(key, name);
+    test_symbol(key, symbol);
+    return create_element(key, symbol, name, mass);
+}
+
+
+static double test_mass(int key) {
+    return key * 1.5 + (test_rand() % 1000) / 8.0;
+}
+
+
+// Inserts key into the tree and the reference.
+static int model_insert(int key) {
+    double mass = test_mass(key);
+    Element *element = test_element(key, mass);
+    int inserted = insert(element);
+    if (inserted) {
+        present[key] = 1;
+        masses[key] = mass;
+    } else {
+        free_element(element);
+    }
+    return inserted;
+}
+
+
+static int model_delete(int key) {
+    int deleted = delete(key);
+    present[key] = 0;
+    return deleted;
+}
+
+
+static long model_delete_range(int lower, int upper) {
+    long deleted = delete_range(lower, upper);
+    for (int key = lower < 0 ? 0 : lower; key <= upper && key < TEST_KEYS; key++) {
+        present[key] = 0;
+    }
+    return deleted;
+}
+
+
+static long model_count(void) {
+    long count = 0;
+    for (int key = 0; key < TEST_KEYS; key++) {
+        count += present[key];
+    }
+    return count;
+}
+
+
+// A record as the tree returned it against the reference.
+static int record_matches(const Element *element, int key) {
+    char name[30];
+    char symbol[3];
+    test_name(key, name);
+    test_symbol(key, symbol);
+    return element != NULL && element->atomic_number == key && element->atomic_mass == masses[key] &&
+           strcmp(element->name, name) == 0 && strcmp(element->symbol, symbol) == 0;
+}
+
+
+typedef struct TreeCheck {
+    int leaf_depth;
+    const Node *prev_leaf;
+    long records;
+    int ok;
+} TreeCheck;
+
+
+// Keys of node's subtree must lie in [low, high). Checks key order, node
+// fill, equal leaf depth, the leaf chain, the records against the reference
+// and the subtree stats.
+static void check_node(TreeCheck *check, const Node *node, int depth, long low, long high, int is_root) {
+    if (node->num_keys > MAX_ELEMENTS || (!is_root && !defer_rebalance && node->num_keys < MIN_KEYS)) {
+        check->ok = 0;
+        return;
+    }
+    for (int i = 0; i < node->num_keys; i++) {
+        if (node->keys[i] < low || node->keys[i] >= high || (i > 0 && node->keys[i] <= node->keys[i - 1])) {
+            check->ok = 0;
+        }
+    }
+    Aggregate stats;
+    aggregate_clear(&stats);
+    if (node->is_leaf) {
+        if (check->leaf_depth < 0) {
+            check->leaf_depth = depth;
+        }
+        if (depth != check->leaf_depth || (check->prev_leaf != NULL && check->prev_leaf->next != node)) {
+            check->ok = 0;
+        }
+        check->prev_leaf = node;
+        check->records += node->num_keys;
+        for (int i = 0; i < node->num_keys; i++) {
+            int key = node->keys[i];
+            if (key < 0 || key >= TEST_KEYS || !present[key] || !record_matches(node->elements[i], key)) {
+                check->ok = 0;
+            } else {
+                aggregate_add(&stats, node->elements[i]->atomic_mass);
+            }
+        }
+    } else {
+        for (int i = 0; i <= node->num_keys; i++) {
+            check_node(check, node->children[i], depth + 1, i > 0 ? node->keys[i - 1] : low,
+                       i < node->num_keys ? node->keys[i] : high, 0);
+            aggregate_merge(&stats, &node->children[i]->stats);
+        }
+    }
+    // The stats are not kept in concurrent mode.
+    if (!tree_concurrent &&
+        (stats.count != node->stats.count || fabs(stats.sum - node->stats.sum) > 1e-6 * (1 + fabs(stats.sum)) ||
+         stats.min != node->stats.min || stats.max != node->stats.max)) {
+        check->ok = 0;
+    }
+}
+
+
+// Whether the whole tree is well formed and holds exactly the reference.
+static int check_tree(void) {
+    TreeCheck check = {-1, NULL, 0, 1};
+    if (root != NULL) {
+        check_node(&check, root, 0, INT_MIN, (long)INT_MAX + 1, 1);
+        if (check.prev_leaf == NULL || check.prev_leaf->next != NULL) {
+            check.ok = 0;
+        }
+    }
+    return check.ok && check.records == model_count();
+}
+
+
+// Height of the tree, 0 when empty.
+static int tree_height(void) {
+    int height = 0;
+    for (const Node *node = root; node != NULL; node = node->is_leaf ? NULL : node->children[0]) {
+        height++;
+    }
+    return height;
+}
+
+
+// Runs range_search() with stdout going to a temporary file and returns
+// what it printed.
+static char *capture_range_search(int lower, int upper) {
+    fflush(stdout);
+    FILE *capture = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+    range_search(lower, upper);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    fseek(capture, 0, SEEK_END);
+    long length = ftell(capture);
+    char *text = (char *)malloc(length + 1);
+    rewind(capture);
+    length = (long)fread(text, 1, length, capture);
+    text[length] = '\0';
+    fclose(capture);
+    return text;
+}
+
+
+// What range_search(lower, upper) should print for the reference.
+static char *expected_range_search(int lower, int upper) {
+    size_t capacity = 256;
+    size_t length = 0;
+    char *text = (char *)malloc(capacity);
+    text[0] = '\0';
+    if (model_count() == 0) {
+        strcpy(text, "Tree is empty. No elements to search.\n");
+        return text;
+    }
+    for (int key = lower < 0 ? 0 : lower; key <= upper && key < TEST_KEYS; key++) {
+        if (!present[key]) {
+            continue;
+        }
+        char name[30];
+        char symbol[3];
+        char line[128];
+        test_name(key, name);
+        test_symbol(key, symbol);
+        int n = snprintf(line, sizeof(line), "%s (%s) - Atomic Number: %d, Atomic Mass: %.2f\n", name, symbol, key,
+                         masses[key]);
+        if (length + n + 1 > capacity) {
+            capacity = 2 * (length + n + 1);
+            text = (char *)realloc(text, capacity);
+        }
+        memcpy(text + length, line, n + 1);
+        length += n;
+    }
+    if (length == 0) {
+        strcpy(text, "No elements found in the specified range.\n");
+    }
+    return text;
+}
+
+
+// Whether a cursor over [lower, upper] returns exactly the reference keys in it, in order.
+static int cursor_matches(int lower, int upper) {
+    Cursor cursor;
+    Element *element;
+    int key = lower < 0 ? 0 : lower;
+    cursor_seek(&cursor, lower, upper);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        while (key < TEST_KEYS && !present[key]) {
+            key++;
+        }
+        if (key > upper || !record_matches(element, key)) {
+            return 0;
+        }
+        key++;
+    }
+    while (key <= upper && key < TEST_KEYS && !present[key]) {
+        key++;
+    }
+    return key > upper || key >= TEST_KEYS;
+}
+
+
+static void test_insert_search_delete(void) {
+    int keys[TEST_KEYS];
+    for (int i = 0; i < TEST_KEYS; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, TEST_KEYS);
+    CHECK(search(keys[0]) == NULL);
+    CHECK(delete(keys[0]) == 0);
+    for (int i = 0; i < TEST_KEYS; i += 2) {
+        CHECK(model_insert(keys[i]) == 1);
+    }
+    CHECK(check_tree());
+
+    // Duplicates are refused and leave the stored record alone.
+    for (int i = 0; i < TEST_KEYS; i += 64) {
+        Element *duplicate = test_element(keys[i], -1.0);
+        CHECK(insert(duplicate) == 0);
+        free_element(duplicate);
+        CHECK(record_matches(search(keys[i]), keys[i]));
+    }
+    for (int i = 0; i < TEST_KEYS; i++) {
+        Element *element = search(keys[i]);
+        CHECK(i % 2 == 0 ? record_matches(element, keys[i]) : element == NULL);
+    }
+    CHECK(search(-1) == NULL);
+    CHECK(search(TEST_KEYS) == NULL);
+
+    // Deleting a missing key changes nothing.
+    for (int i = 1; i < TEST_KEYS; i += 128) {
+        CHECK(delete(keys[i]) == 0);
+    }
+    CHECK(check_tree());
+
+    shuffle(keys, TEST_KEYS);
+    for (int i = 0; i < TEST_KEYS; i++) {
+        int was_present = present[keys[i]];
+        CHECK(model_delete(keys[i]) == was_present);
+        CHECK(search(keys[i]) == NULL);
+        if (i % 256 == 0) {
+            CHECK(check_tree());
+        }
+    }
+    CHECK(check_tree());
+    CHECK(root == NULL || root->num_keys == 0);
+    CHECK(model_insert(7) == 1);
+    CHECK(record_matches(search(7), 7));
+}
+
+
+// Splits at exactly the point a node fills, and merges back down to a
+// single leaf.
+static void test_split_merge_boundaries(void) {
+    for (int key = 0; key < MAX_ELEMENTS; key++) {
+        model_insert(key);
+    }
+    CHECK(root != NULL && root->is_leaf && root->num_keys == MAX_ELEMENTS);
+    CHECK(check_tree());
+    model_insert(MAX_ELEMENTS);
+    CHECK(root != NULL && !root->is_leaf && root->num_keys == 1);
+    CHECK(root->children[0]->num_keys + root->children[1]->num_keys == MAX_ELEMENTS + 1);
+    CHECK(check_tree());
+
+    // Grow to three levels or more, checking every step near the splits.
+    int key = MAX_ELEMENTS + 1;
+    while (tree_height() < 3 && key < TEST_KEYS) {
+        model_insert(key++);
+        CHECK(check_tree());
+    }
+    CHECK(tree_height() >= 3 || key == TEST_KEYS);
+
+    // Descending deletes take the rightmost nodes down to MIN_KEYS and merge them.
+    while (key > 0) {
+        key--;
+        CHECK(model_delete(key) == 1);
+        if (key < 4 * MAX_ELEMENTS || key % 16 == 0) {
+            CHECK(check_tree());
+        }
+        if (key == MAX_ELEMENTS) {
+            CHECK(tree_height() <= 2);
+        }
+    }
+    CHECK(check_tree());
+    CHECK(root == NULL || (root->is_leaf && root->num_keys == 0));
+
+    // Deletes from the front merge leftmost nodes.
+    for (key = 0; key < 8 * MAX_ELEMENTS && key < TEST_KEYS; key++) {
+        model_insert(key);
+    }
+    for (int k = 0; k < key; k++) {
+        CHECK(model_delete(k) == 1);
+        if (k % 7 == 0) {
+            CHECK(check_tree());
+        }
+    }
+    CHECK(check_tree());
+}
+
+
+static void test_bulk_load(void) {
+    int counts[] = {1, 2, MIN_KEYS, MIN_KEYS + 1, MAX_ELEMENTS, MAX_ELEMENTS + 1, 3 * MAX_ELEMENTS + 5, TEST_KEYS};
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        reset();
+        int count = counts[c];
+        Element **elements = (Element **)malloc(count * sizeof(Element *));
+        for (int i = 0; i < count; i++) {
+            int key = i * (TEST_KEYS / count);
+            masses[key] = test_mass(key);
+            present[key] = 1;
+            elements[i] = test_element(key, masses[key]);
+        }
+        bulk_load(elements, count);
+        free(elements);
+        CHECK(check_tree());
+
+        // Leaves are filled evenly to about bulk_load_fill, and chained in key order.
+        int per_node = (int)(MAX_ELEMENTS * bulk_load_fill);
+        if (per_node < MIN_KEYS + 1) {
+            per_node = MIN_KEYS + 1;
+        }
+        const Node *leaf = root;
+        while (!leaf->is_leaf) {
+            leaf = leaf->children[0];
+        }
+        int fewest = INT_MAX;
+        int most = 0;
+        long chained = 0;
+        int last = -1;
+        for (; leaf != NULL; leaf = leaf->next) {
+            fewest = leaf->num_keys < fewest ? leaf->num_keys : fewest;
+            most = leaf->num_keys > most ? leaf->num_keys : most;
+            for (int i = 0; i < leaf->num_keys; i++) {
+                CHECK(leaf->keys[i] > last);
+                last = leaf->keys[i];
+            }
+            chained += leaf->num_keys;
+        }
+        CHECK(chained == count);
+        CHECK(most <= per_node || most == count);
+        CHECK(most - fewest <= 1);
+        CHECK(cursor_matches(0, TEST_KEYS));
+    }
+
+    // The loaded tree takes further inserts and deletes.
+    for (int key = 1; key < TEST_KEYS; key += 3) {
+        model_insert(key);
+    }
+    for (int key = 0; key < TEST_KEYS; key += 5) {
+        model_delete(key);
+    }
+    CHECK(check_tree());
+}
+
+
+static void test_range_scans(void) {
+    char *expected = expected_range_search(0, 100);
+    char *printed = capture_range_search(0, 100);
+    CHECK(strcmp(printed, expected) == 0);
+    free(expected);
+    free(printed);
+
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (test_rand() % 3 == 0) {
+            model_insert(key);
+        }
+    }
+    for (int round = 0; round < 200; round++) {
+        int lower = (int)(test_rand() % (TEST_KEYS + 20)) - 10;
+        int width = round % 4 == 0 ? (int)(test_rand() % TEST_KEYS) : (int)(test_rand() % 40);
+        int upper = lower + width;
+        CHECK(cursor_matches(lower, upper));
+        expected = expected_range_search(lower, upper);
+        printed = capture_range_search(lower, upper);
+        CHECK(strcmp(printed, expected) == 0);
+        free(expected);
+        free(printed);
+    }
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(cursor_matches(10, 5));
+
+    // A range with nothing in it.
+    for (int key = 100; key <= 200; key++) {
+        model_delete(key);
+    }
+    expected = expected_range_search(100, 200);
+    printed = capture_range_search(100, 200);
+    CHECK(strcmp(printed, "No elements found in the specified range.\n") == 0);
+    CHECK(strcmp(printed, expected) == 0);
+    free(expected);
+    free(printed);
+}
+
+
+// A snapshot record against the reference.
+static int snapshot_record_matches(const SnapshotRecord *record, int key) {
+    char name[30];
+    char symbol[3];
+    test_name(key, name);
+    test_symbol(key, symbol);
+    return record != NULL && record->atomic_number == key && record->atomic_mass == masses[key] &&
+           strncmp(record->name, name, sizeof(record->name)) == 0 &&
+           strncmp(record->symbol, symbol, sizeof(record->symbol)) == 0;
+}
+
+
+// A temporary file name for tests that write files.
+static char *temp_path(char *path, size_t size, const char *suffix) {
+    snprintf(path, size, "/tmp/run2-tests-%ld%s", (long)getpid(), suffix);
+    return path;
+}
+
+
+static int write_file(const char *path, const char *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    int ok = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+
+static char *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = (size_t)ftell(file);
+    rewind(file);
+    char *data = (char *)malloc(*size + 1);
+    *size = fread(data, 1, *size, file);
+    fclose(file);
+    return data;
+}
+
+
+static void test_snapshot(void) {
+    char path[64];
+    temp_path(path, sizeof(path), ".snap");
+
+    // An empty tree.
+    CHECK(snapshot_save(path));
+    SnapshotFile *snapshot = snapshot_open(path, 1);
+    CHECK(snapshot != NULL);
+    if (snapshot != NULL) {
+        SnapshotCursor cursor;
+        CHECK(snapshot_search(snapshot, 1) == NULL);
+        snapshot_cursor_seek(&cursor, snapshot, INT_MIN, INT_MAX);
+        CHECK(snapshot_cursor_next(&cursor) == NULL);
+        snapshot_close(snapshot);
+    }
+
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (test_rand() % 2 == 0) {
+            model_insert(key);
+        }
+    }
+    CHECK(snapshot_save(path));
+    snapshot = snapshot_open(path, 1);
+    CHECK(snapshot != NULL);
+    if (snapshot == NULL) {
+        return;
+    }
+    for (int key = -1; key <= TEST_KEYS; key++) {
+        const SnapshotRecord *record = snapshot_search(snapshot, key);
+        CHECK(key >= 0 && key < TEST_KEYS && present[key] ? snapshot_record_matches(record, key) : record == NULL);
+    }
+    for (int round = 0; round < 50; round++) {
+        int lower = (int)(test_rand() % TEST_KEYS);
+        int upper = lower + (int)(test_rand() % (round % 5 == 0 ? TEST_KEYS : 50));
+        SnapshotCursor cursor;
+        const SnapshotRecord *record;
+        int key = lower;
+        int ok = 1;
+        snapshot_cursor_seek(&cursor, snapshot, lower, upper);
+        while ((record = snapshot_cursor_next(&cursor)) != NULL) {
+            while (key < TEST_KEYS && !present[key]) {
+                key++;
+            }
+            ok = ok && snapshot_record_matches(record, key);
+            key++;
+        }
+        while (key <= upper && key < TEST_KEYS && !present[key]) {
+            key++;
+        }
+        CHECK(ok && (key > upper || key >= TEST_KEYS));
+    }
+
+    // Materializing rebuilds the same tree.
+    destroy_tree();
+    mapped_snapshot = snapshot;
+    snapshot_materialize();
+    CHECK(mapped_snapshot == NULL);
+    CHECK(check_tree());
+
+    // A truncated file, or a damaged payload when it is verified, doesn't open.
+    size_t size;
+    char *data = read_file(path, &size);
+    CHECK(data != NULL && size > sizeof(SnapshotHeader));
+    if (data == NULL) {
+        return;
+    }
+    CHECK(write_file(path, data, size - 1) && snapshot_open(path, 0) == NULL);
+    CHECK(write_file(path, data, sizeof(SnapshotHeader) / 2) && snapshot_open(path, 0) == NULL);
+
+    // Unverified, a damaged payload opens, and lookups and scans over it
+    // must stay inside the mapping and end.
+    const SnapshotHeader *header = (const SnapshotHeader *)data;
+    char *damaged = (char *)malloc(size);
+    for (int round = 0; round < 200; round++) {
+        memcpy(damaged, data, size);
+        int hits = 1 + (int)(test_rand() % 8);
+        for (int i = 0; i < hits; i++) {
+            size_t at = header->nodes_offset + test_rand() % (size - header->nodes_offset - sizeof(uint64_t));
+            uint64_t value;
+            switch (test_rand() % 4) {
+            case 0:
+                value = ((uint64_t)test_rand() << 32) | test_rand();
+                break;
+            case 1:
+                value = test_rand() % (size * 2);
+                break;
+            case 2:
+                value = header->root_offset;
+                break;
+            default:
+                value = test_rand() % (header->record_count + 1000);
+                break;
+            }
+            memcpy(damaged + at, &value, test_rand() % 2 ? sizeof(uint32_t) : sizeof(uint64_t));
+        }
+        CHECK(write_file(path, damaged, size));
+        SnapshotFile *verified = snapshot_open(path, 1);
+        CHECK(verified == NULL);
+        if (verified != NULL) {
+            snapshot_close(verified);
+        }
+        snapshot = snapshot_open(path, 0);
+        CHECK(snapshot != NULL);
+        if (snapshot == NULL) {
+            continue;
+        }
+        for (int key = 0; key < TEST_KEYS; key += 17) {
+            snapshot_search(snapshot, key);
+        }
+        SnapshotCursor cursor;
+        long scanned = 0;
+        snapshot_cursor_seek(&cursor, snapshot, INT_MIN, INT_MAX);
+        while (snapshot_cursor_next(&cursor) != NULL) {
+            scanned++;
+        }
+        CHECK(scanned <= (long)header->record_count * (long)header->node_count);
+        mapped_snapshot = snapshot;
+        snapshot_materialize();
+        CHECK(root == NULL || root->num_keys <= MAX_ELEMENTS);
+    }
+    free(damaged);
+    free(data);
+    remove(path);
+}
+
+
+// Concurrent mode: readers run against writers that insert and delete the
+// odd keys, each writer its own share. The even keys are never written, so
+// readers must always find them; an odd key may or may not be there, but
+// whatever a lookup or scan returns must be the right record.
+#define CONCURRENT_READERS 3
+#define CONCURRENT_WRITERS 2
+#define CONCURRENT_ROUNDS 20000
+
+typedef struct ConcurrentWorker {
+    pthread_t thread;
+    int id;
+    unsigned long long rng;
+    long errors;
+} ConcurrentWorker;
+
+int concurrent_stop = 0;
+
+
+static unsigned int worker_rand(ConcurrentWorker *worker) {
+    worker->rng ^= worker->rng << 13;
+    worker->rng ^= worker->rng >> 7;
+    worker->rng ^= worker->rng << 17;
+    return (unsigned int)(worker->rng >> 32);
+}
+
+
+// Odd keys carry a mass derived from the key alone, so a reader can check
+// them while writers churn.
+static int concurrent_record_ok(const Element *element, int key) {
+    if (element == NULL || element->atomic_number != key) {
+        return 0;
+    }
+    return key % 2 == 0 ? record_matches(element, key) : element->atomic_mass == key * 1.5;
+}
+
+
+static void *concurrent_reader(void *arg) {
+    ConcurrentWorker *worker = (ConcurrentWorker *)arg;
+    while (!__atomic_load_n(&concurrent_stop, __ATOMIC_ACQUIRE)) {
+        int key = (int)(worker_rand(worker) % TEST_KEYS);
+        Element *element = search(key);
+        if ((key % 2 == 0 || element != NULL) && !concurrent_record_ok(element, key)) {
+            worker->errors++;
+        }
+        if (worker_rand(worker) % 16 == 0) {
+            // Every even key in the range comes back, in order.
+            Cursor cursor;
+            int upper = key + 200;
+            int expected = key + key % 2;
+            int last = key - 1;
+            cursor_seek(&cursor, key, upper);
+            while ((element = cursor_next(&cursor)) != NULL) {
+                int number = element->atomic_number;
+                if (number <= last || number > upper || !concurrent_record_ok(element, number) ||
+                    (number > expected && expected < TEST_KEYS)) {
+                    worker->errors++;
+                }
+                if (number == expected) {
+                    expected += 2;
+                }
+                last = number;
+            }
+            if (expected <= upper && expected < TEST_KEYS) {
+                worker->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+static void *concurrent_writer(void *arg) {
+    ConcurrentWorker *worker = (ConcurrentWorker *)arg;
+    for (int round = 0; round < CONCURRENT_ROUNDS; round++) {
+        // Odd keys whose (key / 2) % CONCURRENT_WRITERS is the writer's id.
+        int slot = (int)(worker_rand(worker) % (TEST_KEYS / 2 / CONCURRENT_WRITERS));
+        int key = (slot * CONCURRENT_WRITERS + worker->id) * 2 + 1;
+        if (worker_rand(worker) % 2 == 0) {
+            char name[30];
+            char symbol[3];
+            test_name(key, name);
+            test_symbol(key, symbol);
+            Element *element = create_element(key, symbol, name, key * 1.5);
+            if (!insert(element)) {
+                free_element(element);
+            }
+        } else {
+            delete(key);
+        }
+    }
+    return NULL;
+}
+
+
+static void test_concurrent(void) {
+    for (int key = 0; key < TEST_KEYS; key += 2) {
+        model_insert(key);
+    }
+    enable_concurrency();
+
+    // The bulk writers refuse to run and leave the tree alone.
+    Element *batch[2] = {test_element(1, 1.5), test_element(3, 4.5)};
+    CHECK(insert_batch(batch, 2, UPSERT_KEEP) == -1);
+    free_element(batch[0]);
+    free_element(batch[1]);
+    CHECK(delete_range(0, TEST_KEYS) == -1);
+    CHECK(compact_tree() == 0);
+    CHECK(pack_tree() == 0 && packed_tree == NULL);
+    CHECK(search(0) != NULL && search(1) == NULL);
+
+    ConcurrentWorker readers[CONCURRENT_READERS];
+    ConcurrentWorker writers[CONCURRENT_WRITERS];
+    concurrent_stop = 0;
+    for (int i = 0; i < CONCURRENT_READERS; i++) {
+        readers[i] = (ConcurrentWorker){0, i, 0x9E3779B97F4A7C15ULL * (i + 1), 0};
+        pthread_create(&readers[i].thread, NULL, concurrent_reader, &readers[i]);
+    }
+    for (int i = 0; i < CONCURRENT_WRITERS; i++) {
+        writers[i] = (ConcurrentWorker){0, i, 0xD1B54A32D192ED03ULL * (i + 1), 0};
+        pthread_create(&writers[i].thread, NULL, concurrent_writer, &writers[i]);
+    }
+    for (int i = 0; i < CONCURRENT_WRITERS; i++) {
+        pthread_join(writers[i].thread, NULL);
+    }
+    __atomic_store_n(&concurrent_stop, 1, __ATOMIC_RELEASE);
+    long errors = 0;
+    for (int i = 0; i < CONCURRENT_READERS; i++) {
+        pthread_join(readers[i].thread, NULL);
+        errors += readers[i].errors;
+    }
+    CHECK(errors == 0);
+    disable_concurrency();
+
+    // Whatever the writers left behind is a well-formed tree.
+    for (int key = 1; key < TEST_KEYS; key += 2) {
+        Element *element = search(key);
+        present[key] = element != NULL;
+        masses[key] = key * 1.5;
+        CHECK(element == NULL || concurrent_record_ok(element, key));
+    }
+    CHECK(check_tree());
+}
+
+
+static long file_size(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0 ? (long)info.st_size : -1;
+}
+
+
+// Writes through the log, replays it onto an empty tree, with and without a
+// checkpoint under it, and cuts off a torn tail.
+static void test_wal(void) {
+    char log_path[64];
+    char snapshot_path[64];
+    temp_path(log_path, sizeof(log_path), ".wal");
+    temp_path(snapshot_path, sizeof(snapshot_path), ".wal.snap");
+    remove(log_path);
+    remove(snapshot_path);
+
+    // Groups far bigger than the writes: only the time bound commits them.
+    CHECK(wal_open(log_path, snapshot_path, 1000, 20, 0));
+    long empty_size = file_size(log_path);
+    for (int key = 0; key < 100; key++) {
+        model_insert(key);
+    }
+    CHECK(file_size(log_path) == empty_size);
+    struct timespec pause = {0, 200 * 1000000L};
+    nanosleep(&pause, NULL);
+    CHECK(file_size(log_path) == empty_size + 100 * (long)sizeof(WalRecord));
+
+    for (int key = 0; key < 100; key += 3) {
+        model_delete(key);
+    }
+    model_delete_range(40, 60);
+    wal_close();
+
+    // Replay rebuilds the same tree.
+    char logged_present[TEST_KEYS];
+    double logged_masses[TEST_KEYS];
+    memcpy(logged_present, present, sizeof(present));
+    memcpy(logged_masses, masses, sizeof(masses));
+    reset();
+    CHECK(wal_open(log_path, snapshot_path, 1000, 0, 0));
+    wal_close();
+    memcpy(present, logged_present, sizeof(present));
+    memcpy(masses, logged_masses, sizeof(masses));
+    CHECK(check_tree());
+
+    // A checkpoint truncates the log; what follows it is replayed on top.
+    CHECK(wal_open(log_path, snapshot_path, 4, 0, 0));
+    CHECK(wal_checkpoint());
+    CHECK(file_size(log_path) == empty_size);
+    for (int key = 100; key < 300; key++) {
+        model_insert(key);
+    }
+    model_delete_range(150, 160);
+    wal_close();
+    long size = file_size(log_path);
+    FILE *log = fopen(log_path, "ab");
+    CHECK(log != NULL);
+    if (log != NULL) {
+        fputs("torn record", log);
+        fclose(log);
+    }
+
+    destroy_tree();
+    mapped_snapshot = snapshot_open(snapshot_path, 1);
+    CHECK(mapped_snapshot != NULL);
+    CHECK(wal_open(log_path, snapshot_path, 4, 0, 0));
+    wal_close();
+    CHECK(mapped_snapshot == NULL);
+    CHECK(file_size(log_path) == size);
+    CHECK(check_tree());
+    remove(log_path);
+    remove(snapshot_path);
+}
+
+
+// Range statistics, rank() and select_element() against sums over the reference.
+static int aggregates_match(void) {
+    long count = 0;
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (rank(key) != count) {
+            return 0;
+        }
+        if (present[key]) {
+            const Element *element = select_element(count);
+            if (element == NULL || element->atomic_number != key) {
+                return 0;
+            }
+            count++;
+        }
+    }
+    if (select_element(count) != NULL || select_element(-1) != NULL || rank(INT_MAX) != count) {
+        return 0;
+    }
+    for (int round = 0; round < 100; round++) {
+        int lower = (int)(test_rand() % (TEST_KEYS + 20)) - 10;
+        int upper = lower + (int)(test_rand() % (round % 3 == 0 ? TEST_KEYS : 100));
+        Aggregate expected;
+        aggregate_clear(&expected);
+        for (int key = lower < 0 ? 0 : lower; key <= upper && key < TEST_KEYS; key++) {
+            if (present[key]) {
+                aggregate_add(&expected, masses[key]);
+            }
+        }
+        Aggregate got = range_aggregate(lower, upper);
+        if (got.count != expected.count || fabs(got.sum - expected.sum) > 1e-6 * (1 + fabs(expected.sum)) ||
+            got.min != expected.min || got.max != expected.max) {
+            return 0;
+        }
+    }
+    Aggregate none = range_aggregate(10, 5);
+    return none.count == 0;
+}
+
+
+static void test_aggregates(void) {
+    CHECK(aggregates_match());
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (test_rand() % 2 == 0) {
+            model_insert(key);
+        }
+    }
+    CHECK(aggregates_match());
+    for (int key = 0; key < TEST_KEYS; key += 1 + (int)(test_rand() % 5)) {
+        model_delete(key);
+    }
+    CHECK(aggregates_match());
+    CHECK(check_tree());
+
+    // A huge mass rounds away the small ones while it is summed in. Removing
+    // it with a larger and a smaller mass still present refreshes no extreme,
+    // so only recomputing the sums leaves no rounding error behind.
+    static const double huge[3] = {-1.5e17, 1e17, 1.5e17};
+    for (int i = 0; i < 3; i++) {
+        int key = TEST_KEYS - 3 + i;
+        model_delete(key);
+        CHECK(insert(test_element(key, huge[i])));
+        present[key] = 1;
+        masses[key] = huge[i];
+    }
+    CHECK(model_delete(TEST_KEYS - 2));
+    CHECK(check_tree());
+    CHECK(model_delete(TEST_KEYS - 3) && model_delete(TEST_KEYS - 1));
+    CHECK(aggregates_match());
+}
+
+
+static void test_delete_range(void) {
+    CHECK(delete_range(0, TEST_KEYS) == 0);
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (test_rand() % 4 != 0) {
+            model_insert(key);
+        }
+    }
+    CHECK(delete_range(10, 5) == 0);
+    for (int round = 0; round < 60; round++) {
+        int lower = (int)(test_rand() % TEST_KEYS);
+        int upper = lower + (int)(test_rand() % (round % 10 == 0 ? TEST_KEYS / 4 : 3 * MAX_ELEMENTS));
+        long expected = 0;
+        for (int key = lower; key <= upper && key < TEST_KEYS; key++) {
+            expected += present[key];
+        }
+        CHECK(model_delete_range(lower, upper) == expected);
+        CHECK(check_tree());
+        CHECK(cursor_matches(lower - MAX_ELEMENTS, upper + MAX_ELEMENTS));
+        // Refill part of the gap so later ranges cut through fresh leaves.
+        for (int key = lower; key <= upper && key < TEST_KEYS; key += 3) {
+            model_insert(key);
+        }
+    }
+    long remaining = model_count();
+    CHECK(model_delete_range(INT_MIN, INT_MAX) == remaining);
+    CHECK(check_tree());
+    CHECK(search(0) == NULL && cursor_matches(INT_MIN, INT_MAX));
+
+    // Deferred deletes leave leaves underfull until compact_tree().
+    for (int key = 0; key < TEST_KEYS; key++) {
+        model_insert(key);
+    }
+    defer_rebalance = 1;
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (key % 5 != 0) {
+            CHECK(model_delete(key) == 1);
+        }
+    }
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    compact_tree();
+    defer_rebalance = 0;
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(aggregates_match());
+}
+
+
+// The reference as it stood when a view was opened.
+typedef struct Reference {
+    char present[TEST_KEYS];
+    double masses[TEST_KEYS];
+} Reference;
+
+
+static void save_reference(Reference *reference) {
+    memcpy(reference->present, present, sizeof(present));
+    memcpy(reference->masses, masses, sizeof(masses));
+}
+
+
+// Whether view holds exactly the keys of reference, by point lookups and by
+// a view cursor over [lower, upper].
+static int view_matches(const TreeView *view, const Reference *reference, int lower, int upper) {
+    Reference current;
+    save_reference(&current);
+    memcpy(present, reference->present, sizeof(present));
+    memcpy(masses, reference->masses, sizeof(masses));
+    int ok = 1;
+    for (int key = 0; key < TEST_KEYS && ok; key++) {
+        Element *element = view_search(view, key);
+        ok = present[key] ? record_matches(element, key) : element == NULL;
+    }
+    ViewCursor cursor;
+    Element *element;
+    int key = lower < 0 ? 0 : lower;
+    view_cursor_seek(&cursor, view, lower, upper);
+    while (ok && (element = view_cursor_next(&cursor)) != NULL) {
+        while (key < TEST_KEYS && !present[key]) {
+            key++;
+        }
+        ok = key <= upper && record_matches(element, key);
+        key++;
+    }
+    while (key <= upper && key < TEST_KEYS && !present[key]) {
+        key++;
+    }
+    ok = ok && (key > upper || key >= TEST_KEYS);
+    memcpy(present, current.present, sizeof(present));
+    memcpy(masses, current.masses, sizeof(masses));
+    return ok;
+}
+
+
+// Views opened at different points keep seeing the tree as it was while
+// inserts, deletes and range deletes split, merge and free its nodes.
+static void test_views(void) {
+    static Reference first_reference;
+    static Reference second_reference;
+    for (int key = 0; key < TEST_KEYS; key += 2) {
+        model_insert(key);
+    }
+    save_reference(&first_reference);
+    TreeView *first = view_open();
+    CHECK(view_matches(first, &first_reference, INT_MIN, INT_MAX));
+
+    for (int key = 1; key < TEST_KEYS; key += 2) {
+        model_insert(key);
+    }
+    for (int key = 0; key < TEST_KEYS; key += 6) {
+        model_delete(key);
+    }
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(view_matches(first, &first_reference, INT_MIN, INT_MAX));
+    CHECK(view_matches(first, &first_reference, 100, 100 + 5 * MAX_ELEMENTS));
+
+    save_reference(&second_reference);
+    TreeView *second = view_open();
+    model_delete_range(TEST_KEYS / 4, TEST_KEYS / 2);
+    for (int round = 0; round < TEST_KEYS; round++) {
+        int key = (int)(test_rand() % TEST_KEYS);
+        if (present[key]) {
+            model_delete(key);
+        } else {
+            model_insert(key);
+        }
+    }
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(view_matches(first, &first_reference, INT_MIN, INT_MAX));
+    CHECK(view_matches(second, &second_reference, INT_MIN, INT_MAX));
+    CHECK(view_matches(second, &second_reference, TEST_KEYS / 4 - 10, TEST_KEYS / 2 + 10));
+
+    view_close(first);
+    CHECK(view_matches(second, &second_reference, INT_MIN, INT_MAX));
+    for (int key = 0; key < TEST_KEYS; key += 3) {
+        model_delete(key);
+    }
+    CHECK(view_matches(second, &second_reference, INT_MIN, INT_MAX));
+    view_close(second);
+    CHECK(open_views == NULL);
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(aggregates_match());
+}
+
+
+typedef struct ScanCheck {
+    int next;                    // no key below this may come next
+    long count;
+    int ok;
+} ScanCheck;
+
+
+static int scan_check_visit(Element *element, void *arg) {
+    ScanCheck *scan = (ScanCheck *)arg;
+    int key = element->atomic_number;
+    if (key < scan->next || key >= TEST_KEYS || !present[key] || !record_matches(element, key)) {
+        scan->ok = 0;
+    }
+    for (int missed = scan->next < 0 ? 0 : scan->next; missed < key && missed < TEST_KEYS; missed++) {
+        if (present[missed]) {
+            scan->ok = 0;
+        }
+    }
+    scan->next = key + 1;
+    scan->count++;
+    return 1;
+}
+
+
+// Whether cached_range_scan() over [lower, upper] visits exactly the reference keys in it, in order.
+static int scan_matches(int lower, int upper) {
+    ScanCheck scan = {lower, 0, 1};
+    long count = cached_range_scan(lower, upper, scan_check_visit, &scan);
+    for (int key = scan.next < 0 ? 0 : scan.next; key <= upper && key < TEST_KEYS; key++) {
+        if (present[key]) {
+            scan.ok = 0;
+        }
+    }
+    return scan.ok && count == scan.count;
+}
+
+
+// Lookups and range scans decode the packed records; unpacking restores the tree.
+static void test_packed(void) {
+    CHECK(pack_tree() == 1);
+    CHECK(packed_tree != NULL && packed_tree->count == 0);
+    CHECK(search(1) == NULL && scan_matches(INT_MIN, INT_MAX));
+    char *printed = capture_range_search(0, 10);
+    CHECK(strcmp(printed, "Tree is empty. No elements to search.\n") == 0);
+    free(printed);
+    unpack_tree();
+    CHECK(packed_tree == NULL && root == NULL);
+
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (test_rand() % 3 != 0 || key % 1000 == 999) {
+            model_insert(key);
+        }
+    }
+    for (int key = 1000; key < 2000; key++) {
+        model_delete(key);
+    }
+    CHECK(pack_tree() == 1);
+    CHECK(root == NULL && packed_tree->count == model_count());
+    CHECK(pack_tree() == 1);
+    for (int key = -1; key <= TEST_KEYS; key++) {
+        Element *element = search(key);
+        CHECK(key >= 0 && key < TEST_KEYS && present[key] ? record_matches(element, key) : element == NULL);
+    }
+    for (int round = 0; round < 200; round++) {
+        int lower = (int)(test_rand() % (TEST_KEYS + 20)) - 10;
+        int upper = lower + (round % 4 == 0 ? (int)(test_rand() % TEST_KEYS) : (int)(test_rand() % 100));
+        CHECK(scan_matches(lower, upper));
+        if (round % 10 == 0) {
+            char *expected = expected_range_search(lower, upper);
+            printed = capture_range_search(lower, upper);
+            CHECK(strcmp(printed, expected) == 0);
+            free(expected);
+            free(printed);
+        }
+    }
+    CHECK(scan_matches(INT_MIN, INT_MAX));
+    CHECK(scan_matches(10, 5));
+    CHECK(scan_matches(1000, 1999));
+
+    unpack_tree();
+    CHECK(packed_tree == NULL);
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(aggregates_match());
+
+    // Writes, and reads other than lookups, unpack the records first.
+    CHECK(pack_tree() == 1);
+    CHECK(aggregates_match() && packed_tree == NULL);
+    CHECK(pack_tree() == 1);
+    CHECK(model_insert(1500) == 1 && packed_tree == NULL);
+    CHECK(pack_tree() == 1);
+    CHECK(model_delete(999) == 1 && packed_tree == NULL);
+    CHECK(pack_tree() == 1);
+    long in_range = 0;
+    for (int key = 2000; key <= 2100; key++) {
+        in_range += present[key];
+    }
+    CHECK(model_delete_range(2000, 2100) == in_range && packed_tree == NULL);
+    CHECK(pack_tree() == 1);
+    double mass = test_mass(1600);
+    Element *batch[1] = {test_element(1600, mass)};
+    CHECK(insert_batch(batch, 1, UPSERT_KEEP) == 1 && packed_tree == NULL);
+    present[1600] = 1;
+    masses[1600] = mass;
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+
+    // A checkpoint taken while packed saves every record.
+    char log_path[64];
+    char snapshot_path[64];
+    temp_path(log_path, sizeof(log_path), ".wal");
+    temp_path(snapshot_path, sizeof(snapshot_path), ".wal.snap");
+    remove(log_path);
+    remove(snapshot_path);
+    CHECK(pack_tree() == 1);
+    CHECK(wal_open(log_path, snapshot_path, 1, 0, 0));
+    CHECK(wal_checkpoint());
+    wal_close();
+    static Reference checkpointed;
+    save_reference(&checkpointed);
+    reset();
+    memcpy(present, checkpointed.present, sizeof(present));
+    memcpy(masses, checkpointed.masses, sizeof(masses));
+    mapped_snapshot = snapshot_open(snapshot_path, 1);
+    CHECK(mapped_snapshot != NULL);
+    snapshot_materialize();
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    remove(log_path);
+    remove(snapshot_path);
+
+    // Key gaps that take every varint length.
+    reset();
+    int keys[] = {INT_MIN, INT_MIN + 1, -70000, -1, 0, 127, 128, 20000, 3000000, INT_MAX};
+    int num_keys = (int)(sizeof(keys) / sizeof(keys[0]));
+    for (int i = 0; i < num_keys; i++) {
+        CHECK(insert(create_element(keys[i], "Xy", "Wide", keys[i] / 2.0)));
+    }
+    CHECK(pack_tree() == 1);
+    for (int i = 0; i < num_keys; i++) {
+        Element *element = search(keys[i]);
+        CHECK(element != NULL && element->atomic_number == keys[i] && element->atomic_mass == keys[i] / 2.0 &&
+              strcmp(element->name, "Wide") == 0 && strcmp(element->symbol, "Xy") == 0);
+        CHECK(search(keys[i] == INT_MAX ? keys[i] - 1 : keys[i] + 2) == NULL);
+    }
+    unpack_tree();
+    CHECK(root != NULL && root->stats.count == num_keys);
+}
+
+
+// Cached ranges match the reference, are answered again without a scan, and
+// are dropped by writes inside them but not by writes elsewhere.
+static void test_result_cache(void) {
+    result_cache_enable(4, 4 * 64);
+    for (int key = 0; key < TEST_KEYS; key++) {
+        if (key % 3 != 0) {
+            model_insert(key);
+        }
+    }
+    uint64_t hits = result_cache.hits;
+    uint64_t misses = result_cache.misses;
+    CHECK(scan_matches(100, 130));
+    CHECK(result_cache.misses == misses + 1 && result_cache.count == 1);
+    CHECK(scan_matches(100, 130));
+    char *expected = expected_range_search(100, 130);
+    char *printed = capture_range_search(100, 130);
+    CHECK(strcmp(printed, expected) == 0);
+    free(expected);
+    free(printed);
+    CHECK(result_cache.hits == hits + 2 && result_cache.misses == misses + 1);
+
+    // Writes outside the range leave it cached; inside, they drop it.
+    uint64_t invalidations = result_cache.invalidations;
+    CHECK(model_insert(99) && model_delete(131) == 1);
+    CHECK(scan_matches(100, 130) && result_cache.hits == hits + 3);
+    CHECK(model_insert(102));
+    CHECK(result_cache.invalidations == invalidations + 1 && result_cache.count == 0);
+    CHECK(scan_matches(100, 130) && result_cache.misses == misses + 2);
+    CHECK(model_delete(130) == 1);
+    CHECK(scan_matches(100, 130) && result_cache.misses == misses + 3);
+    CHECK(model_delete_range(110, 115) == 4);
+    CHECK(scan_matches(100, 130) && result_cache.misses == misses + 4);
+    CHECK(scan_matches(100, 130) && result_cache.hits == hits + 4);
+
+    // Results over max_records / RESULT_CACHE_ENTRY_SHARE are not kept, and
+    // the least recently used entry makes room.
+    CHECK(scan_matches(0, 200));
+    CHECK(scan_matches(0, 200) && result_cache.hits == hits + 4 && result_cache.count == 1);
+    for (int lower = 1000; lower < 1500; lower += 100) {
+        CHECK(scan_matches(lower, lower + 20));
+    }
+    CHECK(result_cache.count == 4 && result_cache.evictions >= 2);
+    CHECK(scan_matches(1400, 1420) && result_cache.hits == hits + 5);
+    CHECK(check_tree());
+    result_cache_disable();
+    CHECK(!result_cache.enabled && scan_matches(100, 130));
+}
+
+
+// Applies a batch of count records with keys from base up to base + spread
+// (wrapping) to the tree with insert_batch() and to the reference, and
+// checks the number stored.
+static int model_insert_batch(int count, int base, int spread, int policy) {
+    static Element *batch[TEST_KEYS];
+    static char seen[TEST_KEYS];
+    long expected = 0;
+    memset(seen, 0, sizeof(seen));
+    for (int i = 0; i < count; i++) {
+        int key = (base + (int)(test_rand() % spread)) % TEST_KEYS;
+        double mass = test_mass(key);
+        batch[i] = test_element(key, mass);
+        if (policy == UPSERT_REPLACE || !present[key]) {
+            expected += !seen[key];
+            seen[key] = 1;
+            present[key] = 1;
+            masses[key] = mass;
+        }
+    }
+    return insert_batch(batch, count, policy) == expected;
+}
+
+
+// Batches with duplicates among themselves and against the tree, under both
+// policies, from single records to thousands bound for many leaves at once.
+static void test_insert_batch(void) {
+    Element *empty[1];
+    CHECK(insert_batch(empty, 0, UPSERT_KEEP) == 0 && root == NULL);
+    for (int round = 0; round < 120; round++) {
+        int count = 1 + (int)(test_rand() % (round % 3 == 0 ? TEST_KEYS / 2 : 40));
+        int spread = 1 + (int)(test_rand() % TEST_KEYS);
+        int policy = round % 2 ? UPSERT_REPLACE : UPSERT_KEEP;
+        CHECK(model_insert_batch(count, (int)(test_rand() % TEST_KEYS), spread, policy));
+        if (round % 4 == 3) {
+            for (int i = 0; i < 100; i++) {
+                model_delete((int)(test_rand() % TEST_KEYS));
+            }
+        }
+        if (round % 10 == 0) {
+            CHECK(check_tree());
+            CHECK(cursor_matches(INT_MIN, INT_MAX));
+        }
+    }
+    CHECK(check_tree());
+    CHECK(cursor_matches(INT_MIN, INT_MAX));
+    CHECK(aggregates_match());
+
+    // A replaced record stays visible, as it was, to a view opened before.
+    int key = 0;
+    while (!present[key]) {
+        key++;
+    }
+    static Reference before;
+    save_reference(&before);
+    TreeView *view = view_open();
+    CHECK(model_insert_batch(1, key, 1, UPSERT_REPLACE));
+    CHECK(record_matches(search(key), key));
+    CHECK(view_matches(view, &before, key - 10, key + 10));
+    view_close(view);
+    CHECK(check_tree());
+}
+
+
+static int record_is(int key, const char *symbol, const char *name, double mass) {
+    Element *element = search(key);
+    return element != NULL && strcmp(element->symbol, symbol) == 0 && strcmp(element->name, name) == 0 &&
+           element->atomic_mass == mass;
+}
+
+
+// Loads text files: malformed lines are skipped, CRLF and blank lines are
+// accepted, the first record of a number wins, a second load merges into
+// the tree, and a file of several chunks is parsed on several threads.
+static void test_ingest(void) {
+    char path[64];
+    temp_path(path, sizeof(path), ".txt");
+    CHECK(initialize_tree_from_file("/nonexistent/run2-tests.txt") == -1);
+    CHECK(write_file(path, "", 0) && initialize_tree_from_file(path) == 0 && root == NULL);
+
+    const char *text = "1 H Hydrogen 1.008\r\n"
+                       "\r\n"
+                       "2 He Helium\n"
+                       "x Li Lithium 6.94\n"
+                       "3 Lii Lithium 6.94\n"
+                       "4 Be Beryllium 9.012 extra\n"
+                       "5 B Boron 1.0811e1\n"
+                       "1 Hx Duplicate 2.0\n"
+                       "  6\tC\tCarbon\t12.011  \n"
+                       "7 N Nitrogen nan\n"
+                       "-8 O Oxygen 15.999";
+    CHECK(write_file(path, text, strlen(text)));
+    CHECK(initialize_tree_from_file(path) == 4);
+    CHECK(record_is(1, "H", "Hydrogen", 1.008));
+    CHECK(record_is(5, "B", "Boron", 10.811));
+    CHECK(record_is(6, "C", "Carbon", 12.011));
+    CHECK(record_is(-8, "O", "Oxygen", 15.999));
+    CHECK(search(2) == NULL && search(3) == NULL && search(4) == NULL && search(7) == NULL);
+
+    text = "5 Bx Other 1.0\n9 F Fluorine 18.998\n";
+    CHECK(write_file(path, text, strlen(text)));
+    CHECK(initialize_tree_from_file(path) == 1);
+    CHECK(record_is(5, "B", "Boron", 10.811) && record_is(9, "F", "Fluorine", 18.998));
+    CHECK(root->stats.count == 5);
+    reset();
+
+    // Over 2 MB, so several chunks, in shuffled order, with a duplicate of
+    // key 100 first and last in the file.
+    int num_keys = 100000;
+    int *keys = (int *)malloc(num_keys * sizeof(int));
+    for (int i = 0; i < num_keys; i++) {
+        keys[i] = i;
+    }
+    shuffle(keys, num_keys);
+    size_t capacity = (size_t)num_keys * 40 + 64;
+    char *data = (char *)malloc(capacity);
+    size_t length = (size_t)sprintf(data, "100 Zz First 1\n");
+    for (int i = 0; i < num_keys; i++) {
+        length += (size_t)sprintf(data + length, "%d Ab Element%d %d.25\n", keys[i], keys[i], keys[i]);
+    }
+    length += (size_t)sprintf(data + length, "100 Yy Last 2\n");
+    CHECK(length > 2 * INGEST_CHUNK_MIN_BYTES);
+    CHECK(write_file(path, data, length));
+    int saved_threads = scan_threads;
+    scan_threads = 4;
+    CHECK(initialize_tree_from_file(path) == num_keys);
+    scan_threads = saved_threads;
+    CHECK(record_is(100, "Zz", "First", 1.0));
+    Cursor cursor;
+    Element *element;
+    int key = 0;
+    int ok = 1;
+    cursor_seek(&cursor, INT_MIN, INT_MAX);
+    while ((element = cursor_next(&cursor)) != NULL) {
+        char name[30];
+        snprintf(name, sizeof(name), "Element%d", key);
+        ok = ok && element->atomic_number == key &&
+             (key == 100 || (strcmp(element->name, name) == 0 && element->atomic_mass == key + 0.25));
+        key++;
+    }
+    CHECK(ok && key == num_keys && root->stats.count == num_keys);
+    free(data);
+    free(keys);
+    unlink(path);
+}
+
+
+Test tests[] = {
+    {"insert_search_delete", test_insert_search_delete},
+    {"split_merge_boundaries", test_split_merge_boundaries},
+    {"bulk_load", test_bulk_load},
+    {"range_scans", test_range_scans},
+    {"snapshot", test_snapshot},
+    {"concurrent", test_concurrent},
+    {"wal", test_wal},
+    {"aggregates", test_aggregates},
+    {"delete_range", test_delete_range},
+    {"views", test_views},
+    {"packed", test_packed},
+    {"result_cache", test_result_cache},
+    {"insert_batch", test_insert_batch},
+    {"ingest", test_ingest},
+};
+
+
+int main(int argc, char **argv) {
+    int num_run = 0;
+    for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+        int selected = argc == 1;
+        for (int i = 1; i < argc; i++) {
+            selected = selected || strstr(tests[t].name, argv[i]) != NULL;
+        }
+        if (!selected) {
+            continue;
+        }
+        int failures_before = failures;
+        current_test = tests[t].name;
+        reset();
+        tests[t].run();
+        reset();
+        printf("%-28s %s\n", tests[t].name, failures == failures_before ? "ok" : "FAILED");
+        num_run++;
+    }
+    printf("%d tests, %d checks, %d failed (node order %d)\n", num_run, checks, failures, MAX_ELEMENTS);
+    return failures != 0;
+}